@@ -4,6 +4,7 @@
 #include <QWidget>
 
 #include "src/image_processor.h"
+#include "src/map_exporter.h"
 #include "src/open_gl_widget.h"
 #include "src/project.h"
 
@@ -18,8 +19,7 @@ class ExportWidget : public QWidget
 
 public:
   explicit ExportWidget(QWidget *parent = nullptr);
-  bool ExportMap(TextureTypes type, ImageProcessor *p, QString postfix, QString destination = "", bool useAlpha = false);
-  QImage rearrangeFrames(QImage n, ImageProcessor *p);
+  ExportOptions exportOptions();
 
   QList<ImageProcessor *> processorList;
   QList<ImageProcessor *> selectedProcessors;
@@ -132,7 +132,6 @@ void NBSelector::setNeighbor(int x, int y)
     QString filename = imagesList->currentItem()->data(Qt::UserRole).toString();
     bool success;
     image = il->loadImage(filename, &success);
-    image = image.convertToFormat(QImage::Format_RGBA8888);
   }
 
   processor->set_neighbour_image(image, x, y);
@@ -212,7 +211,6 @@ void NBSelector::on_addImagePushButton_pressed()
   {
     bool success;
     QImage image = il->loadImage(fileName, &success);
-    image = image.convertToFormat(QImage::Format_RGBA8888);
     QListWidgetItem *item = new QListWidgetItem;
     item->setIcon(QPixmap::fromImage(image));
     item->setData(Qt::UserRole, fileName);
@@ -19,13 +19,13 @@
 
 #include "gui/presets_manager.h"
 #include "main_window.h"
+#include "src/cli.h"
 #include "src/image_processor.h"
 
 #include <QApplication>
 #include <QCommandLineParser>
 #include <QDebug>
 #include <QDir>
-#include <QFile>
 #include <QOpenGLContext>
 #include <QSplashScreen>
 #include <QStandardPaths>
@@ -33,19 +33,16 @@
 
 #define cimg_use_openmp 1
 
-QCoreApplication *createApplication(int &argc, char *argv[])
-{
-  for (int i = 1; i < argc; ++i)
-    if (!qstrcmp(argv[i], "--no-gui"))
-      return new QCoreApplication(argc, argv);
-
-  return new QApplication(argc, argv);
-}
-
 int main(int argc, char *argv[])
 {
+  Cli::mark_start();
   QCoreApplication::setApplicationName("laigter");
   QCoreApplication::setApplicationVersion("1.10.7-beta");
+
+  /* Batch, watch, serve and export modes skip all the gui setup below */
+  if (Cli::is_headless(argc, argv))
+    return Cli::run(argc, argv);
+
   //QCoreApplication::setAttribute(Qt::AA_EnableHighDpiScaling);
   QCoreApplication::setAttribute(Qt::AA_ShareOpenGLContexts);
 
@@ -81,142 +78,66 @@ int main(int argc, char *argv[])
                                 "Use software opengl renderer.");
   argsParser.addOption(softOpenGl);
 
-  QCommandLineOption noGuiOption(QStringList() << "g"
-                                               << "no-gui",
-                                 "do not start graphical interface");
-  argsParser.addOption(noGuiOption);
-
-  QCommandLineOption inputDiffuseTextureOption(QStringList() << "d"
-                                                             << "diffuse",
-                                               "diffuse texture to load",
-                                               "diffuse texture path");
-  argsParser.addOption(inputDiffuseTextureOption);
-
-  QCommandLineOption outputNormalTextureOption(QStringList() << "n"
-                                                             << "normal",
-                                               "generate normals");
-  argsParser.addOption(outputNormalTextureOption);
-
-  QCommandLineOption outputSpecularTextureOption(QStringList() << "c"
-                                                               << "specular",
-                                                 "generate specular");
-  argsParser.addOption(outputSpecularTextureOption);
-
-  QCommandLineOption outputOcclusionTextureOption(QStringList()
-                                                      << "o"
-                                                      << "occlusion",
-                                                  "generate occlusion");
-  argsParser.addOption(outputOcclusionTextureOption);
-
-  QCommandLineOption outputParallaxTextureOption(QStringList() << "p"
-                                                               << "parallax",
-                                                 "generate parallax");
-  argsParser.addOption(outputParallaxTextureOption);
-
-  QCommandLineOption pressetOption(QStringList() << "r"
-                                                 << "preset",
-                                   "presset to load", "preset file path");
-  argsParser.addOption(pressetOption);
+  CommonOptions common;
+  common.add_to(&argsParser);
+
+  argsParser.addPositionalArgument("project", "project to open, see --no-gui --help for batch processing", "[project]");
 
   QSurfaceFormat fmt;
   fmt.setDepthBufferSize(24);
   fmt.setSamples(16);
   fmt.setProfile(QSurfaceFormat::CompatibilityProfile);
   QSurfaceFormat::setDefaultFormat(fmt);
-  QScopedPointer<QCoreApplication> app(createApplication(argc, argv));
+  QApplication app(argc, argv);
 
-  argsParser.process(*app.data());
-  QImage auximage;
+  argsParser.process(app);
+  common.apply(argsParser);
 
+  /* A diffuse given on the command line is opened; its maps are written
+   * without gui (see Cli::is_headless) */
   ImageProcessor *processor = new ImageProcessor();
-
   bool success = false;
-  QString inputDiffuseTextureOptionValue =
-      argsParser.value(inputDiffuseTextureOption);
-  if (!inputDiffuseTextureOptionValue.trimmed().isEmpty())
+  QString diffuse_path = argsParser.value(common.diffuse);
+  if (!diffuse_path.trimmed().isEmpty())
   {
-    QFileInfo info(inputDiffuseTextureOptionValue);
-    QString suffix =
-        info.suffix(); // just the last suffix, not the complete one
-
-    QString pressetOptionValue = argsParser.value(pressetOption);
     ImageLoader il;
-    auximage = il.loadImage(inputDiffuseTextureOptionValue, &success);
-    auximage =
-        auximage.convertToFormat(QImage::Format_RGBA8888_Premultiplied);
-    if (!pressetOptionValue.trimmed().isEmpty())
+    QImage image = il.loadImage(diffuse_path, &success);
+    QString preset_path = argsParser.value(common.preset);
+    if (!preset_path.trimmed().isEmpty())
     {
       processor->recalculate_timer.stop();
-      PresetsManager::applyPresets(pressetOptionValue, *processor);
-    }
-    processor->loadImage(inputDiffuseTextureOptionValue, auximage);
-
-    QString pathWithoutExtension =
-        info.absoluteFilePath().remove("." + suffix);
-    if (argsParser.isSet(outputNormalTextureOption))
-    {
-      QImage normal = *processor->get_normal();
-      QString name = pathWithoutExtension + "_n." + suffix;
-      normal.save(name);
-    }
-
-    if (argsParser.isSet(outputSpecularTextureOption))
-    {
-      QImage specular = *processor->get_specular();
-      QString name = pathWithoutExtension + "_s." + suffix;
-      specular.save(name);
-    }
-
-    if (argsParser.isSet(outputOcclusionTextureOption))
-    {
-      QImage occlusion = *processor->get_occlusion();
-      QString name = pathWithoutExtension + "_o." + suffix;
-      occlusion.save(name);
-    }
-
-    if (argsParser.isSet(outputParallaxTextureOption))
-    {
-      QImage parallax = *processor->get_parallax();
-      QString name = pathWithoutExtension + "_p." + suffix;
-      parallax.save(name);
+      PresetsManager::applyPresets(preset_path, *processor);
     }
+    processor->loadImage(diffuse_path, image);
   }
 
-  QApplication *a = qobject_cast<QApplication *>(app.data());
-  int returnCode;
-  if (a)
+  bool softOpenGlValue = argsParser.isSet(softOpenGl);
+  if (softOpenGlValue)
   {
-    bool softOpenGlValue = argsParser.isSet(softOpenGl);
-    if (softOpenGlValue)
-    {
-      a->setAttribute(Qt::AA_UseSoftwareOpenGL);
-      qDebug() << "Soft OpenGL";
-    }
-    MainWindow w;
-    QGuiApplication::setWindowIcon(QIcon(":/images/laigter_icon.png"));
-
-    w.show();
-    qRegisterMetaType<ProcessedImage>("ProcessedImage");
+    app.setAttribute(Qt::AA_UseSoftwareOpenGL);
+    qDebug() << "Soft OpenGL";
+  }
+  MainWindow w;
+  QGuiApplication::setWindowIcon(QIcon(":/images/laigter_icon.png"));
 
-    if (success)
-      w.add_processor(processor);
-    else
-      delete processor;
+  w.show();
+  qRegisterMetaType<ProcessedImage>("ProcessedImage");
 
-    /* Load Project if dropped. Only supports one project */
-    if (argsParser.positionalArguments().count() > 0)
-    {
-      QString project_path = argsParser.positionalArguments().at(0);
-      w.LoadProject(project_path);
-    }
+  if (success)
+    w.add_processor(processor);
+  else
+    delete processor;
 
-    returnCode = app->exec();
+  /* Load Project if dropped. Only supports one project */
+  if (argsParser.isSet(common.project))
+  {
+    w.LoadProject(argsParser.value(common.project));
   }
-  else
+  else if (argsParser.positionalArguments().count() > 0)
   {
-    // do CLI only things here
-    returnCode = 0;
+    QString project_path = argsParser.positionalArguments().at(0);
+    w.LoadProject(project_path);
   }
 
-  return returnCode;
+  return app.exec();
 }
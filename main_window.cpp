@@ -46,6 +46,7 @@
 #include <QPluginLoader>
 #include <QStandardPaths>
 #include <QtConcurrent/QtConcurrent>
+#include <cstring>
 
 #include <QtNetwork>
 QNetworkAccessManager manager;
@@ -165,6 +166,14 @@ MainWindow::MainWindow(QWidget *parent)
   connect(ui->openGLPreviewWidget, SIGNAL(stopAddingLight()), this, SLOT(stopAddingLight()));
   connect(ui->openGLPreviewWidget, SIGNAL(set_enabled_map_controls(bool)), this, SLOT(set_enabled_map_controls(bool)));
   connect(ui->openGLPreviewWidget, SIGNAL(set_enabled_light_controls(bool)), this, SLOT(set_enabled_light_controls(bool)));
+  connect(&project, SIGNAL(save_progress(int, int)), this, SLOT(project_save_progress(int, int)));
+  connect(&project, SIGNAL(save_finished(bool, QString)), this, SLOT(project_saved(bool, QString)));
+
+  import_watcher = nullptr;
+  import_total = imported = 0;
+  import_selected = false;
+  background_timer.setInterval(100);
+  connect(&background_timer, SIGNAL(timeout()), this, SLOT(build_background_maps()));
 
   tabifyDockWidget(ui->normalDockWidget, ui->specularDockWidget);
   tabifyDockWidget(ui->normalDockWidget, ui->parallaxDockWidget);
@@ -223,6 +232,11 @@ MainWindow::MainWindow(QWidget *parent)
 
 MainWindow::~MainWindow()
 {
+  cancel_import();
+  background_timer.stop();
+  background_maps.clear();
+  foreach (ImageProcessor *p, processorList)
+    p->stop_maps();
   QSettings settings("Azagaya", "Laigter");
   settings.setValue("geometry", saveGeometry());
   settings.setValue("windowState", saveState());
@@ -290,6 +304,7 @@ void MainWindow::remove_processor(ImageProcessor *p)
   }
 
   fs_watcher.removePaths(paths);
+  background_maps.removeAll(p);
 
   for (int i = 0; i < ui->listWidget->count(); i++)
   {
@@ -306,6 +321,8 @@ void MainWindow::remove_processor(ImageProcessor *p)
     on_listWidget_itemSelectionChanged();
   }
   processorList.removeOne(p);
+  /* Its background rebuild may still be queued on the pool */
+  p->stop_maps();
   p->deleteLater();
 
   if (ui->listWidget->selectedItems().count() == 0)
@@ -341,7 +358,6 @@ void MainWindow::list_menu_action_triggered(QAction *action)
     bool success;
     fs_watcher.removePath(p->get_heightmap_path());
     QImage height = il.loadImage(p->get_current_frame()->get_file_name(), &success);
-    height = height.convertToFormat(QImage::Format_RGBA8888_Premultiplied);
     p->loadHeightMap(p->get_name(), height);
   }
   else if (option == tr("Merge Heightmap with previous Sprite"))
@@ -359,6 +375,7 @@ void MainWindow::list_menu_action_triggered(QAction *action)
       QPoint point2 = p2->get_position()->toPoint();
       QPoint point1 = p->get_position()->toPoint();
       QPoint position = QPoint(point2.x(), -point2.y()) - QPoint(h2.width(), h2.height()) / 2 - (QPoint(point1.x(), -point1.y()) - QPoint(h.width(), h.height()) / 2);
+      PixelFormat::expect(h2, h.format(), "merge heightmap");
       painter.drawImage(position, h2);
 
       p->get_current_frame()->set_image(TextureTypes::Heightmap, h);
@@ -375,8 +392,6 @@ void MainWindow::list_menu_action_triggered(QAction *action)
     bool success;
     fs_watcher.removePath(p->get_specular_path());
     QImage specular = il.loadImage(p->get_name(), &success);
-    specular =
-        specular.convertToFormat(QImage::Format_RGBA8888_Premultiplied);
     p->loadSpecularMap(p->get_name(), specular);
   }
 }
@@ -403,7 +418,6 @@ void MainWindow::loadSpecular()
       return;
 
     fs_watcher.addPath(fileName);
-    spec = spec.convertToFormat(QImage::Format_RGBA8888_Premultiplied);
     processor->loadSpecularMap(fileName, spec);
   }
 }
@@ -421,8 +435,6 @@ void MainWindow::loadHeightmap()
       return;
 
     fs_watcher.addPath(fileName);
-    height =
-        height.convertToFormat(QImage::Format_RGBA8888_Premultiplied);
     processor->loadHeightMap(fileName, height);
   }
   ui->openGLPreviewWidget->need_to_update = true;
@@ -433,15 +445,29 @@ void MainWindow::update_scene()
   ui->openGLPreviewWidget->need_to_update = true;
 }
 
-void MainWindow::add_processor(ImageProcessor *p)
+/* List icons are drawn small, so a full size pixmap per sprite is wasted */
+static QImage thumbnail(const QImage &image)
+{
+  const int size = 64;
+  if (image.width() <= size && image.height() <= size)
+    return image;
+  return image.scaled(size, size, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+}
+
+void MainWindow::add_processor(ImageProcessor *p, bool select, QImage icon)
 {
   processorList.append(p);
-  processor = p;
-  on_comboBoxView_currentIndexChanged(ui->comboBoxView->currentIndex());
+  if (icon.isNull())
+    icon = thumbnail(*p->get_texture());
   QListWidgetItem *i = new QListWidgetItem(p->get_name());
   i->setData(Qt::UserRole, p->get_name());
-  i->setIcon(QIcon(QPixmap::fromImage(*p->get_texture())));
+  i->setIcon(QIcon(QPixmap::fromImage(icon)));
   ui->listWidget->addItem(i);
+  if (!select)
+    return;
+
+  processor = p;
+  on_comboBoxView_currentIndexChanged(ui->comboBoxView->currentIndex());
   ui->listWidget->setCurrentRow(ui->listWidget->count() - 1);
 }
 
@@ -467,61 +493,192 @@ ImageProcessor *MainWindow::find_processor(QString name)
   return nullptr;
 }
 
-QStringList MainWindow::FindSimilarFiles(QString file_name, QStringList checkedFiles, QString *prefix)
+struct SequenceFrame
+{
+  QString file;
+  QSize size;
+  QImage image;
+  int slot = -1;
+  bool failed = false;
+};
+
+static void decode_frame(SequenceFrame &f)
+{
+  bool success;
+  f.image = ImageLoader::loadImage(f.file, &success);
+  if (!success || f.image.isNull())
+  {
+    f.failed = true;
+    f.image = QImage();
+  }
+}
+
+/* Decodes the frames of a sequence on the worker pool, straight into their
+ * slot of a single row sheet. Frames are stretched to the largest frame size,
+ * as drawing them into their slot with a painter did. */
+static QImage decode_sequence(const QStringList &files, QStringList *failed, int *frames)
+{
+  QVector<SequenceFrame> list;
+  foreach (QString file, files)
+  {
+    SequenceFrame f;
+    f.file = file;
+    list.append(f);
+  }
+
+  /* Headers are cheap to read; a frame whose size cannot be told from its
+   * header is decoded now */
+  QtConcurrent::blockingMap(list, [](SequenceFrame &f) {
+    f.size = ImageLoader::imageSize(f.file);
+    if (!f.size.isValid())
+    {
+      decode_frame(f);
+      f.size = f.image.size();
+    }
+  });
+
+  QSize frame_size(0, 0);
+  int count = 0;
+  for (SequenceFrame &f : list)
+  {
+    if (f.failed)
+      continue;
+    frame_size = frame_size.expandedTo(f.size);
+    f.slot = count++;
+  }
+
+  QImage sheet(QSize(frame_size.width() * count, frame_size.height()), PixelFormat::canonical);
+  sheet.fill(Qt::transparent);
+  uchar *bits = sheet.bits();
+  int bpl = sheet.bytesPerLine();
+  int row = 4 * frame_size.width();
+
+  QtConcurrent::blockingMap(list, [=](SequenceFrame &f) {
+    if (f.slot < 0)
+      return;
+    if (f.image.isNull())
+      decode_frame(f);
+    if (f.failed)
+      return;
+
+    QImage image = f.image;
+    f.image = QImage();
+    if (image.size() != frame_size)
+      image = image.scaled(frame_size);
+    image = PixelFormat::toCanonical(image, "decode_sequence");
+    for (int y = 0; y < frame_size.height(); y++)
+      memcpy(bits + y * bpl + f.slot * row, image.constScanLine(y), row);
+  });
+
+  /* A frame whose header was readable but whose pixels were not leaves a
+   * hole; close it so the frame count stays right */
+  int k = 0;
+  foreach (const SequenceFrame &f, list)
+  {
+    if (f.failed)
+    {
+      failed->append(f.file);
+      continue;
+    }
+    if (f.slot != k)
+    {
+      for (int y = 0; y < frame_size.height(); y++)
+        memcpy(bits + y * bpl + k * row, bits + y * bpl + f.slot * row, row);
+    }
+    k++;
+  }
+  if (k != count)
+    sheet = sheet.copy(0, 0, k * frame_size.width(), frame_size.height());
+
+  *frames = k;
+  return sheet;
+}
+
+QStringList MainWindow::FindSimilarFiles(QString file_name, const QSet<QString> &checkedFiles, QString *prefix,
+                                         SequenceIndex *index)
 {
   /* Check for auto loading of frames */
+  if (checkedFiles.contains(file_name))
+    return QStringList();
+  return index->sequence(file_name, prefix);
+}
 
-  QStringList similarList;
-  QString postfix;
-  QFileInfo info(file_name);
-  if (!checkedFiles.contains(file_name))
-  {
-    QRegularExpression rx("((\\d+)(?!.*\\d))");
-    QRegularExpressionMatch match = rx.match(info.fileName());
-    QStringList parts = file_name.split("/").last().split(match.captured(0));
-    *prefix = parts.first();
-    postfix = parts.last();
-    QDir dir = info.absoluteDir();
-    if (*prefix != "")
+static ImportJob decode_import(const ImportJob &source)
+{
+  ImportJob job = source;
+  QString fileName = job.files.first();
+  if (job.kind == ImportJob::Single)
+  {
+    bool success;
+    QImage image = ImageLoader::loadImage(fileName, &success);
+    if (success && !image.isNull())
+      job.images.append(image);
+    else
+      job.failed.append(fileName);
+  }
+  else if (job.kind == ImportJob::Sequence)
+  {
+    QImage sheet = decode_sequence(job.files, &job.failed, &job.frames);
+    if (job.frames > 0)
+      job.images.append(sheet);
+  }
+  else
+  {
+    QList<QImage> image_list = ImageLoader::loadImages(fileName);
+    if (image_list.isEmpty())
+      job.failed.append(fileName);
+    else if (QImageReader(fileName).supportsAnimation())
     {
-      foreach (QString file, dir.entryList())
+      QSize frame_size = ImageLoader::maxImagesSize(image_list);
+      /* all frames in a single row */
+      QSize full_size(frame_size.width() * image_list.size(), frame_size.height());
+      QImage sprite(full_size, PixelFormat::canonical);
+      sprite.fill(Qt::transparent);
+      QPainter painter(&sprite);
+      painter.setCompositionMode(QPainter::CompositionMode_Source);
+      int i = 0;
+      foreach (QImage image, image_list)
       {
-        match = rx.match(file);
-
-        QStringList parts = file.split("/").last().split(match.captured(0));
-        if (parts.first() == prefix && parts.last() == postfix)
-        {
-          similarList.append(dir.path() + "/" + file);
-        }
+        QRect rect(i * frame_size.width(), 0, frame_size.width(), frame_size.height());
+        painter.drawImage(rect, image);
+        i++;
       }
+      painter.end();
+      job.images.append(sprite);
+      job.frames = image_list.size();
     }
+    else
+      job.images = image_list;
   }
-  return similarList;
+
+  foreach (const QImage &image, job.images)
+    job.thumbnails.append(thumbnail(image));
+  return job;
 }
 
 void MainWindow::open_files(QStringList fileNames)
 {
-  QImage auximage;
-  QStringList similarFiles, checkedFiles, similarList;
+  /* Only the questions are asked here. The images are decoded on the worker
+   * pool and listed as they arrive */
+  QSet<QString> similarFiles, checkedFiles;
+  QStringList similarList;
   QString prefix;
+  SequenceIndex index;
   foreach (QString fileName, fileNames)
   {
     if (similarFiles.contains(fileName))
       continue;
-    /* Only load similar files as animation if the image doesnt already have multiple frames */
 
     QImageReader reader(fileName);
     QFileInfo info(fileName);
-    QString name = info.baseName();
+    ImportJob job;
+    job.name = info.baseName();
+    job.files.append(fileName);
 
+    /* Only load similar files as animation if the image doesnt already have multiple frames */
     if (reader.imageCount() <= 1)
     {
-      similarList = FindSimilarFiles(fileName, checkedFiles, &prefix);
-
-      if (similarList.count() == 0)
-      {
-        similarList.append(fileName);
-      }
+      similarList = FindSimilarFiles(fileName, checkedFiles, &prefix, &index);
 
       if (similarList.count() > 1)
       {
@@ -534,123 +691,141 @@ void MainWindow::open_files(QStringList fileNames)
 
         if (reply == QMessageBox::No)
         {
-          checkedFiles = similarList;
-          similarList.clear();
-          similarList.append(fileName);
+          checkedFiles = QSet<QString>(similarList.begin(), similarList.end());
         }
         else
         {
-          similarFiles = similarList;
-          name = prefix;
+          similarFiles = QSet<QString>(similarList.begin(), similarList.end());
+          job.kind = ImportJob::Sequence;
+          job.name = prefix;
+          job.files = similarList;
         }
       }
+    }
+    else
+    {
+      job.kind = ImportJob::Multiple;
+    }
+    queued_imports.append(job);
+  }
+  start_import();
+}
 
-      ImageProcessor *p = new ImageProcessor();
-      int i = 1;
-      while (ui->listWidget->findItems(name, Qt::MatchExactly).count())
-        name = info.baseName() + " (" + QString::number(++i) + ")";
+void MainWindow::start_import()
+{
+  /* An import started meanwhile waits for the running one */
+  if (import_watcher || queued_imports.isEmpty())
+    return;
 
-      p->set_name(name);
-      p->copy_settings(processor->get_settings());
+  import_watcher = new QFutureWatcher<ImportJob>(this);
+  connect(import_watcher, SIGNAL(resultReadyAt(int)), this, SLOT(import_ready(int)));
+  connect(import_watcher, SIGNAL(finished()), this, SLOT(import_finished()));
+  import_total = queued_imports.count();
+  imported = 0;
+  import_selected = false;
+  import_failures.clear();
+  ui->statusBar->showMessage(tr("Importing... %1/%2").arg(0).arg(import_total));
+  import_watcher->setFuture(QtConcurrent::mapped(queued_imports, decode_import));
+  queued_imports.clear();
+}
 
-      bool loaded = false;
+void MainWindow::cancel_import()
+{
+  queued_imports.clear();
+  if (!import_watcher)
+    return;
 
-      QList<QImage> image_list;
-      foreach (fileName, similarList)
-      {
-        if (fileName != nullptr)
-        {
-          ImageLoader il;
-          bool success;
-          auximage = il.loadImage(fileName, &success);
-          loaded = loaded || success;
-          if (!success || auximage.isNull())
-          {
-            QMessageBox msgBox;
-            msgBox.setText(tr("Cannot open ") + fileName + ".\n" +
-                           tr("Unsupported or incorrect format."));
-            msgBox.exec();
-            continue;
-          }
-          if (auximage.hasAlphaChannel())
-            auximage = auximage.convertToFormat(
-                QImage::Format_RGBA8888_Premultiplied);
-          image_list.append(auximage);
-        }
-      }
-      QSize frame_size = il.maxImagesSize(image_list);
-      /* all frames in a single row */
-      QSize full_size(frame_size.width() * image_list.size(), frame_size.height());
-      QImage sprite(full_size, QImage::Format_RGBA8888_Premultiplied);
-      sprite.fill(Qt::transparent);
-      QPainter painter(&sprite);
-      painter.setCompositionMode(QPainter::CompositionMode_Source);
+  import_watcher->disconnect(this);
+  import_watcher->cancel();
+  import_watcher->waitForFinished();
+  import_watcher->deleteLater();
+  import_watcher = nullptr;
+  ui->statusBar->clearMessage();
+}
 
-      i = 0;
-      foreach (QImage image, image_list)
-      {
-        image = image.convertToFormat(QImage::Format_RGBA8888_Premultiplied);
-        QRect rect(i * frame_size.width(), 0, frame_size.width(), frame_size.height());
-        painter.drawImage(rect, image);
-        i++;
-      }
-      p->loadImage(similarList[0], sprite);
-      add_processor(p);
-      splitInFrames(image_list.size(), 1, p);
+void MainWindow::import_ready(int index)
+{
+  Q_UNUSED(index);
+  if (sender() != import_watcher)
+    return;
 
-      p->reset_neighbours();
-    }
+  /* Results arrive in any order; the list keeps the order of the files */
+  QFuture<ImportJob> future = import_watcher->future();
+  while (imported < import_total && future.isResultReadyAt(imported))
+    add_imported(future.resultAt(imported++));
+  ui->statusBar->showMessage(tr("Importing... %1/%2").arg(imported).arg(import_total));
+}
+
+void MainWindow::import_finished()
+{
+  if (sender() != import_watcher)
+    return;
+
+  import_ready(imported);
+  import_watcher->deleteLater();
+  import_watcher = nullptr;
+  ui->statusBar->clearMessage();
+
+  if (!import_failures.isEmpty())
+  {
+    QMessageBox msgBox;
+    msgBox.setText(tr("Cannot open ") + import_failures.join(", ") + ".\n" +
+                   tr("Unsupported or incorrect format."));
+    import_failures.clear();
+    msgBox.exec();
+  }
+  start_import();
+}
+
+void MainWindow::add_imported(const ImportJob &job)
+{
+  import_failures.append(job.failed);
+  QFileInfo info(job.files.first());
+  for (int k = 0; k < job.images.count(); k++)
+  {
+    QString name = job.name;
+    int i = 1;
+    while (ui->listWidget->findItems(name, Qt::MatchExactly).count())
+      name = job.name + " (" + QString::number(++i) + ")";
+
+    ImageProcessor *p = new ImageProcessor();
+    p->set_name(name);
+    p->copy_settings(processor->get_settings());
+
+    /* Nothing is computed while loading: the maps are queued for the
+     * background pool, or built at once if the sprite is shown first */
+    p->set_calculation_deferred(true);
+    if (job.images.count() > 1)
+      p->loadImage(info.absolutePath() + "/" + name + "." + info.suffix(), job.images[k]);
     else
-    {
-      QList<QImage> image_list = il.loadImages(fileName);
-      if (reader.supportsAnimation())
-      {
-        QSize frame_size = il.maxImagesSize(image_list);
-        /* all frames in a single row */
-        QSize full_size(frame_size.width() * image_list.size(), frame_size.height());
-        QImage sprite(full_size, QImage::Format_RGBA8888_Premultiplied);
-        sprite.fill(Qt::transparent);
-        QPainter painter(&sprite);
-        painter.setCompositionMode(QPainter::CompositionMode_Source);
-        ImageProcessor *p = new ImageProcessor();
-        int i = 1;
-        while (ui->listWidget->findItems(name, Qt::MatchExactly).count())
-          name = info.baseName() + " (" + QString::number(++i) + ")";
-
-        p->set_name(name);
-        p->copy_settings(processor->get_settings());
-        i = 0;
-        foreach (QImage image, image_list)
-        {
-          image = image.convertToFormat(QImage::Format_RGBA8888_Premultiplied);
-          QRect rect(i * frame_size.width(), 0, frame_size.width(), frame_size.height());
-          painter.drawImage(rect, image);
-          i++;
-        }
-        p->loadImage(fileName, sprite);
-        add_processor(p);
-        splitInFrames(image_list.size(), 1, p);
+      p->loadImage(job.files.first(), job.images[k]);
+    p->defer_maps();
 
-        p->reset_neighbours();
-      }
-      else
-      {
-        foreach (QImage image, image_list)
-        {
-          ImageProcessor *p = new ImageProcessor();
-          int i = 1;
-          while (ui->listWidget->findItems(name, Qt::MatchExactly).count())
-            name = info.baseName() + " (" + QString::number(++i) + ")";
-
-          p->set_name(name);
-          p->copy_settings(processor->get_settings());
-          image = image.convertToFormat(QImage::Format_RGBA8888_Premultiplied);
-          p->loadImage(info.absolutePath() + "/" + name + "." + info.suffix(), image);
-          add_processor(p);
-        }
-      }
+    add_processor(p, !import_selected, job.thumbnails.value(k));
+    import_selected = true;
+    if (job.images.count() == 1)
+    {
+      splitInFrames(job.frames, 1, p);
+      p->reset_neighbours();
     }
+
+    background_maps.append(p);
   }
+
+  if (!background_maps.isEmpty() && !background_timer.isActive())
+    background_timer.start();
+}
+
+void MainWindow::build_background_maps()
+{
+  /* Fed as threads free up, so a sprite selected meanwhile (built on the
+   * shared pool) is never queued behind the rest */
+  QThreadPool *pool = ImageProcessor::background_pool();
+  while (!background_maps.isEmpty() && pool->activeThreadCount() < pool->maxThreadCount())
+    background_maps.takeFirst()->restore_maps_background();
+
+  if (background_maps.isEmpty())
+    background_timer.stop();
 }
 
 void MainWindow::on_actionFitZoom_triggered()
@@ -1050,7 +1225,11 @@ bool MainWindow::ExportMap(TextureTypes type, ImageProcessor *p, QString postfix
   }
   if (useAlpha)
   {
-    n.setAlphaChannel(p->get_texture()->convertToFormat(QImage::Format_Alpha8));
+    PixelFormat::applyAlpha(&n, *p->get_texture());
+  }
+  else
+  {
+    n = MapExporter::file_image(type, n);
   }
   saved &= n.save(name);
 
@@ -1722,6 +1901,7 @@ void MainWindow::LoadProject(QString path)
 {
   QList<ImageProcessor *> newList;
   QJsonObject general_settings;
+  cancel_import();
   /* Remove Current Processors */
   foreach (ImageProcessor *p, processorList)
   {
@@ -1811,7 +1991,21 @@ void MainWindow::SaveProject(QString path)
   {
     p_list.append(find_processor(ui->listWidget->item(i)->text()));
   }
-  project.save(path, p_list, general_settings);
+  /* Written in the background; editing can go on meanwhile */
+  project.save_async(path, p_list, general_settings);
+}
+
+void MainWindow::project_save_progress(int done, int total)
+{
+  ui->statusBar->showMessage(tr("Saving project... %1%").arg(100 * done / qMax(total, 1)));
+}
+
+void MainWindow::project_saved(bool saved, QString path)
+{
+  if (saved)
+    ui->statusBar->showMessage(tr("Project saved to %1").arg(path), 5000);
+  else
+    ui->statusBar->showMessage(tr("Could not save project to %1").arg(path));
 }
 
 void MainWindow::on_blendSlider_valueChanged(int value)
@@ -26,6 +26,7 @@
 #include "src/image_processor.h"
 #include "src/light_source.h"
 #include "src/project.h"
+#include "src/sequence_index.h"
 
 #include "gui/exportwidget.h"
 #include "gui/nb_selector.h"
@@ -34,13 +35,16 @@
 
 #include <QColor>
 #include <QFileSystemWatcher>
+#include <QFutureWatcher>
 #include <QGraphicsScene>
 #include <QList>
 #include <QListWidgetItem>
 #include <QMainWindow>
 #include <QOpenGLWidget>
 #include <QPluginLoader>
+#include <QSet>
 #include <QThread>
+#include <QTimer>
 #include <QVector3D>
 
 namespace Ui
@@ -48,6 +52,29 @@ namespace Ui
 class MainWindow;
 }
 
+/* One entry of a bulk import: a single image, a numbered sequence or a file
+ * holding several images. The worker fills in the decoded part. */
+struct ImportJob
+{
+  enum Kind
+  {
+    Single,
+    Sequence,
+    Multiple
+  };
+
+  Kind kind = Single;
+  QString name;
+  QStringList files;
+
+  /* One image per processor, with its list icon; frames of a sequence or an
+   * animation are already laid out in a single row */
+  QList<QImage> images;
+  QList<QImage> thumbnails;
+  int frames = 1;
+  QStringList failed;
+};
+
 class MainWindow : public QMainWindow
 {
   Q_OBJECT
@@ -79,6 +106,17 @@ private:
   SpritePropertiesDock *sprite_widget;
   NBSelector nbSelector;
   ExportWidget exportWidget;
+  QFutureWatcher<ImportJob> *import_watcher;
+  QList<ImportJob> queued_imports;
+  QStringList import_failures;
+  int import_total, imported;
+  bool import_selected;
+  QList<ImageProcessor *> background_maps;
+  QTimer background_timer;
+
+  void start_import();
+  void cancel_import();
+  void add_imported(const ImportJob &job);
 
 public:
   explicit MainWindow(QWidget *parent = nullptr);
@@ -89,14 +127,15 @@ public:
   void SaveProject(QString path);
   void LoadProject(QString path);
   bool ExportMap(TextureTypes type, ImageProcessor *p, QString postfix, QString destination = "", bool useAlpha = false);
-  QStringList FindSimilarFiles(QString file_name, QStringList checkedFiles, QString *prefix);
+  QStringList FindSimilarFiles(QString file_name, const QSet<QString> &checkedFiles, QString *prefix,
+                               SequenceIndex *index);
 
 public slots:
   ImageProcessor *find_processor(QString name);
   int get_processor_index(ImageProcessor *p);
   void setCurrentItem(QListWidgetItem *i);
   void update_scene();
-  void add_processor(ImageProcessor *p);
+  void add_processor(ImageProcessor *p, bool select = true, QImage icon = QImage());
   void remove_processor(ImageProcessor *p);
   void selectedLightChanged(LightSource *light);
   void stopAddingLight();
@@ -119,6 +158,11 @@ private slots:
   void showContextMenuForListWidget(const QPoint &pos);
   void list_menu_action_triggered(QAction *action);
   void openGL_initialized();
+  void project_save_progress(int done, int total);
+  void project_saved(bool saved, QString path);
+  void import_ready(int index);
+  void import_finished();
+  void build_background_maps();
   void on_actionFitZoom_triggered();
   void on_actionZoom_100_triggered();
   void on_actionZoomIn_triggered();
@@ -0,0 +1,321 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "batch_coordinator.h"
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QFile>
+#include <QHash>
+#include <QJsonDocument>
+#include <QThread>
+#include <algorithm>
+
+BatchCoordinator::BatchCoordinator(QObject *parent) : QObject(parent) {}
+
+BatchCoordinator::~BatchCoordinator()
+{
+  foreach (Worker *w, workers)
+  {
+    if (w->socket)
+      w->socket->disconnect(this);
+
+    /* Only the workers started here are told to quit */
+    if (w->process)
+    {
+      if (w->alive)
+      {
+        QJsonObject quit;
+        quit.insert("command", "quit");
+        send(w, quit);
+        w->socket->waitForBytesWritten(1000);
+      }
+      if (!w->process->waitForFinished(5000))
+        w->process->kill();
+    }
+    else if (w->socket)
+    {
+      w->socket->disconnectFromServer();
+    }
+    delete w;
+  }
+}
+
+QVector<QList<int>> BatchCoordinator::shard(const QVector<qint64> &weights, QList<int> jobs, QVector<qint64> loads)
+{
+  /* Largest job first onto the lightest shard */
+  std::stable_sort(jobs.begin(), jobs.end(), [&weights](int a, int b) {
+    return weights[a] > weights[b];
+  });
+
+  QVector<QList<int>> shards(loads.count());
+  foreach (int job, jobs)
+  {
+    int lightest = 0;
+    for (int i = 1; i < loads.count(); i++)
+    {
+      if (loads[i] < loads[lightest])
+        lightest = i;
+    }
+    shards[lightest] << job;
+    loads[lightest] += weights[job];
+  }
+  return shards;
+}
+
+void BatchCoordinator::set_retries(int r)
+{
+  retries = qMax(0, r);
+}
+
+bool BatchCoordinator::launch(int count, QStringList arguments)
+{
+  QList<Worker *> started;
+  for (int i = 0; i < count; i++)
+  {
+    Worker *w = new Worker;
+    w->name = QString("laigter-worker-%1-%2").arg(QCoreApplication::applicationPid()).arg(i);
+    w->process = new QProcess(this);
+    w->process->setProcessChannelMode(QProcess::ForwardedChannels);
+    w->process->start(QCoreApplication::applicationFilePath(), QStringList() << "--serve" << w->name << arguments);
+    workers << w;
+    started << w;
+  }
+
+  int connected = 0;
+  foreach (Worker *w, started)
+  {
+    if (w->process->waitForStarted() && open(w, connect_timeout_ms))
+      connected++;
+  }
+  qInfo() << connected << "of" << count << "workers started";
+  return connected > 0;
+}
+
+bool BatchCoordinator::connect_to(QStringList names)
+{
+  int connected = 0;
+  foreach (QString name, names)
+  {
+    Worker *w = new Worker;
+    w->name = name.trimmed();
+    workers << w;
+    if (open(w, connect_timeout_ms))
+      connected++;
+  }
+  return connected > 0;
+}
+
+bool BatchCoordinator::open(Worker *w, int timeout_ms)
+{
+  QElapsedTimer timer;
+  timer.start();
+  w->socket = new QLocalSocket(this);
+  while (true)
+  {
+    w->socket->connectToServer(w->name);
+    if (w->socket->waitForConnected(250))
+      break;
+
+    /* Launched workers need a moment before they listen */
+    bool exited = w->process && w->process->state() == QProcess::NotRunning;
+    if (exited || timer.elapsed() > timeout_ms)
+    {
+      qWarning() << "could not connect to worker" << w->name << w->socket->errorString();
+      return false;
+    }
+    w->socket->abort();
+    QThread::msleep(100);
+  }
+
+  connect(w->socket, SIGNAL(readyRead()), this, SLOT(read_replies()));
+  connect(w->socket, SIGNAL(disconnected()), this, SLOT(worker_lost()));
+  w->alive = true;
+  return true;
+}
+
+QVector<BatchResult> BatchCoordinator::run(QList<BatchJob> list)
+{
+  jobs = list;
+  results = QVector<BatchResult>(jobs.count());
+  attempts = QVector<int>(jobs.count(), 0);
+  weights = QVector<qint64>(jobs.count(), 0);
+  finished.clear();
+
+  QHash<QString, QString> presets;
+  QList<int> all;
+  for (int i = 0; i < jobs.count(); i++)
+  {
+    QSize size;
+    weights[i] = BatchEngine::estimate_bytes(jobs[i].input, &size);
+    results[i].input = jobs[i].input;
+    results[i].size = size;
+    results[i].estimate = weights[i];
+
+    /* Workers may not see the same preset files, send the text instead */
+    if (jobs[i].preset_contents.isNull() && !jobs[i].preset.isEmpty())
+    {
+      if (!presets.contains(jobs[i].preset))
+      {
+        QFile file(jobs[i].preset);
+        presets.insert(jobs[i].preset, file.open(QIODevice::ReadOnly) ? QString::fromUtf8(file.readAll()) : QString());
+      }
+      jobs[i].preset_contents = presets.value(jobs[i].preset);
+    }
+    all << i;
+  }
+
+  dispatch(all);
+  if (finished.count() < jobs.count())
+    loop.exec();
+  return results;
+}
+
+QJsonArray BatchCoordinator::report()
+{
+  QJsonArray list;
+  foreach (Worker *w, workers)
+  {
+    QJsonObject o;
+    o.insert("worker", w->name);
+    o.insert("launched", w->process != nullptr);
+    o.insert("alive", w->alive);
+    o.insert("jobs", w->done);
+    o.insert("lost_jobs", w->lost);
+    o.insert("pixels", double(w->pixels));
+    list.append(o);
+  }
+  return list;
+}
+
+void BatchCoordinator::send(Worker *w, const QJsonObject &message)
+{
+  w->socket->write(QJsonDocument(message).toJson(QJsonDocument::Compact) + "\n");
+}
+
+void BatchCoordinator::dispatch(QList<int> list)
+{
+  QList<Worker *> alive;
+  QVector<qint64> loads;
+  foreach (Worker *w, workers)
+  {
+    if (!w->alive)
+      continue;
+    qint64 load = 0;
+    foreach (int job, w->pending)
+      load += weights[job];
+    alive << w;
+    loads << load;
+  }
+
+  if (alive.isEmpty())
+  {
+    foreach (int job, list)
+    {
+      BatchResult r = results[job];
+      r.error = "no worker left to run the job";
+      finish(job, r);
+    }
+    return;
+  }
+
+  QVector<QList<int>> shards = shard(weights, list, loads);
+  for (int i = 0; i < alive.count(); i++)
+  {
+    foreach (int job, shards[i])
+    {
+      QJsonObject request = BatchEngine::job_json(jobs[job]);
+      request.insert("id", job);
+      request.insert("return", "path");
+      alive[i]->pending.insert(job);
+      attempts[job]++;
+      send(alive[i], request);
+    }
+  }
+}
+
+void BatchCoordinator::finish(int job, const BatchResult &result)
+{
+  if (finished.contains(job))
+    return;
+
+  results[job] = result;
+  results[job].input = jobs[job].input;
+  finished.insert(job);
+  if (finished.count() == jobs.count())
+    loop.quit();
+}
+
+BatchCoordinator::Worker *BatchCoordinator::worker_for(QObject *object)
+{
+  foreach (Worker *w, workers)
+  {
+    if (w->socket == object)
+      return w;
+  }
+  return nullptr;
+}
+
+void BatchCoordinator::read_replies()
+{
+  Worker *w = worker_for(sender());
+  if (!w)
+    return;
+
+  while (w->socket->canReadLine())
+  {
+    QJsonObject o = QJsonDocument::fromJson(w->socket->readLine()).object();
+    int job = o.value("id").toInt(-1);
+    if (!o.value("done").toBool() || !w->pending.remove(job))
+      continue;
+
+    BatchResult r = BatchEngine::read_result(o);
+    w->done++;
+    w->pixels += qint64(r.size.width()) * r.size.height();
+    finish(job, r);
+  }
+}
+
+void BatchCoordinator::worker_lost()
+{
+  Worker *w = worker_for(sender());
+  if (!w || !w->alive)
+    return;
+
+  w->alive = false;
+  QList<int> retry;
+  foreach (int job, w->pending)
+  {
+    w->lost++;
+    if (attempts[job] <= retries)
+    {
+      retry << job;
+    }
+    else
+    {
+      BatchResult r = results[job];
+      r.error = "worker lost while running the job";
+      finish(job, r);
+    }
+  }
+  w->pending.clear();
+
+  qWarning() << "lost worker" << w->name << "," << retry.count() << "jobs sent to other workers";
+  dispatch(retry);
+}
@@ -0,0 +1,95 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+
+#ifndef BATCHCOORDINATOR_H
+#define BATCHCOORDINATOR_H
+
+#include "batch_engine.h"
+
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QJsonArray>
+#include <QList>
+#include <QLocalSocket>
+#include <QObject>
+#include <QProcess>
+#include <QSet>
+#include <QVector>
+
+/* Splits a batch across several --serve workers, either processes it
+ * launches itself or instances that are already running. Jobs carry file
+ * paths, not pixels, so every worker must run on this machine or see the
+ * same paths; a forwarded socket alone is not enough. Jobs are sharded
+ * by pixel count, largest first onto the lightest shard. When a worker dies
+ * or disconnects, its unfinished jobs are sharded again over the workers
+ * left, up to the retry limit. */
+class BatchCoordinator : public QObject
+{
+  Q_OBJECT
+
+public:
+  static const int connect_timeout_ms = 10000;
+
+public:
+  explicit BatchCoordinator(QObject *parent = nullptr);
+  ~BatchCoordinator();
+
+  static QVector<QList<int>> shard(const QVector<qint64> &weights, QList<int> jobs, QVector<qint64> loads);
+
+  void set_retries(int r);
+  bool launch(int count, QStringList arguments);
+  bool connect_to(QStringList names);
+  QVector<BatchResult> run(QList<BatchJob> jobs);
+  QJsonArray report();
+
+private slots:
+  void read_replies();
+  void worker_lost();
+
+private:
+  struct Worker
+  {
+    QString name;
+    QLocalSocket *socket = nullptr;
+    QProcess *process = nullptr;
+    QSet<int> pending;
+    int done = 0;
+    int lost = 0;
+    qint64 pixels = 0;
+    bool alive = false;
+  };
+
+  bool open(Worker *w, int timeout_ms);
+  void send(Worker *w, const QJsonObject &message);
+  void dispatch(QList<int> jobs);
+  void finish(int job, const BatchResult &result);
+  Worker *worker_for(QObject *object);
+
+  QList<Worker *> workers;
+  QList<BatchJob> jobs;
+  QVector<qint64> weights;
+  QVector<BatchResult> results;
+  QVector<int> attempts;
+  QSet<int> finished;
+  QEventLoop loop;
+  int retries = 2;
+};
+
+#endif // BATCHCOORDINATOR_H
@@ -0,0 +1,697 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "batch_engine.h"
+#include "image_loader.h"
+#include "image_processor.h"
+#include "map_cache.h"
+#include "map_exporter.h"
+#include "memory_budget.h"
+#include "pixel_format.h"
+#include "presets.h"
+#include "tar_writer.h"
+
+#include <QBuffer>
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QSet>
+#include <QThread>
+#include <QThreadPool>
+#include <QtConcurrent/QtConcurrent>
+#include <algorithm>
+
+/* Diffuse, maps and float planes kept alive while one image is processed */
+static const qint64 bytes_per_pixel = 64;
+static const qint64 memory_unit = 1024 * 1024;
+
+static const QList<TextureTypes> &map_types()
+{
+  static const QList<TextureTypes> types = QList<TextureTypes>()
+                                           << TextureTypes::Normal << TextureTypes::Specular
+                                           << TextureTypes::Occlussion << TextureTypes::Parallax;
+  return types;
+}
+
+QString BatchEngine::map_name(TextureTypes type)
+{
+  switch (type)
+  {
+    case TextureTypes::Normal:
+      return "normal";
+    case TextureTypes::Specular:
+      return "specular";
+    case TextureTypes::Occlussion:
+      return "occlusion";
+    case TextureTypes::Parallax:
+      return "parallax";
+    default:
+      return "";
+  }
+}
+
+bool BatchEngine::map_from_name(QString name, TextureTypes *type)
+{
+  foreach (TextureTypes t, map_types())
+  {
+    if (map_name(t) == name.toLower())
+    {
+      *type = t;
+      return true;
+    }
+  }
+  return false;
+}
+
+static QImage processor_map(ImageProcessor *p, TextureTypes type)
+{
+  switch (type)
+  {
+    case TextureTypes::Normal:
+      return *p->get_normal();
+    case TextureTypes::Specular:
+      return *p->get_specular();
+    case TextureTypes::Occlussion:
+      return *p->get_occlusion();
+    case TextureTypes::Parallax:
+      return *p->get_parallax();
+    default:
+      return QImage();
+  }
+}
+
+static QByteArray encode_png(TextureTypes type, QImage map, QImage alpha)
+{
+  if (!alpha.isNull())
+    PixelFormat::applyAlpha(&map, alpha);
+  else
+    map = MapExporter::file_image(type, map);
+
+  QByteArray data;
+  QBuffer buffer(&data);
+  buffer.open(QIODevice::WriteOnly);
+  map.save(&buffer, "PNG");
+  return data;
+}
+
+class BatchTask : public QRunnable
+{
+public:
+  BatchTask(BatchEngine *engine, const BatchJob &job, BatchResult *result, QSemaphore *memory, int units)
+      : engine(engine), job(job), result(result), memory(memory), units(units) {}
+
+  void run() override
+  {
+    QElapsedTimer timer;
+    timer.start();
+    if (units > 0)
+      memory->acquire(units);
+    result->wait_ms = timer.restart();
+
+    engine->process(job, result);
+    result->process_ms = timer.elapsed();
+
+    if (units > 0)
+      memory->release(units);
+  }
+
+private:
+  BatchEngine *engine;
+  BatchJob job;
+  BatchResult *result;
+  QSemaphore *memory;
+  int units;
+};
+
+BatchEngine::BatchEngine(BatchOptions options) : options(options), first_map(-1)
+{
+  clock.start();
+  /* Created here so its timer lives in the main thread, not in a worker */
+  MemoryBudget::instance();
+  preset_contents(options.preset);
+}
+
+QString BatchEngine::map_postfix(TextureTypes type)
+{
+  switch (type)
+  {
+    case TextureTypes::Normal:
+      return "_n";
+    case TextureTypes::Specular:
+      return "_s";
+    case TextureTypes::Occlussion:
+      return "_o";
+    case TextureTypes::Parallax:
+      return "_p";
+    default:
+      return "";
+  }
+}
+
+QStringList BatchEngine::expand_inputs(QStringList patterns)
+{
+  QStringList image_filters;
+  foreach (QByteArray format, QImageReader::supportedImageFormats())
+    image_filters << "*." + QString(format);
+  image_filters << "*.tga";
+
+  QStringList files;
+  foreach (QString pattern, patterns)
+  {
+    if (pattern.trimmed().isEmpty())
+      continue;
+
+    QFileInfo info(pattern);
+    QStringList found;
+    if (info.isDir())
+    {
+      QDir dir(pattern);
+      foreach (QString name, dir.entryList(image_filters, QDir::Files, QDir::Name))
+        found << dir.filePath(name);
+    }
+    else if (pattern.contains(QRegExp("[*?\\[]")))
+    {
+      QDir dir(info.path());
+      foreach (QString name, dir.entryList(QStringList() << info.fileName(), QDir::Files, QDir::Name))
+        found << dir.filePath(name);
+    }
+    else
+    {
+      files << pattern;
+      continue;
+    }
+
+    /* Expanded sets would otherwise pick up maps written by a previous run */
+    QSet<QString> bases;
+    foreach (QString f, found)
+    {
+      QFileInfo fi(f);
+      bases.insert(fi.path() + "/" + fi.completeBaseName());
+    }
+    foreach (QString f, found)
+    {
+      QFileInfo fi(f);
+      QString base = fi.path() + "/" + fi.completeBaseName();
+      bool generated = false;
+      foreach (TextureTypes type, map_types())
+      {
+        QString postfix = map_postfix(type);
+        if (base.endsWith(postfix) && bases.contains(base.left(base.length() - postfix.length())))
+          generated = true;
+      }
+      if (!generated)
+        files << f;
+    }
+  }
+  files.removeDuplicates();
+  return files;
+}
+
+void BatchEngine::read_job(const QJsonObject &o, const QDir &base, BatchJob *job)
+{
+  if (o.contains("input"))
+    job->input = base.absoluteFilePath(o.value("input").toString());
+  if (o.contains("preset"))
+    job->preset = base.absoluteFilePath(o.value("preset").toString());
+  if (o.contains("output_dir"))
+    job->output_dir = base.absoluteFilePath(o.value("output_dir").toString());
+  if (o.contains("alpha"))
+    job->use_alpha = o.value("alpha").toBool();
+  if (o.contains("memory_mb"))
+    job->memory_cap = qint64(o.value("memory_mb").toDouble()) * memory_unit;
+
+  if (o.contains("maps"))
+  {
+    job->maps.clear();
+    foreach (QJsonValue v, o.value("maps").toArray())
+    {
+      TextureTypes type;
+      if (map_from_name(v.toString(), &type))
+        job->maps << type;
+      else
+        qWarning() << "unknown map" << v.toString();
+    }
+  }
+
+  QJsonObject postfixes = o.value("postfixes").toObject();
+  foreach (QString key, postfixes.keys())
+  {
+    TextureTypes type;
+    if (map_from_name(key, &type))
+      job->postfixes[type] = postfixes.value(key).toString();
+  }
+}
+
+QJsonObject BatchEngine::job_json(const BatchJob &job)
+{
+  /* Inverse of read_job, paths are sent absolute */
+  QJsonObject o;
+  o.insert("input", QFileInfo(job.input).absoluteFilePath());
+  if (!job.preset.isEmpty())
+    o.insert("preset", QFileInfo(job.preset).absoluteFilePath());
+  if (!job.preset_contents.isNull())
+    o.insert("preset_string", job.preset_contents);
+  if (!job.output_dir.isEmpty())
+    o.insert("output_dir", QFileInfo(job.output_dir).absoluteFilePath());
+  o.insert("alpha", job.use_alpha);
+  if (job.memory_cap > 0)
+    o.insert("memory_mb", double(job.memory_cap / memory_unit));
+
+  QJsonArray maps;
+  foreach (TextureTypes type, job.maps)
+    maps.append(map_name(type));
+  o.insert("maps", maps);
+
+  QJsonObject postfixes;
+  foreach (TextureTypes type, job.postfixes.keys())
+    postfixes.insert(map_name(type), job.postfixes.value(type));
+  if (!postfixes.isEmpty())
+    o.insert("postfixes", postfixes);
+  return o;
+}
+
+bool BatchEngine::load_manifest(QString path, BatchOptions *options, QList<BatchJob> *jobs, QString *error)
+{
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly))
+  {
+    *error = "could not open " + path;
+    return false;
+  }
+
+  QJsonParseError e;
+  QJsonDocument doc = QJsonDocument::fromJson(file.readAll(), &e);
+  if (e.error != QJsonParseError::NoError)
+  {
+    *error = path + ": " + e.errorString() + " at offset " + QString::number(e.offset);
+    return false;
+  }
+
+  /* Either a bare list of jobs or an object with defaults and jobs */
+  QJsonObject root = doc.object();
+  QJsonArray list = doc.isArray() ? doc.array() : root.value("jobs").toArray();
+  QDir base = QFileInfo(path).absoluteDir();
+
+  if (root.contains("parallel"))
+    options->parallel = root.value("parallel").toInt();
+  if (root.contains("memory_limit_mb"))
+    options->memory_limit = qint64(root.value("memory_limit_mb").toDouble()) * memory_unit;
+
+  BatchJob defaults;
+  defaults.preset = options->preset;
+  defaults.output_dir = options->output_dir;
+  defaults.maps = options->maps;
+  read_job(root.value("defaults").toObject(), base, &defaults);
+
+  for (int i = 0; i < list.count(); i++)
+  {
+    BatchJob job = defaults;
+    if (list.at(i).isString())
+      job.input = base.absoluteFilePath(list.at(i).toString());
+    else
+      read_job(list.at(i).toObject(), base, &job);
+
+    if (job.input.isEmpty())
+    {
+      *error = path + ": job " + QString::number(i) + " has no input";
+      return false;
+    }
+    jobs->append(job);
+  }
+  return true;
+}
+
+QJsonObject BatchEngine::result_json(const BatchResult &r)
+{
+  QJsonObject o;
+  o.insert("input", r.input);
+  o.insert("ok", r.ok);
+  if (!r.ok)
+    o.insert("error", r.error);
+  o.insert("outputs", QJsonArray::fromStringList(r.outputs));
+  o.insert("cached", r.cached);
+  o.insert("width", r.size.width());
+  o.insert("height", r.size.height());
+  o.insert("estimate_bytes", double(r.estimate));
+  o.insert("wait_ms", double(r.wait_ms));
+  o.insert("process_ms", double(r.process_ms));
+  return o;
+}
+
+BatchResult BatchEngine::read_result(const QJsonObject &o)
+{
+  BatchResult r;
+  r.input = o.value("input").toString();
+  r.ok = o.value("ok").toBool();
+  r.error = o.value("error").toString();
+  foreach (QJsonValue v, o.value("outputs").toArray())
+    r.outputs << v.toString();
+  r.cached = o.value("cached").toBool();
+  r.size = QSize(o.value("width").toInt(), o.value("height").toInt());
+  r.estimate = qint64(o.value("estimate_bytes").toDouble());
+  r.wait_ms = qint64(o.value("wait_ms").toDouble());
+  r.process_ms = qint64(o.value("process_ms").toDouble());
+  return r;
+}
+
+bool BatchEngine::write_summary(QString path, const QVector<BatchResult> &results, qint64 wall_ms,
+                                const QJsonArray &workers)
+{
+  QJsonArray list;
+  int failed = 0;
+  foreach (const BatchResult &r, results)
+  {
+    list.append(result_json(r));
+    failed += r.ok ? 0 : 1;
+  }
+
+  QJsonObject root;
+  root.insert("jobs", list);
+  root.insert("total", results.count());
+  root.insert("failed", failed);
+  root.insert("wall_ms", double(wall_ms));
+  if (!workers.isEmpty())
+    root.insert("workers", workers);
+
+  QByteArray data = QJsonDocument(root).toJson();
+  QFile file(path);
+  bool opened;
+  if (path == "-")
+    opened = file.open(stdout, QIODevice::WriteOnly);
+  else
+    opened = file.open(QIODevice::WriteOnly);
+  if (!opened)
+  {
+    qWarning() << "could not write summary" << path;
+    return false;
+  }
+  return file.write(data) == data.size();
+}
+
+qint64 BatchEngine::estimate_bytes(QString path, QSize *size)
+{
+  /* Only the header is read here */
+  QSize s = QImageReader(path).size();
+  qint64 pixels;
+  if (s.isValid())
+    pixels = qint64(s.width()) * s.height();
+  else
+    pixels = QFileInfo(path).size() / 3;
+
+  if (size)
+    *size = s;
+  return pixels * bytes_per_pixel;
+}
+
+QString BatchEngine::preset_contents(QString path)
+{
+  if (path.trimmed().isEmpty())
+    return QString();
+
+  /* Filled from the main thread before any job starts */
+  if (!presets.contains(path))
+  {
+    QFile file(path);
+    if (file.open(QIODevice::ReadOnly))
+      presets.insert(path, QString::fromUtf8(file.readAll()));
+    else
+      qWarning() << "could not read preset" << path;
+  }
+  return presets.value(path);
+}
+
+void BatchEngine::set_map_callback(MapCallback callback)
+{
+  map_callback = callback;
+}
+
+BatchJob BatchEngine::job_for(QString input)
+{
+  BatchJob job;
+  job.input = input;
+  job.preset = options.preset;
+  job.output_dir = options.output_dir;
+  job.maps = options.maps;
+  return job;
+}
+
+QString BatchEngine::output_path(const BatchJob &job, TextureTypes type)
+{
+  QFileInfo info(job.input);
+  QString suffix = info.suffix();
+  if (!QImageWriter::supportedImageFormats().contains(suffix.toLower().toUtf8()))
+    suffix = "png";
+
+  QString postfix = job.postfixes.value(type, map_postfix(type));
+  QString dir = job.output_dir.isEmpty() ? info.absolutePath() : job.output_dir;
+  return dir + "/" + info.completeBaseName() + postfix + "." + suffix;
+}
+
+bool BatchEngine::process(const BatchJob &job, BatchResult *result)
+{
+  result->input = job.input;
+  if (job.memory_cap > 0 && result->estimate > job.memory_cap)
+  {
+    result->error = "estimated memory exceeds the job cap";
+    return false;
+  }
+
+  bool success = false;
+  QImage image = ImageLoader::loadImage(job.input, &success);
+  if (!success)
+  {
+    result->error = "could not load image";
+    qWarning() << "could not load" << job.input;
+    return false;
+  }
+  return process(job, image, result);
+}
+
+bool BatchEngine::process(const BatchJob &job, QImage image, BatchResult *result)
+{
+  result->input = job.input;
+  result->size = image.size();
+  image = PixelFormat::toCanonical(image, "BatchEngine::process");
+
+  ImageProcessor processor;
+  processor.set_headless(true);
+  QString preset = job.preset_contents.isNull() ? presets.value(job.preset) : job.preset_contents;
+  if (!preset.isEmpty())
+    Presets::apply_string(preset, &processor);
+
+  if (MapCache::enabled() && copy_cached(job, processor.fingerprint(image), result))
+  {
+    MapCache::count(true);
+    result->cached = true;
+    result->ok = true;
+    return true;
+  }
+
+  /* loadImage runs the whole pipeline on this thread when headless */
+  processor.loadImage(job.input, image);
+  processor.wait_idle();
+
+  bool saved = true;
+  foreach (TextureTypes type, job.maps)
+  {
+    QImage map = processor_map(&processor, type);
+    if (map.isNull())
+      continue;
+    if (job.use_alpha)
+      PixelFormat::applyAlpha(&map, *processor.get_texture());
+    else
+      map = MapExporter::file_image(type, map);
+
+    bool written;
+    if (job.on_map)
+    {
+      written = job.on_map(job.input, type, map);
+    }
+    else if (map_callback)
+    {
+      written = map_callback(job.input, type, map);
+    }
+    else
+    {
+      QString name = output_path(job, type);
+      written = map.save(name);
+      if (written)
+        result->outputs << name;
+    }
+    if (written)
+      note_map();
+    saved &= written;
+  }
+
+  if (!saved)
+  {
+    result->error = "could not write maps";
+    qWarning() << "could not write maps of" << job.input;
+  }
+  result->ok = saved;
+  return saved;
+}
+
+bool BatchEngine::stream(QIODevice *in, QIODevice *out, const BatchJob &job)
+{
+  QImage image = QImage::fromData(in->readAll());
+  if (image.isNull())
+  {
+    qWarning() << "could not decode the image read from stdin";
+    return false;
+  }
+  image = PixelFormat::toCanonical(image, "BatchEngine::stream");
+
+  ImageProcessor processor;
+  processor.set_headless(true);
+  QString preset = job.preset_contents.isNull() ? presets.value(job.preset) : job.preset_contents;
+  if (!preset.isEmpty())
+    Presets::apply_string(preset, &processor);
+
+  /* Each map is encoded on the pool as soon as it is ready, while the
+   * following maps are still being computed on this thread */
+  QImage alpha = job.use_alpha ? image : QImage();
+  QMap<TextureTypes, QFuture<QByteArray>> encoded;
+  QObject::connect(&processor, &ImageProcessor::map_ready, [&](TextureTypes type) {
+    if (job.maps.contains(type) && !encoded.contains(type))
+      encoded.insert(type, QtConcurrent::run(encode_png, type, processor_map(&processor, type), alpha));
+  });
+
+  processor.loadImage(job.input, image);
+  processor.wait_idle();
+
+  QString base = QFileInfo(job.input).completeBaseName();
+  TarWriter tar(out);
+  foreach (TextureTypes type, job.maps)
+  {
+    QByteArray data = encoded.contains(type) ? encoded.value(type).result()
+                                             : encode_png(type, processor_map(&processor, type), alpha);
+    if (tar.add_file(base + job.postfixes.value(type, map_postfix(type)) + ".png", data))
+      note_map();
+  }
+  return tar.finish();
+}
+
+bool BatchEngine::copy_cached(const BatchJob &job, const QByteArray &key, BatchResult *result)
+{
+  /* Only plain png outputs are byte copies of the cache entries */
+  if (job.use_alpha || job.on_map || map_callback)
+    return false;
+  foreach (TextureTypes type, job.maps)
+  {
+    if (!output_path(job, type).endsWith(".png") || !MapCache::contains(key, type))
+      return false;
+  }
+
+  foreach (TextureTypes type, job.maps)
+  {
+    QString name = output_path(job, type);
+    QFile::remove(name);
+    if (!QFile::copy(MapCache::path(key, type), name))
+    {
+      result->outputs.clear();
+      return false;
+    }
+    result->outputs << name;
+    note_map();
+  }
+  return true;
+}
+
+void BatchEngine::note_map()
+{
+  first_map.testAndSetOrdered(-1, clock.elapsed());
+}
+
+qint64 BatchEngine::first_map_ms()
+{
+  /* Time from engine creation to the first map written, -1 if none yet */
+  return first_map.loadAcquire();
+}
+
+bool BatchEngine::process_file(QString path)
+{
+  BatchJob job = job_for(path);
+  BatchResult result;
+  return process(job, &result);
+}
+
+int BatchEngine::run(QStringList files)
+{
+  QList<BatchJob> jobs;
+  foreach (QString file, files)
+    jobs << job_for(file);
+
+  int failed = 0;
+  foreach (const BatchResult &r, run_jobs(jobs))
+    failed += r.ok ? 0 : 1;
+  return failed;
+}
+
+QVector<BatchResult> BatchEngine::run_jobs(QList<BatchJob> jobs)
+{
+  QVector<BatchResult> results(jobs.count());
+  QVector<int> order(jobs.count());
+  for (int i = 0; i < jobs.count(); i++)
+  {
+    order[i] = i;
+    results[i].input = jobs[i].input;
+    results[i].estimate = estimate_bytes(jobs[i].input);
+    preset_contents(jobs[i].preset);
+    if (!jobs[i].output_dir.isEmpty())
+      QDir(jobs[i].output_dir).mkpath(".");
+  }
+
+  /* Largest first: the pool queue is shared, so small images fill in
+   * around the big sheets instead of piling up behind them at the end */
+  std::stable_sort(order.begin(), order.end(), [&results](int a, int b) {
+    return results[a].estimate > results[b].estimate;
+  });
+
+  qint64 limit = options.memory_limit >= 0 ? options.memory_limit : MemoryBudget::instance()->budget();
+  int total_units = limit > 0 ? int(qMax<qint64>(1, limit / memory_unit)) : 0;
+  QSemaphore memory(total_units);
+
+  QThreadPool pool;
+  pool.setMaxThreadCount(options.parallel > 0 ? options.parallel : QThread::idealThreadCount());
+
+  foreach (int i, order)
+  {
+    int units = 0;
+    if (total_units > 0)
+    {
+      /* A job larger than the whole limit still runs, but alone */
+      units = int((results[i].estimate + memory_unit - 1) / memory_unit);
+      units = qBound(1, units, total_units);
+    }
+    pool.start(new BatchTask(this, jobs[i], &results[i], &memory, units));
+  }
+  pool.waitForDone();
+
+  return results;
+}
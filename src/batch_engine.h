@@ -0,0 +1,126 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef BATCHENGINE_H
+#define BATCHENGINE_H
+
+#include "sprite.h"
+
+#include <QAtomicInteger>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QIODevice>
+#include <QImage>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QList>
+#include <QMap>
+#include <QSize>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <functional>
+
+struct BatchOptions
+{
+  QString preset;
+  QString output_dir;
+  QList<TextureTypes> maps;
+  int parallel = 0;         /* 0 means one image per core */
+  qint64 memory_limit = -1; /* bytes reserved by running jobs, -1 uses the memory budget */
+};
+
+typedef std::function<bool(const QString &input, TextureTypes type, const QImage &map)> BatchMapCallback;
+
+/* One image to process, with the same knobs as the export dialog */
+struct BatchJob
+{
+  QString input;
+  QString preset;
+  QString preset_contents; /* used instead of reading preset when not null */
+  QString output_dir;
+  QList<TextureTypes> maps;
+  QMap<TextureTypes, QString> postfixes;
+  bool use_alpha = false;
+  qint64 memory_cap = 0; /* reject the job when its estimate is larger, 0 for no cap */
+  BatchMapCallback on_map; /* receives the maps instead of writing them */
+};
+
+struct BatchResult
+{
+  QString input;
+  bool ok = false;
+  QString error;
+  QStringList outputs;
+  QSize size;
+  bool cached = false;
+  qint64 estimate = 0;
+  qint64 wait_ms = 0;
+  qint64 process_ms = 0;
+};
+
+/* Headless generator for --no-gui and --jobs. Every image runs the whole
+ * pipeline synchronously on a pool thread. Jobs are queued largest first,
+ * and a job waits until its estimated working memory fits in the limit. */
+class BatchEngine
+{
+public:
+  typedef BatchMapCallback MapCallback;
+
+public:
+  explicit BatchEngine(BatchOptions options);
+
+  static QStringList expand_inputs(QStringList patterns);
+  static QString map_postfix(TextureTypes type);
+  static QString map_name(TextureTypes type);
+  static bool map_from_name(QString name, TextureTypes *type);
+  static void read_job(const QJsonObject &o, const QDir &base, BatchJob *job);
+  static QJsonObject job_json(const BatchJob &job);
+  static QJsonObject result_json(const BatchResult &r);
+  static BatchResult read_result(const QJsonObject &o);
+  static bool load_manifest(QString path, BatchOptions *options, QList<BatchJob> *jobs, QString *error);
+  static bool write_summary(QString path, const QVector<BatchResult> &results, qint64 wall_ms,
+                            const QJsonArray &workers = QJsonArray());
+  static qint64 estimate_bytes(QString path, QSize *size = nullptr);
+
+  void set_map_callback(MapCallback callback);
+  BatchJob job_for(QString input);
+  QString output_path(const BatchJob &job, TextureTypes type);
+  bool process(const BatchJob &job, BatchResult *result);
+  bool process(const BatchJob &job, QImage image, BatchResult *result);
+  bool stream(QIODevice *in, QIODevice *out, const BatchJob &job);
+  bool process_file(QString path);
+  int run(QStringList files);
+  QVector<BatchResult> run_jobs(QList<BatchJob> jobs);
+  qint64 first_map_ms();
+
+private:
+  QString preset_contents(QString path);
+  bool copy_cached(const BatchJob &job, const QByteArray &key, BatchResult *result);
+  void note_map();
+
+  BatchOptions options;
+  QHash<QString, QString> presets;
+  MapCallback map_callback;
+  QElapsedTimer clock;
+  QAtomicInteger<qint64> first_map;
+};
+
+#endif // BATCHENGINE_H
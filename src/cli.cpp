@@ -0,0 +1,516 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "cli.h"
+#include "batch_coordinator.h"
+#include "batch_engine.h"
+#include "directory_watcher.h"
+#include "map_cache.h"
+#include "map_exporter.h"
+#include "map_server.h"
+#include "memory_budget.h"
+#include "pixel_format.h"
+#include "project.h"
+#include "scratch_arena.h"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QTemporaryDir>
+#include <QThread>
+#include <QtConcurrent/QtConcurrent>
+
+#ifdef Q_OS_WIN
+#include <fcntl.h>
+#include <io.h>
+#endif
+#ifdef Q_OS_LINUX
+#include <unistd.h>
+#endif
+
+static QElapsedTimer process_clock;
+
+void Cli::mark_start()
+{
+  process_clock.start();
+}
+
+CommonOptions::CommonOptions()
+    : diffuse(QStringList() << "d"
+                            << "diffuse",
+              "diffuse texture to load", "diffuse texture path"),
+      preset(QStringList() << "r"
+                           << "preset",
+             "presset to load", "preset file path"),
+      memory_budget(QStringList() << "memory-budget", "memory budget for computed maps, 0 to disable", "megabytes"),
+      no_cache(QStringList() << "no-cache", "always generate maps, without reading or writing the map cache"),
+      project(QStringList() << "project", "project to open, or to export with --export", "project path")
+{
+}
+
+void CommonOptions::add_to(QCommandLineParser *parser)
+{
+  parser->addOption(diffuse);
+  parser->addOption(preset);
+  parser->addOption(memory_budget);
+  parser->addOption(no_cache);
+  parser->addOption(project);
+}
+
+void CommonOptions::apply(const QCommandLineParser &parser)
+{
+  if (parser.isSet(memory_budget))
+  {
+    MemoryBudget::instance()->set_budget(parser.value(memory_budget).toLongLong() * 1024 * 1024);
+  }
+  if (parser.isSet(no_cache))
+  {
+    MapCache::set_enabled(false);
+  }
+}
+
+bool Cli::is_headless(int argc, char *argv[])
+{
+  /* Modes that never open a window. Asking for maps is one: they are
+   * written without gui */
+  const char *headless[] = {"-g", "--no-gui", "--jobs", "--watch", "--serve", "--export", "--workers", "--connect",
+                            "--benchmark-project", "-n", "--normal", "-c", "--specular", "-o", "--occlusion",
+                            "-p", "--parallax"};
+  for (int i = 1; i < argc; ++i)
+  {
+    QByteArray arg(argv[i]);
+    for (const char *flag : headless)
+    {
+      if (arg == flag || arg.startsWith(QByteArray(flag) + "="))
+        return true;
+    }
+  }
+  return false;
+}
+
+qint64 Cli::elapsed_ms()
+{
+#ifdef Q_OS_LINUX
+  /* Counts dynamic loading and static constructors before main() too */
+  QFile stat("/proc/self/stat"), uptime("/proc/uptime");
+  if (stat.open(QIODevice::ReadOnly) && uptime.open(QIODevice::ReadOnly))
+  {
+    QByteArray line = stat.readAll();
+    QList<QByteArray> fields = line.mid(line.lastIndexOf(')') + 2).split(' ');
+    double now = uptime.readAll().split(' ').first().toDouble();
+    if (fields.count() > 19)
+    {
+      double started = fields.at(19).toDouble() / sysconf(_SC_CLK_TCK);
+      qint64 since_start = (now - started) * 1000;
+      if (since_start >= process_clock.elapsed())
+        return since_start;
+    }
+  }
+#endif
+  return process_clock.elapsed();
+}
+
+static void report_timing(qint64 startup, qint64 first_map)
+{
+  QString first = first_map < 0 ? QString("-") : QString::number(first_map);
+  qInfo().noquote() << QString("timing: startup %1 ms, first map %2 ms, total %3 ms")
+                           .arg(startup)
+                           .arg(first)
+                           .arg(Cli::elapsed_ms());
+}
+
+static int benchmark_project(QString project_path)
+{
+  Project project;
+  project.set_headless(true);
+  QList<ImageProcessor *> processors;
+  if (!project.load(project_path, &processors))
+  {
+    qCritical() << "could not load" << project_path;
+    return 2;
+  }
+  /* Saved projects carry their maps, so have them all computed */
+  QtConcurrent::blockingMap(processors, [](ImageProcessor *p) {
+    p->restore_maps(true);
+    p->wait_idle();
+  });
+
+  QTemporaryDir dir;
+  const char *names[] = {"mixed", "deflate", "raw"};
+  bool ok = true;
+  for (const char *name : names)
+  {
+    ProjectCompression c;
+    Project::parse_compression(name, &c);
+    QString path = dir.filePath(QString(name) + ".laigter");
+
+    QElapsedTimer timer;
+    timer.start();
+    Project saver;
+    saver.set_compression(c);
+    ok &= saver.save(path, processors);
+    qint64 save_ms = timer.restart();
+
+    Project loader;
+    loader.set_headless(true);
+    QList<ImageProcessor *> loaded;
+    ok &= loader.load(path, &loaded);
+    qint64 load_ms = timer.elapsed();
+    qDeleteAll(loaded);
+
+    qInfo().noquote() << QString("%1: save %2 ms, load %3 ms, %4 KiB")
+                             .arg(name, -8)
+                             .arg(save_ms)
+                             .arg(load_ms)
+                             .arg(QFileInfo(path).size() / 1024);
+  }
+  qDeleteAll(processors);
+  return ok ? 0 : 1;
+}
+
+int Cli::run(int &argc, char *argv[])
+{
+  QCoreApplication app(argc, argv);
+
+  QCommandLineParser argsParser;
+  argsParser.setApplicationDescription("Laigter without graphical interface");
+  argsParser.addHelpOption();
+  argsParser.addVersionOption();
+
+  QCommandLineOption noGuiOption(QStringList() << "g"
+                                               << "no-gui",
+                                 "do not start graphical interface");
+  argsParser.addOption(noGuiOption);
+
+  QCommandLineOption outputNormalTextureOption(QStringList() << "n"
+                                                             << "normal",
+                                               "generate normals");
+  argsParser.addOption(outputNormalTextureOption);
+
+  QCommandLineOption outputSpecularTextureOption(QStringList() << "c"
+                                                               << "specular",
+                                                 "generate specular");
+  argsParser.addOption(outputSpecularTextureOption);
+
+  QCommandLineOption outputOcclusionTextureOption(QStringList()
+                                                      << "o"
+                                                      << "occlusion",
+                                                  "generate occlusion");
+  argsParser.addOption(outputOcclusionTextureOption);
+
+  QCommandLineOption outputParallaxTextureOption(QStringList() << "p"
+                                                               << "parallax",
+                                                 "generate parallax");
+  argsParser.addOption(outputParallaxTextureOption);
+
+  CommonOptions common;
+  common.add_to(&argsParser);
+
+  QCommandLineOption statsOption(QStringList() << "stats",
+                                 "print pixel conversion and scratch buffer counters");
+  argsParser.addOption(statsOption);
+
+  QCommandLineOption parallelOption(QStringList() << "parallel",
+                                    "images processed at once without gui, defaults to one per core", "count");
+  argsParser.addOption(parallelOption);
+
+  QCommandLineOption outputDirOption(QStringList() << "output-dir",
+                                     "directory for maps generated without gui, defaults to next to each input", "directory");
+  argsParser.addOption(outputDirOption);
+
+  QCommandLineOption jobsOption(QStringList() << "jobs",
+                                "process the jobs listed in a json manifest, implies --no-gui", "manifest");
+  argsParser.addOption(jobsOption);
+
+  QCommandLineOption summaryOption(QStringList() << "summary",
+                                   "write a json summary with per job timings, - for stdout", "file");
+  argsParser.addOption(summaryOption);
+
+  QCommandLineOption watchOption(QStringList() << "watch",
+                                 "keep the maps of images under a directory up to date, implies --no-gui", "directory");
+  argsParser.addOption(watchOption);
+
+  QCommandLineOption serveOption(QStringList() << "serve",
+                                 "serve map requests on a local socket until told to quit, implies --no-gui", "socket name");
+  argsParser.addOption(serveOption);
+
+  QCommandLineOption exportOption(QStringList() << "export",
+                                  "export the maps of every sprite in --project, implies --no-gui", "directory");
+  argsParser.addOption(exportOption);
+
+  QCommandLineOption exportMapsOption(QStringList() << "export-maps",
+                                      "maps to export: normal, specular, parallax, occlusion, diffuse, combined",
+                                      "list");
+  argsParser.addOption(exportMapsOption);
+
+  QCommandLineOption exportLayoutOption(QStringList() << "export-layout",
+                                        "frames layout: default, horizontal, vertical, rows:N, columns:N, separate",
+                                        "layout");
+  argsParser.addOption(exportLayoutOption);
+
+  QCommandLineOption invertXOption(QStringList() << "invert-x", "export normals with the red channel inverted");
+  argsParser.addOption(invertXOption);
+
+  QCommandLineOption invertYOption(QStringList() << "invert-y", "export normals with the green channel inverted");
+  argsParser.addOption(invertYOption);
+
+  QCommandLineOption normalAlphaOption(QStringList() << "normal-alpha",
+                                       "embed specular, parallax or occlusion in the normal alpha", "map");
+  argsParser.addOption(normalAlphaOption);
+
+  QCommandLineOption workersOption(QStringList() << "workers",
+                                   "split the batch across this many worker processes", "count");
+  argsParser.addOption(workersOption);
+
+  QCommandLineOption connectOption(QStringList() << "connect",
+                                   "split the batch across --serve instances already running on this machine, comma separated",
+                                   "socket names");
+  argsParser.addOption(connectOption);
+
+  QCommandLineOption retriesOption(QStringList() << "retries",
+                                   "times a job is sent again after its worker is lost, defaults to 2", "count");
+  argsParser.addOption(retriesOption);
+
+  QCommandLineOption benchmarkProjectOption(QStringList() << "benchmark-project",
+                                            "save and reopen --project with every compression policy, printing "
+                                            "times and sizes");
+  argsParser.addOption(benchmarkProjectOption);
+
+  QCommandLineOption timingOption(QStringList() << "timing",
+                                  "print the time from process start to startup done, first map and exit");
+  argsParser.addOption(timingOption);
+
+  argsParser.addPositionalArgument("inputs", "images, directories and globs to process, - for stdin", "[inputs...]");
+  argsParser.process(app);
+  qint64 startup = elapsed_ms();
+  bool timing = argsParser.isSet(timingOption);
+
+  common.apply(argsParser);
+
+  if (argsParser.isSet(benchmarkProjectOption))
+  {
+    QString project_path = argsParser.value(common.project);
+    if (!QFileInfo(project_path).isFile())
+    {
+      qCritical() << "--benchmark-project needs an existing --project, got" << project_path;
+      return 2;
+    }
+    return benchmark_project(project_path);
+  }
+
+  if (argsParser.isSet(exportOption))
+  {
+    QString project_path = argsParser.value(common.project);
+    if (!QFileInfo(project_path).isFile())
+    {
+      qCritical() << "--export needs an existing --project, got" << project_path;
+      return 2;
+    }
+
+    ExportOptions o;
+    o.destination = argsParser.value(exportOption);
+    o.project_path = project_path;
+    o.invert_x = argsParser.isSet(invertXOption);
+    o.invert_y = argsParser.isSet(invertYOption);
+    if (argsParser.isSet(normalAlphaOption))
+    {
+      /* Same spelling as the export dialog choices */
+      QString alpha = argsParser.value(normalAlphaOption).toLower();
+      if (!alpha.isEmpty())
+        alpha[0] = alpha[0].toUpper();
+      o.normal_alpha = alpha;
+    }
+    if (argsParser.isSet(exportLayoutOption) && !MapExporter::parse_layout(argsParser.value(exportLayoutOption), &o))
+    {
+      qCritical() << "unknown layout" << argsParser.value(exportLayoutOption);
+      return 2;
+    }
+    if (argsParser.isSet(exportMapsOption))
+    {
+      QStringList maps = argsParser.value(exportMapsOption).toLower().split(",");
+      o.normal = maps.contains("normal");
+      o.specular = maps.contains("specular");
+      o.parallax = maps.contains("parallax");
+      o.occlusion = maps.contains("occlusion");
+      o.diffuse = maps.contains("diffuse");
+      o.combined = maps.contains("combined");
+    }
+
+    Project project;
+    project.set_headless(true);
+    QList<ImageProcessor *> processors;
+    if (!project.load(project_path, &processors))
+    {
+      qCritical() << "could not load" << project_path;
+      return 2;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    bool saved = MapExporter::export_all(processors, o);
+    qInfo() << processors.count() << "sprites exported in" << timer.elapsed() << "ms";
+    qDeleteAll(processors);
+    if (timing)
+      report_timing(startup, -1);
+    return saved ? 0 : 1;
+  }
+
+  BatchOptions options;
+  options.preset = argsParser.value(common.preset);
+  options.output_dir = argsParser.value(outputDirOption);
+  options.parallel = argsParser.value(parallelOption).toInt();
+  if (argsParser.isSet(outputNormalTextureOption))
+    options.maps << TextureTypes::Normal;
+  if (argsParser.isSet(outputSpecularTextureOption))
+    options.maps << TextureTypes::Specular;
+  if (argsParser.isSet(outputOcclusionTextureOption))
+    options.maps << TextureTypes::Occlussion;
+  if (argsParser.isSet(outputParallaxTextureOption))
+    options.maps << TextureTypes::Parallax;
+
+  QList<BatchJob> jobs;
+  if (argsParser.isSet(jobsOption))
+  {
+    QString error;
+    if (!BatchEngine::load_manifest(argsParser.value(jobsOption), &options, &jobs, &error))
+    {
+      qCritical().noquote() << error;
+      return 2;
+    }
+    if (argsParser.isSet(parallelOption))
+      options.parallel = argsParser.value(parallelOption).toInt();
+  }
+
+  /* The engine clock starts here, first_map_ms() is relative to it */
+  qint64 engine_start = elapsed_ms();
+  BatchEngine engine(options);
+  QStringList patterns = argsParser.values(common.diffuse) + argsParser.positionalArguments();
+
+  /* "-" reads one image from stdin and writes its maps to stdout as tar */
+  if (patterns == QStringList("-"))
+  {
+#ifdef Q_OS_WIN
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    QFile in, out;
+    in.open(stdin, QIODevice::ReadOnly);
+    out.open(stdout, QIODevice::WriteOnly);
+    bool streamed = engine.stream(&in, &out, engine.job_for("stdin"));
+    if (timing)
+      report_timing(startup, engine.first_map_ms() < 0 ? -1 : engine_start + engine.first_map_ms());
+    return streamed ? 0 : 1;
+  }
+
+  QStringList inputs = BatchEngine::expand_inputs(patterns);
+  foreach (QString input, inputs)
+    jobs << engine.job_for(input);
+
+  QElapsedTimer timer;
+  timer.start();
+  QVector<BatchResult> results;
+  QJsonArray workers;
+  if (argsParser.isSet(workersOption) || argsParser.isSet(connectOption))
+  {
+    BatchCoordinator coordinator;
+    if (argsParser.isSet(retriesOption))
+      coordinator.set_retries(argsParser.value(retriesOption).toInt());
+
+    bool ready = false;
+    if (argsParser.isSet(workersOption))
+    {
+      int count = qMax(1, argsParser.value(workersOption).toInt());
+      int threads = options.parallel > 0 ? options.parallel : qMax(1, QThread::idealThreadCount() / count);
+      QStringList arguments;
+      arguments << "--parallel" << QString::number(threads);
+      if (argsParser.isSet(common.no_cache))
+        arguments << "--no-cache";
+      if (argsParser.isSet(common.memory_budget))
+        arguments << "--memory-budget" << argsParser.value(common.memory_budget);
+      ready |= coordinator.launch(count, arguments);
+    }
+    if (argsParser.isSet(connectOption))
+      ready |= coordinator.connect_to(argsParser.value(connectOption).split(",", QString::SkipEmptyParts));
+    if (!ready)
+    {
+      qCritical() << "no worker to run the batch";
+      return 2;
+    }
+
+    results = coordinator.run(jobs);
+    workers = coordinator.report();
+    foreach (QJsonValue v, workers)
+    {
+      QJsonObject w = v.toObject();
+      qInfo().noquote() << QString("%1: %2 jobs, %3 pixels, %4 lost")
+                               .arg(w.value("worker").toString())
+                               .arg(w.value("jobs").toInt())
+                               .arg(qint64(w.value("pixels").toDouble()))
+                               .arg(w.value("lost_jobs").toInt());
+    }
+  }
+  else
+  {
+    results = engine.run_jobs(jobs);
+  }
+  int failed = 0;
+  foreach (const BatchResult &r, results)
+    failed += r.ok ? 0 : 1;
+  qInfo() << results.count() - failed << "of" << results.count() << "images processed";
+
+  if (argsParser.isSet(summaryOption))
+    BatchEngine::write_summary(argsParser.value(summaryOption), results, timer.elapsed(), workers);
+
+  if (argsParser.isSet(statsOption))
+  {
+    qInfo() << "pixel conversions:" << PixelFormat::conversionCount();
+    qInfo().noquote() << ScratchArena::stats();
+    qInfo() << "map cache hits:" << MapCache::hits() << "misses:" << MapCache::misses();
+  }
+  if (timing)
+    report_timing(startup, engine.first_map_ms() < 0 ? -1 : engine_start + engine.first_map_ms());
+
+  if (argsParser.isSet(watchOption) || argsParser.isSet(serveOption))
+  {
+    DirectoryWatcher watcher(&engine);
+    if (argsParser.isSet(watchOption))
+    {
+      if (options.maps.isEmpty())
+        qWarning() << "no maps selected to generate, use -n, -c, -o or -p";
+
+      foreach (QString directory, argsParser.values(watchOption))
+      {
+        if (!watcher.watch(directory))
+          return 2;
+      }
+      watcher.catch_up();
+      qInfo() << "watching" << argsParser.values(watchOption);
+    }
+
+    MapServer server(&engine, options.parallel);
+    if (argsParser.isSet(serveOption) && !server.listen(argsParser.value(serveOption)))
+      return 2;
+
+    return app.exec();
+  }
+  return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+
+#ifndef CLI_H
+#define CLI_H
+
+#include <QCommandLineOption>
+#include <QtGlobal>
+
+class QCommandLineParser;
+
+/* Options accepted with and without the gui, declared once for both
+ * parsers */
+struct CommonOptions
+{
+  CommonOptions();
+  void add_to(QCommandLineParser *parser);
+  /* Memory budget and map cache, applied right after parsing */
+  void apply(const QCommandLineParser &parser);
+
+  QCommandLineOption diffuse, preset, memory_budget, no_cache, project;
+};
+
+/* Headless entry point. Only the processing core is initialized: no
+ * QApplication, no OpenGL surface setup and no settings directories, so the
+ * first map is written as soon as possible after the process starts. */
+class Cli
+{
+public:
+  static void mark_start();
+  static bool is_headless(int argc, char *argv[]);
+  static int run(int &argc, char *argv[]);
+  static qint64 elapsed_ms();
+};
+
+#endif // CLI_H
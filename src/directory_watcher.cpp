@@ -0,0 +1,263 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "directory_watcher.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+
+DirectoryWatcher::DirectoryWatcher(BatchEngine *engine, QObject *parent)
+    : QObject(parent), engine(engine)
+{
+  debounce.setInterval(debounce_ms);
+  debounce.setSingleShot(true);
+  connect(&debounce, SIGNAL(timeout()), this, SLOT(rescan()));
+  connect(&watcher, SIGNAL(directoryChanged(QString)), this, SLOT(directory_changed(QString)));
+  connect(&watcher, SIGNAL(fileChanged(QString)), this, SLOT(file_changed(QString)));
+}
+
+bool DirectoryWatcher::is_output(QString path)
+{
+  /* Maps written by the engine must not come back as inputs: neither what
+   * lands in --output-dir nor anything named like a map */
+  BatchJob job = engine->job_for(path);
+  QFileInfo info(path);
+  QString absolute = QDir::cleanPath(info.absoluteFilePath());
+  if (!job.output_dir.isEmpty())
+  {
+    QString out = QDir::cleanPath(QFileInfo(job.output_dir).absoluteFilePath());
+    if (absolute == out || absolute.startsWith(out + "/"))
+      return true;
+  }
+  if (info.isDir())
+    return false;
+
+  QString base = info.completeBaseName();
+  foreach (TextureTypes type, job.maps)
+  {
+    if (base.endsWith(job.postfixes.value(type, BatchEngine::map_postfix(type))))
+      return true;
+  }
+  return false;
+}
+
+bool DirectoryWatcher::watch(QString directory)
+{
+  QFileInfo info(directory);
+  if (!info.isDir())
+  {
+    qWarning() << "not a directory" << directory;
+    return false;
+  }
+
+  add_directory(info.absoluteFilePath());
+  QDirIterator it(info.absoluteFilePath(), QDir::Dirs | QDir::NoDotAndDotDot, QDirIterator::Subdirectories);
+  while (it.hasNext())
+    add_directory(it.next());
+  return true;
+}
+
+void DirectoryWatcher::add_directory(QString directory)
+{
+  if (files.contains(directory) || is_output(directory))
+    return;
+
+  watcher.addPath(directory);
+  files.insert(directory, scan(directory));
+}
+
+QHash<QString, DirectoryWatcher::FileState> DirectoryWatcher::scan(QString directory)
+{
+  QHash<QString, FileState> state;
+  foreach (QString path, BatchEngine::expand_inputs(QStringList() << directory))
+  {
+    if (is_output(path))
+      continue;
+    QFileInfo info(path);
+    FileState s;
+    s.size = info.size();
+    s.modified = info.lastModified();
+    state.insert(info.absoluteFilePath(), s);
+  }
+
+  /* Writes in place only show up on the file itself. Paths already
+   * watched are just reported back as not added. */
+  if (!state.isEmpty())
+    watcher.addPaths(state.keys());
+  return state;
+}
+
+void DirectoryWatcher::catch_up()
+{
+  /* Maps missing or older than their image are regenerated on start */
+  QList<BatchJob> jobs;
+  foreach (const QString &directory, files.keys())
+  {
+    foreach (const QString &input, files.value(directory).keys())
+    {
+      BatchJob job = engine->job_for(input);
+      QDateTime modified = QFileInfo(input).lastModified();
+      foreach (TextureTypes type, job.maps)
+      {
+        QFileInfo out(engine->output_path(job, type));
+        if (!out.exists() || out.lastModified() < modified)
+        {
+          jobs << job;
+          break;
+        }
+      }
+    }
+  }
+
+  if (!jobs.isEmpty())
+    engine->run_jobs(jobs);
+}
+
+void DirectoryWatcher::directory_changed(const QString &path)
+{
+  dirty.insert(path);
+  debounce.start();
+}
+
+void DirectoryWatcher::file_changed(const QString &path)
+{
+  dirty.insert(QFileInfo(path).absolutePath());
+  debounce.start();
+}
+
+void DirectoryWatcher::remove_maps(QString input)
+{
+  BatchJob job = engine->job_for(input);
+  foreach (TextureTypes type, job.maps)
+  {
+    QString name = engine->output_path(job, type);
+    if (QFile::remove(name))
+      qInfo() << "removed" << name;
+  }
+}
+
+bool DirectoryWatcher::move_maps(QString from, QString to)
+{
+  BatchJob old_job = engine->job_for(from);
+  BatchJob new_job = engine->job_for(to);
+  foreach (TextureTypes type, old_job.maps)
+  {
+    QString old_name = engine->output_path(old_job, type);
+    QString new_name = engine->output_path(new_job, type);
+    QFile::remove(new_name);
+    if (!QFile::rename(old_name, new_name))
+      return false;
+  }
+  qInfo() << "renamed" << from << "->" << to;
+  return true;
+}
+
+void DirectoryWatcher::rescan()
+{
+  QSet<QString> directories = dirty;
+  dirty.clear();
+
+  QStringList changed;
+  QHash<QString, FileState> removed, created;
+  foreach (QString directory, directories)
+  {
+    if (!files.contains(directory))
+      continue;
+
+    if (!QFileInfo(directory).isDir())
+    {
+      foreach (QString input, files.value(directory).keys())
+        removed.insert(input, files.value(directory).value(input));
+      files.remove(directory);
+      continue;
+    }
+
+    /* Directories created since the last scan start empty, so everything
+     * found in them on the next pass counts as new */
+    QDirIterator it(directory, QDir::Dirs | QDir::NoDotAndDotDot);
+    while (it.hasNext())
+    {
+      QString sub = it.next();
+      if (!files.contains(sub) && !is_output(sub))
+      {
+        watcher.addPath(sub);
+        files.insert(sub, QHash<QString, FileState>());
+        dirty.insert(sub);
+        debounce.start();
+      }
+    }
+
+    QHash<QString, FileState> before = files.value(directory);
+    QHash<QString, FileState> after = scan(directory);
+    files.insert(directory, after);
+
+    foreach (QString input, after.keys())
+    {
+      if (after.value(input).size == 0)
+        continue;
+      if (!before.contains(input))
+        created.insert(input, after.value(input));
+      else if (before.value(input) != after.value(input))
+        changed << input;
+    }
+    foreach (QString input, before.keys())
+    {
+      if (!after.contains(input))
+        removed.insert(input, before.value(input));
+    }
+  }
+
+  /* A file that vanished while an identical one appeared was renamed */
+  foreach (QString from, removed.keys())
+  {
+    QString to;
+    foreach (QString candidate, created.keys())
+    {
+      if (created.value(candidate) == removed.value(from))
+      {
+        to = candidate;
+        break;
+      }
+    }
+
+    if (!to.isEmpty() && move_maps(from, to))
+      created.remove(to);
+    else
+      remove_maps(from);
+  }
+  changed << created.keys();
+
+  if (changed.isEmpty())
+    return;
+
+  QList<BatchJob> jobs;
+  foreach (QString input, changed)
+    jobs << engine->job_for(input);
+
+  foreach (const BatchResult &r, engine->run_jobs(jobs))
+  {
+    if (r.ok)
+      qInfo() << "updated" << r.input << r.process_ms << "ms";
+    else
+      qWarning() << "failed" << r.input << r.error;
+  }
+}
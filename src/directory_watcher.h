@@ -0,0 +1,75 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef DIRECTORYWATCHER_H
+#define DIRECTORYWATCHER_H
+
+#include "batch_engine.h"
+
+#include <QDateTime>
+#include <QFileSystemWatcher>
+#include <QHash>
+#include <QObject>
+#include <QSet>
+#include <QTimer>
+
+/* Keeps the maps of every image under some directories up to date for
+ * --watch. Change notifications are collected until the directories have
+ * been quiet for debounce_ms, then only the affected directories are
+ * rescanned and compared with the previous scan. */
+class DirectoryWatcher : public QObject
+{
+  Q_OBJECT
+
+public:
+  static const int debounce_ms = 200;
+
+public:
+  explicit DirectoryWatcher(BatchEngine *engine, QObject *parent = nullptr);
+  bool watch(QString directory);
+  void catch_up();
+
+private slots:
+  void directory_changed(const QString &path);
+  void file_changed(const QString &path);
+  void rescan();
+
+private:
+  struct FileState
+  {
+    qint64 size;
+    QDateTime modified;
+    bool operator==(const FileState &o) const { return size == o.size && modified == o.modified; }
+    bool operator!=(const FileState &o) const { return !(*this == o); }
+  };
+
+  bool is_output(QString path);
+  void add_directory(QString directory);
+  QHash<QString, FileState> scan(QString directory);
+  void remove_maps(QString input);
+  bool move_maps(QString from, QString to);
+
+  BatchEngine *engine;
+  QFileSystemWatcher watcher;
+  QTimer debounce;
+  QSet<QString> dirty;
+  QHash<QString, QHash<QString, FileState>> files;
+};
+
+#endif // DIRECTORYWATCHER_H
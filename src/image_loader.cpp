@@ -18,11 +18,21 @@
  */
 
 #include "image_loader.h"
+#include "pixel_format.h"
 
 #include <QDebug>
+#include <QFile>
 #include <QFileInfo>
 #include <QImageReader>
-#include <fstream>
+#include <climits>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
 
 ImageLoader::ImageLoader(QObject *parent) : QObject(parent) {}
 
@@ -33,7 +43,7 @@ QList<QImage> ImageLoader::loadImages(QString fileName)
   for (int i = 0; i < reader.imageCount(); i++)
   {
     reader.jumpToImage(i);
-    image_list.append(reader.read());
+    image_list.append(PixelFormat::toCanonical(reader.read(), "ImageLoader::loadImages"));
     qDebug() << reader.errorString();
   }
   return image_list;
@@ -62,144 +72,230 @@ QImage ImageLoader::loadImage(QString fileName, bool *success)
   if (image.isNull())
     *success = false;
 
-  return image;
+  return PixelFormat::toCanonical(image, "ImageLoader::loadImage");
 }
 
-QImage ImageLoader::loadTga(const char *filePath, bool *success)
+/* TGA pixels are stored B, G, R(, A). The canonical format is R, G, B, A
+ * premultiplied, so each row is swizzled (and premultiplied where alpha is
+ * not opaque) straight into its destination scanline. */
+
+static void premultiply_row(uchar *dst, int n)
 {
-  QImage img;
-  if (!img.load(filePath))
+  for (int x = 0; x < n; x++, dst += 4)
   {
-    // open the file
-    std::fstream fsPicture(filePath, std::ios::in | std::ios::binary);
-
-    if (!fsPicture.is_open())
+    uint a = dst[3];
+    if (a == 255)
+      continue;
+    for (int c = 0; c < 3; c++)
     {
-      img = QImage(1, 1, QImage::Format_RGB32);
-      img.fill(Qt::red);
-      *success = false;
-      return img;
+      uint t = dst[c] * a + 128;
+      dst[c] = (t + (t >> 8)) >> 8;
     }
+  }
+}
 
-    // some variables
-    std::vector<std::uint8_t> *vui8Pixels;
-    std::uint32_t ui32BpP;
-    std::uint32_t ui32Width;
-    std::uint32_t ui32Height;
-
-    // read in the header
-    std::uint8_t ui8x18Header[19] = {0};
-    fsPicture.read(reinterpret_cast<char *>(&ui8x18Header),
-                   sizeof(ui8x18Header) - 1);
-
-    // get variables
-    vui8Pixels = new std::vector<std::uint8_t>;
-    bool bCompressed;
-    std::uint32_t ui32IDLength;
-    std::uint32_t ui32PicType;
-    std::uint32_t ui32PaletteLength;
-    std::uint32_t ui32Size;
-
-    // extract all information from header
-    ui32IDLength = ui8x18Header[0];
-    ui32PicType = ui8x18Header[2];
-    ui32PaletteLength = ui8x18Header[6] * 0x100 + ui8x18Header[5];
-    ui32Width = ui8x18Header[13] * 0x100 + ui8x18Header[12];
-    ui32Height = ui8x18Header[15] * 0x100 + ui8x18Header[14];
-    ui32BpP = ui8x18Header[16];
-
-    // calculate some more information
-    ui32Size = ui32Width * ui32Height * ui32BpP / 8;
-    bCompressed = ui32PicType == 9 || ui32PicType == 10;
-    vui8Pixels->resize(ui32Size);
-
-    // jump to the data block
-    fsPicture.seekg(ui32IDLength + ui32PaletteLength, std::ios_base::cur);
-
-    if (ui32PicType == 2 && (ui32BpP == 24 || ui32BpP == 32))
-      fsPicture.read(reinterpret_cast<char *>(vui8Pixels->data()),
-                     ui32Size);
-    // else if compressed 24 or 32 bit
-    else if (ui32PicType == 10 &&
-             (ui32BpP == 24 || ui32BpP == 32)) // compressed
-    {
-      std::uint8_t tempChunkHeader;
-      std::uint8_t tempData[5];
-      unsigned int tempByteIndex = 0;
+static void swizzle_bgra(const uchar *src, uchar *dst, int n)
+{
+  int x = 0;
+#ifdef __SSE2__
+  /* Swap the B and R bytes of four pixels at a time */
+  const __m128i ga = _mm_set1_epi32(int(0xff00ff00));
+  const __m128i low = _mm_set1_epi32(0xff);
+  for (; x + 4 <= n; x += 4)
+  {
+    __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 4 * x));
+    __m128i b = _mm_slli_epi32(_mm_and_si128(p, low), 16);
+    __m128i r = _mm_and_si128(_mm_srli_epi32(p, 16), low);
+    p = _mm_or_si128(_mm_and_si128(p, ga), _mm_or_si128(b, r));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 4 * x), p);
+  }
+#endif
+  for (; x < n; x++)
+  {
+    dst[4 * x] = src[4 * x + 2];
+    dst[4 * x + 1] = src[4 * x + 1];
+    dst[4 * x + 2] = src[4 * x];
+    dst[4 * x + 3] = src[4 * x + 3];
+  }
+  premultiply_row(dst, n);
+}
 
-      do
+static void swizzle_bgr(const uchar *src, uchar *dst, int n)
+{
+  int x = 0;
+#ifdef __SSSE3__
+  /* Four pixels from each 16 byte load; the last four bytes are unused, so
+   * stop while a full load still fits in the row */
+  const __m128i order = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+  const __m128i alpha = _mm_set1_epi32(int(0xff000000));
+  for (; x + 6 <= n; x += 4)
+  {
+    __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 3 * x));
+    p = _mm_or_si128(_mm_shuffle_epi8(p, order), alpha);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 4 * x), p);
+  }
+#endif
+  for (; x < n; x++)
+  {
+    dst[4 * x] = src[3 * x + 2];
+    dst[4 * x + 1] = src[3 * x + 1];
+    dst[4 * x + 2] = src[3 * x];
+    dst[4 * x + 3] = 255;
+  }
+}
+
+static void swizzle_gray(const uchar *src, uchar *dst, int n)
+{
+  for (int x = 0; x < n; x++, dst += 4)
+  {
+    dst[0] = dst[1] = dst[2] = src[x];
+    dst[3] = 255;
+  }
+}
+
+/* Expands RLE packets into packed pixels. Returns false on truncated data
+ * or packets running past the image */
+static bool decode_rle(const uchar *src, qint64 length, uchar *dst, qint64 size, int bpp)
+{
+  const uchar *end = src + length;
+  uchar *out = dst, *out_end = dst + size;
+  while (out < out_end)
+  {
+    if (src >= end)
+      return false;
+    uchar header = *src++;
+    qint64 bytes = qint64((header & 0x7f) + 1) * bpp;
+    if (bytes > out_end - out)
+      return false;
+
+    if (header & 0x80)
+    {
+      if (bpp > end - src)
+        return false;
+      /* Repeat one pixel; doubling the filled span keeps it to few copies */
+      memcpy(out, src, bpp);
+      qint64 filled = bpp;
+      while (filled < bytes)
       {
-        fsPicture.read(reinterpret_cast<char *>(&tempChunkHeader),
-                       sizeof(tempChunkHeader));
-
-        if (tempChunkHeader >> 7) // repeat count
-        {
-          // just use the first 7 bits
-          tempChunkHeader = (uint8_t(tempChunkHeader << 1) >> 1);
-          fsPicture.read(reinterpret_cast<char *>(&tempData),
-                         ui32BpP / 8);
-
-          for (int i = 0; i <= tempChunkHeader; i++)
-          {
-            vui8Pixels->at(tempByteIndex++) = tempData[0];
-            vui8Pixels->at(tempByteIndex++) = tempData[1];
-            vui8Pixels->at(tempByteIndex++) = tempData[2];
-            if (ui32BpP == 32)
-              vui8Pixels->at(tempByteIndex++) = tempData[3];
-          }
-        }
-        else // data count
-        {
-          // just use the first 7 bits
-          tempChunkHeader = (uint8_t(tempChunkHeader << 1) >> 1);
-
-          for (int i = 0; i <= tempChunkHeader; i++)
-          {
-            fsPicture.read(reinterpret_cast<char *>(&tempData),
-                           ui32BpP / 8);
-            vui8Pixels->at(tempByteIndex++) = tempData[0];
-            vui8Pixels->at(tempByteIndex++) = tempData[1];
-            vui8Pixels->at(tempByteIndex++) = tempData[2];
-            if (ui32BpP == 32)
-              vui8Pixels->at(tempByteIndex++) = tempData[3];
-          }
-        }
-      } while (tempByteIndex < ui32Size);
+        qint64 n = qMin(filled, bytes - filled);
+        memcpy(out + filled, out, n);
+        filled += n;
+      }
+      src += bpp;
     }
     else
     {
-      fsPicture.close();
-      img = QImage(1, 1, QImage::Format_RGB32);
-      img.fill(Qt::red);
-      *success = false;
-      return img;
+      if (bytes > end - src)
+        return false;
+      memcpy(out, src, bytes);
+      src += bytes;
+    }
+    out += bytes;
+  }
+  return true;
+}
+
+QImage ImageLoader::loadTga(const char *filePath, bool *success)
+{
+  QImage img;
+  *success = false;
+
+  QFile file(QString::fromLocal8Bit(filePath));
+  if (!file.open(QIODevice::ReadOnly))
+  {
+    img = QImage(1, 1, QImage::Format_RGB32);
+    img.fill(Qt::red);
+    return img;
+  }
+
+  /* Mapped, the pixels of uncompressed files are read in place */
+  qint64 length = file.size();
+  QByteArray buffered;
+  const uchar *data = length > 0 ? file.map(0, length) : nullptr;
+  if (!data)
+  {
+    buffered = file.readAll();
+    data = reinterpret_cast<const uchar *>(buffered.constData());
+    length = buffered.size();
+  }
+
+  const int header_size = 18;
+  int type = length >= header_size ? data[2] : 0;
+  int bpp = length >= header_size ? data[16] : 0;
+  bool truecolor = (type == 2 || type == 10) && (bpp == 24 || bpp == 32);
+  bool gray = (type == 3 || type == 11) && bpp == 8;
+  if (!truecolor && !gray)
+  {
+    /* Palettes and 16 bit pixels are left to Qt's TGA plugin, if present */
+    if (img.load(file.fileName()))
+    {
+      *success = true;
+      return PixelFormat::toCanonical(img, "ImageLoader::loadTga");
     }
+    img = QImage(1, 1, QImage::Format_RGB32);
+    img.fill(Qt::red);
+    return img;
+  }
 
-    fsPicture.close();
-    img = QImage(ui32Width, ui32Height, QImage::Format_RGBA8888);
-    int pixelSize = ui32BpP == 32 ? 4 : 3;
-    // TODO: write direct into img
+  int id_length = data[0];
+  int palette_bytes = (data[5] | (data[6] << 8)) * ((data[7] + 7) / 8);
+  int width = data[12] | (data[13] << 8);
+  int height = data[14] | (data[15] << 8);
+  int descriptor = data[17];
+  int pixel_size = bpp / 8;
+  qint64 offset = header_size + id_length + palette_bytes;
+  qint64 size = qint64(width) * height * pixel_size;
 
-    for (unsigned int x = 0; x < ui32Width; x++)
+  const uchar *pixels = nullptr;
+  QByteArray expanded;
+  if (width > 0 && height > 0 && offset <= length)
+  {
+    if ((type == 10 || type == 11) && size <= INT_MAX)
     {
-      for (unsigned int y = 0; y < ui32Height; y++)
-      {
-        int vala = pixelSize == 4
-                       ? vui8Pixels->at(y * ui32Width * pixelSize +
-                                        x * pixelSize + 3)
-                       : 255;
-        int valr = vui8Pixels->at(y * ui32Width * pixelSize +
-                                  x * pixelSize + 2);
-        int valg = vui8Pixels->at(y * ui32Width * pixelSize +
-                                  x * pixelSize + 1);
-        int valb =
-            vui8Pixels->at(y * ui32Width * pixelSize + x * pixelSize);
-        QColor value(valr, valg, valb, vala);
-        img.setPixelColor(x, y, value);
-      }
+      expanded = QByteArray(int(size), Qt::Uninitialized);
+      if (decode_rle(data + offset, length - offset, reinterpret_cast<uchar *>(expanded.data()), size, pixel_size))
+        pixels = reinterpret_cast<const uchar *>(expanded.constData());
+    }
+    else if (size <= length - offset)
+    {
+      pixels = data + offset;
     }
-    img = img.mirrored();
   }
+  if (!pixels)
+  {
+    qWarning() << "truncated tga" << file.fileName();
+    img = QImage(1, 1, QImage::Format_RGB32);
+    img.fill(Qt::red);
+    return img;
+  }
+
+  /* Rows are stored bottom up unless the descriptor says top down: pick
+   * the destination row instead of flipping afterwards */
+  img = QImage(width, height, PixelFormat::canonical);
+  if (img.isNull())
+  {
+    /* 4 bytes per pixel out of as little as 1 per pixel in */
+    qWarning() << "tga too large" << file.fileName() << width << "x" << height;
+    img = QImage(1, 1, QImage::Format_RGB32);
+    img.fill(Qt::red);
+    return img;
+  }
+  bool top_down = descriptor & 0x20;
+  int line = width * pixel_size;
+  for (int y = 0; y < height; y++)
+  {
+    const uchar *src = pixels + qint64(y) * line;
+    uchar *dst = img.scanLine(top_down ? y : height - 1 - y);
+    if (bpp == 32)
+      swizzle_bgra(src, dst, width);
+    else if (bpp == 24)
+      swizzle_bgr(src, dst, width);
+    else
+      swizzle_gray(src, dst, width);
+  }
+  /* Right to left files are rare enough for a copy */
+  if (descriptor & 0x10)
+    img = img.mirrored(true, false);
 
   *success = true;
   return img;
@@ -221,3 +317,20 @@ QSize ImageLoader::maxImagesSize(QList<QImage> image_list)
   }
   return s;
 }
+
+QSize ImageLoader::imageSize(QString fileName)
+{
+  if (QFileInfo(fileName).completeSuffix() == "tga")
+  {
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+      return QSize();
+    QByteArray header = file.read(18);
+    if (header.size() < 18)
+      return QSize();
+    const uchar *h = reinterpret_cast<const uchar *>(header.constData());
+    QSize s(h[12] | (h[13] << 8), h[14] | (h[15] << 8));
+    return s.isEmpty() ? QSize() : s;
+  }
+  return QImageReader(fileName).size();
+}
@@ -33,6 +33,9 @@ public:
   static QImage loadImage(QString fileName, bool *success);
   static QList<QImage> loadImages(QString fileName);
   static QSize maxImagesSize(QList<QImage> image_list);
+  /* Size read from the file header without decoding the pixels, or an
+   * invalid size when it cannot be told */
+  static QSize imageSize(QString fileName);
 };
 
 #endif // IMAGELOADER_H
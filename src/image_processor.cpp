@@ -18,11 +18,17 @@
  */
 
 #include "image_processor.h"
+#include "map_cache.h"
+#include "map_exporter.h"
+#include "memory_budget.h"
+#include "project_archive.h"
 
 #include <cmath>
 
-#include <QApplication>
+#include <QCryptographicHash>
+#include <QDataStream>
 #include <QDebug>
+#include <QThread>
 #include <QtConcurrent/QtConcurrent>
 
 using namespace cimg_library;
@@ -123,11 +129,15 @@ ImageProcessor::ImageProcessor(QObject *parent) : QObject(parent)
 
   animation_list.append(Animation("Default"));
   current_animation = getAnimation("Default");
+
+  MemoryBudget::instance()->add(this);
 }
 
 ImageProcessor::~ImageProcessor()
 {
+  MemoryBudget::instance()->remove(this);
   active = false;
+  stop_maps();
   //  while (normal_counter > 0)
   //    QThread::msleep(10);
   //  while (parallax_counter > 0)
@@ -149,51 +159,126 @@ int ImageProcessor::loadImage(QString fileName, QImage image, QString basePath)
   {
     m_absolute_path = basePath;
   }
-  texture = image;
+  image = PixelFormat::toCanonical(image, "ImageProcessor::loadImage");
+  {
+    QMutexLocker locker(&frames_mutex);
+    texture = image;
+  }
   last_texture = image;
   qDebug() << image.hasAlphaChannel();
+  /* Base images share the diffuse pixels until a custom map replaces them.
+   * Neighbours and overlays stay null until they are needed or painted. */
   sprite.set_image(TextureTypes::Diffuse, image);
   sprite.set_image(TextureTypes::Heightmap, image);
   sprite.set_image(TextureTypes::SpecularBase, image);
   sprite.set_image(TextureTypes::OcclussionBase, image);
-  QImage n(3 * image.size(), QImage::Format_RGBA8888_Premultiplied);
-  n.fill(0);
-  sprite.set_image(TextureTypes::Neighbours, n);
-  n = QImage(image.width(), image.height(),
-             QImage::Format_RGBA8888_Premultiplied);
-  n.fill(0);
-  sprite.set_image(TextureTypes::NormalOverlay, n);
-  sprite.set_image(TextureTypes::HeightmapOverlay, n);
-  sprite.set_image(TextureTypes::SpecularOverlay, n);
-  sprite.set_image(TextureTypes::ParallaxOverlay, n);
-  sprite.set_image(TextureTypes::OcclussionOverlay, n);
-  sprite.set_image(TextureTypes::TextureOverlay, n);
+  sprite.set_image(TextureTypes::Neighbours, QImage());
+  sprite.set_image(TextureTypes::NormalOverlay, QImage());
+  sprite.set_image(TextureTypes::HeightmapOverlay, QImage());
+  sprite.set_image(TextureTypes::SpecularOverlay, QImage());
+  sprite.set_image(TextureTypes::ParallaxOverlay, QImage());
+  sprite.set_image(TextureTypes::OcclussionOverlay, QImage());
+  sprite.set_image(TextureTypes::TextureOverlay, QImage());
   sprite.fileName = fileName;
   set_current_frame_id(0);
-  get_normal_overlay();
 
   if (!customHeightMap)
   {
     fill_neighbours(fileName, image);
   }
 
-  recalculate_timer.start();
+  /* Headless processors compute synchronously and never poll for edits */
+  if (!headless)
+    recalculate_timer.start();
   return 0;
 }
 
 void ImageProcessor::set_current_heightmap(int id)
 {
   if (tileable)
+  {
+    ensure_neighbours();
     sprite.get_image(TextureTypes::Neighbours, &heightmap);
+  }
   else
     sprite.get_image(TextureTypes::Heightmap, &heightmap);
 
-  current_heightmap = QImage2CImg(heightmap.convertToFormat(QImage::Format_RGBA8888));
-  m_gray = QImage2CImg(heightmap.convertToFormat(QImage::Format_Grayscale8));
+  /* Only the alpha channel of current_heightmap is used, which is the same
+   * premultiplied or not, so the canonical image is read as is. Both planes
+   * are refilled in place and keep their buffers between recomputes. */
+  heightmap = PixelFormat::toCanonical(heightmap, "set_current_heightmap");
+  int w = heightmap.width(), h = heightmap.height();
+  current_heightmap.assign(w, h, 1, 4);
+  for (int y = 0; y < h; y++)
+  {
+    const uchar *src = heightmap.constScanLine(y);
+    for (int x = 0; x < w; x++, src += 4)
+    {
+      for (int c = 0; c < 4; c++)
+        current_heightmap(x, y, 0, c) = src[c];
+    }
+  }
+  fill_gray_plane(heightmap, m_gray);
+}
+
+void ImageProcessor::fill_gray_plane(const QImage &image, CImg<float> &gray)
+{
+  /* Same values as converting to Format_Grayscale8, without the image */
+  gray.assign(image.width(), image.height(), 1, 1);
+  for (int y = 0; y < image.height(); y++)
+  {
+    const uchar *src = image.constScanLine(y);
+    for (int x = 0; x < image.width(); x++, src += 4)
+      gray(x, y) = qGray(qUnpremultiply(qRgba(src[0], src[1], src[2], src[3])));
+  }
+}
+
+void ImageProcessor::store_map(CImg<float> &work, CImg<float> &map)
+{
+  if (!tileable)
+  {
+    /* The previous map buffer goes back to the arena with work */
+    map.swap(work);
+    return;
+  }
+
+  QSize s = sprite.size();
+  map.assign(s.width(), s.height(), 1, work.spectrum());
+  map.fill(0);
+  map.draw_image(-s.width(), -s.height(), work);
 }
 
 void ImageProcessor::calculate()
 {
+  if (calculation_deferred)
+    return;
+
+  /* Held for the whole rebuild: eviction, stored maps and partial jobs all
+   * wait for it or back off. It is recursive, as the map jobs below take it
+   * again. */
+  QMutexLocker locker(&heightmap_mutex);
+
+  /* In flight until it returns, whichever way */
+  struct Running
+  {
+    QAtomicInt &jobs;
+    ~Running() { jobs.deref(); }
+  } running{maps_jobs};
+  maps_jobs.ref();
+
+  /* The key describes the maps built here; the disk cache reuses it */
+  QByteArray key = fingerprint();
+  if (MapCache::enabled())
+  {
+    bool hit = install_cached_maps(key);
+    MapCache::count(hit);
+    if (hit)
+    {
+      maps_key = key;
+      return;
+    }
+  }
+
   set_current_heightmap(current_frame_id);
   calculate_distance();
   calculate_heightmap();
@@ -201,33 +286,255 @@ void ImageProcessor::calculate()
   calculate_parallax();
   calculate_specular();
   calculate_occlusion();
+
+  maps_key = key;
+  if (MapCache::enabled())
+    store_cached_maps(key);
+}
+
+static void hash_image(QCryptographicHash *hash, const QImage &image)
+{
+  QByteArray header;
+  QDataStream stream(&header, QIODevice::WriteOnly);
+  stream << image.width() << image.height() << int(image.format());
+  hash->addData(header);
+
+  /* Scanline padding is not part of the content */
+  int line = image.width() * image.depth() / 8;
+  for (int y = 0; y < image.height(); y++)
+    hash->addData(reinterpret_cast<const char *>(image.constScanLine(y)), line);
+}
+
+QByteArray ImageProcessor::fingerprint(QImage diffuse)
+{
+  if (diffuse.isNull())
+    sprite.get_image(TextureTypes::Diffuse, &diffuse);
+  diffuse = PixelFormat::toCanonical(diffuse, "ImageProcessor::fingerprint");
+
+  int h, v;
+  bool tiled;
+  {
+    QMutexLocker locker(&frames_mutex);
+    h = h_frames;
+    v = v_frames;
+    tiled = neighbours_tiled;
+  }
+
+  QByteArray settings_data;
+  QDataStream stream(&settings_data, QIODevice::WriteOnly);
+  /* The frame layout decides the neighbours of each frame */
+  stream << MapCache::generator_version << current_frame_id << h << v << tiled;
+  stream << normal_depth << normal_blur_radius << normal_bisel_depth << normal_bisel_distance
+         << normal_bisel_blur_radius << normal_bisel_soft << normalInvertX << normalInvertY
+         << normalInvertZ << qint8(gradient_end) << tileable << tileX << tileY;
+  stream << int(parallax_type) << parallax_max << parallax_min << parallax_focus << parallax_soft
+         << parallax_quantization << parallax_brightness << parallax_contrast
+         << parallax_erode_dilate << parallax_invert;
+  stream << specular_blur << specular_bright << specular_contrast << specular_thresh
+         << specular_invert;
+  stream << occlusion_blur << occlusion_bright << occlusion_contrast << occlusion_thresh
+         << occlusion_invert << occlusion_distance_mode << occlusion_distance;
+
+  QCryptographicHash hash(QCryptographicHash::Sha1);
+  hash.addData(settings_data);
+  hash_image(&hash, diffuse);
+
+  /* Base maps only count when they are not the diffuse itself */
+  TextureTypes bases[] = {TextureTypes::Heightmap, TextureTypes::SpecularBase, TextureTypes::OcclussionBase};
+  for (TextureTypes type : bases)
+  {
+    QImage base;
+    sprite.get_image(type, &base);
+    if (!base.isNull() && base.cacheKey() != diffuse.cacheKey())
+    {
+      hash.addData(QByteArray::number(int(type)));
+      hash_image(&hash, base);
+    }
+  }
+
+  if (tileable && neighbours_custom)
+  {
+    QImage neighbours;
+    sprite.get_image(TextureTypes::Neighbours, &neighbours);
+    hash.addData("neighbours");
+    hash_image(&hash, neighbours);
+  }
+
+  TextureTypes overlays[] = {TextureTypes::NormalOverlay, TextureTypes::HeightmapOverlay,
+                             TextureTypes::SpecularOverlay, TextureTypes::ParallaxOverlay,
+                             TextureTypes::OcclussionOverlay};
+  for (TextureTypes type : overlays)
+  {
+    /* Overlays still encoded from a project are not decoded for this */
+    TiledOverlay *overlay = sprite.get_overlay(type);
+    if (overlay->is_empty())
+      continue;
+    hash.addData(QByteArray::number(int(type)) + " ");
+    hash.addData(overlay->digest());
+  }
+
+  return hash.result();
+}
+
+bool ImageProcessor::install_cached_maps(const QByteArray &key)
+{
+  QImage normal, specular, parallax, occlusion;
+  if (!MapCache::load(key, TextureTypes::Normal, &normal) ||
+      !MapCache::load(key, TextureTypes::Specular, &specular) ||
+      !MapCache::load(key, TextureTypes::Parallax, &parallax) ||
+      !MapCache::load(key, TextureTypes::Occlussion, &occlusion))
+    return false;
+
+  return install_maps(normal, specular, parallax, occlusion);
+}
+
+bool ImageProcessor::install_maps(QImage normal, QImage specular, QImage parallax, QImage occlusion)
+{
+  QSize s = sprite.size();
+  QImage maps[] = {normal, specular, parallax, occlusion};
+  for (const QImage &map : maps)
+  {
+    if (map.size() != s)
+      return false;
+  }
+
+  QMutex *locks[] = {&normal_mutex, &parallax_mutex, &specular_mutex, &occlusion_mutex, &heightmap_mutex};
+  int locked = 0;
+  for (; locked < 5; locked++)
+  {
+    if (!locks[locked]->tryLock())
+      break;
+  }
+  if (locked == 5)
+  {
+    /* Planes are rebuilt in full by the first edit, as after an eviction */
+    drop_planes();
+    /* Kept in the same compact formats as computed maps */
+    sprite.set_image(TextureTypes::Normal, MapExporter::file_image(TextureTypes::Normal, normal));
+    sprite.set_image(TextureTypes::Specular, MapExporter::file_image(TextureTypes::Specular, specular));
+    sprite.set_image(TextureTypes::Parallax, MapExporter::file_image(TextureTypes::Parallax, parallax));
+    sprite.set_image(TextureTypes::Occlussion, MapExporter::file_image(TextureTypes::Occlussion, occlusion));
+  }
+  bool installed = locked == 5;
+  while (locked > 0)
+    locks[--locked]->unlock();
+
+  if (installed)
+  {
+    map_ready(TextureTypes::Normal);
+    map_ready(TextureTypes::Specular);
+    map_ready(TextureTypes::Parallax);
+    map_ready(TextureTypes::Occlussion);
+    processed();
+  }
+  return installed;
+}
+
+QByteArray ImageProcessor::maps_fingerprint()
+{
+  /* Maps that are missing, being recomputed or stale with a recompute
+   * pending have none. This never waits: it runs on the GUI thread */
+  if (evicted.loadAcquire() || calculation_deferred || maps_jobs.loadAcquire() > 0 ||
+      normal_counter > 0 || parallax_counter > 0 || specular_counter > 0 || occlussion_counter > 0)
+    return QByteArray();
+
+  /* Known only when the maps came from a full calculation or a project;
+   * partial recomputes clear it */
+  return maps_key;
+}
+
+bool ImageProcessor::install_stored_maps(const QByteArray &key, QImage normal, QImage specular, QImage parallax, QImage occlusion)
+{
+  /* Maps saved with a project are still current if the inputs and settings
+   * hash the same; they also cover the edits made while restoring those */
+  if (key.isEmpty() || key != fingerprint() || !install_maps(normal, specular, parallax, occlusion))
+    return false;
+
+  normal_counter = specular_counter = parallax_counter = occlussion_counter = 0;
+  calculation_deferred = false;
+  evicted.storeRelease(0);
+  maps_key = key;
+  return true;
+}
+
+void ImageProcessor::store_cached_maps(const QByteArray &key)
+{
+  /* A job skipped or requested meanwhile means the maps may be stale */
+  if (normal_counter > 0 || parallax_counter > 0 || specular_counter > 0 || occlussion_counter > 0)
+    return;
+
+  QImage normal, specular, parallax, occlusion;
+  sprite.get_image(TextureTypes::Normal, &normal);
+  sprite.get_image(TextureTypes::Specular, &specular);
+  sprite.get_image(TextureTypes::Parallax, &parallax);
+  sprite.get_image(TextureTypes::Occlussion, &occlusion);
+
+  auto store = [key, normal, specular, parallax, occlusion]() {
+    MapCache::store(key, TextureTypes::Normal, normal);
+    MapCache::store(key, TextureTypes::Specular, specular);
+    MapCache::store(key, TextureTypes::Parallax, parallax);
+    MapCache::store(key, TextureTypes::Occlussion, occlusion);
+  };
+
+  /* Encoding stays off the gui thread; batch runs wait for it */
+  if (headless)
+    store();
+  else
+    QtConcurrent::run(store);
+}
+
+QFuture<void> ImageProcessor::run_job(std::function<void()> job, QThreadPool *pool)
+{
+  /* Counted from the moment it is queued */
+  maps_jobs.ref();
+  auto counted = [this, job]() {
+    job();
+    maps_jobs.deref();
+  };
+  return pool ? QtConcurrent::run(pool, counted) : QtConcurrent::run(counted);
 }
 
 void ImageProcessor::recalculate()
 {
+  /* Edits to maps that are not there yet are covered by the full rebuild */
+  if (evicted.loadAcquire())
+  {
+    if (normal_counter > 0 || specular_counter > 0 || parallax_counter > 0 || occlussion_counter > 0)
+    {
+      normal_counter = specular_counter = parallax_counter = occlussion_counter = 0;
+      restore_maps(false);
+    }
+    return;
+  }
+
+  /* Any partial recompute leaves maps no full fingerprint describes */
+  if (normal_counter > 0 || specular_counter > 0 || parallax_counter > 0 || occlussion_counter > 0)
+    maps_key.clear();
+
   if (normal_counter > 0 && normal_mutex.tryLock())
   {
 
     normal_mutex.unlock();
-    QtConcurrent::run(this, &ImageProcessor::generate_normal_map, enhance_requested, bump_requested,
-                      distance_requested, rect_requested);
+    bool enhance = enhance_requested, bump = bump_requested, distance = distance_requested;
+    QRect rect = rect_requested;
+    run_job([=]() { generate_normal_map(enhance, bump, distance, rect); });
     enhance_requested = bump_requested = distance_requested = false;
     rect_requested = QRect(0, 0, 0, 0);
     normal_counter = 0;
   }
   if (specular_counter > 0)
   {
-    QtConcurrent::run(this, &ImageProcessor::calculate_specular);
+    run_job([this]() { calculate_specular(); });
     specular_counter = 0;
   }
   if (parallax_counter > 0)
   {
-    QtConcurrent::run(this, &ImageProcessor::calculate_parallax);
+    run_job([this]() { calculate_parallax(); });
     parallax_counter = 0;
   }
   if (occlussion_counter > 0)
   {
-    QtConcurrent::run(this, &ImageProcessor::calculate_occlusion);
+    run_job([this]() { calculate_occlusion(); });
     occlussion_counter = 0;
   }
 }
@@ -240,27 +547,18 @@ void ImageProcessor::calculate_parallax()
     return;
   }
 
-  QImage ovi = get_parallax_overlay();
-
-  CImg<float> ov(QImage2CImg(ovi));
-  CImg<float> alpha = ov.get_channel(3) / 255.0;
+  ScratchArena::Plane work;
+  modify_parallax(*work);
+  store_map(*work, current_parallax);
 
-  current_parallax = modify_parallax();
-
-  if (tileable)
-  {
-
-    QSize s = sprite.size();
-    current_parallax.crop(s.width(), s.height(), 2 * s.width() - 1, 2 * s.height() - 1);
-  }
-
-  current_parallax = (current_parallax.mul(1.0 - alpha) + ov.get_channel(0)).cut(0.0, 255.0);
+  apply_overlay(TextureTypes::ParallaxOverlay, current_parallax);
 
   parallax_ready.lock();
   sprite.set_image(TextureTypes::Parallax, CImg2QImage(current_parallax));
 
   parallax_ready.unlock();
 
+  map_ready(TextureTypes::Parallax);
   processed();
   parallax_mutex.unlock();
 }
@@ -273,24 +571,17 @@ void ImageProcessor::calculate_specular()
     return;
   }
 
-  current_specular = modify_specular();
-  QImage ovi = get_specular_overlay();
+  ScratchArena::Plane work;
+  modify_specular(*work);
+  store_map(*work, current_specular);
 
-  CImg<float> ov(QImage2CImg(ovi));
-  CImg<float> alpha = ov.get_channel(3) / 255.0;
-
-  if (tileable)
-  {
-    QSize s = sprite.size();
-    current_specular.crop(s.width(), s.height(), 2 * s.width() - 1, 2 * s.height() - 1);
-  }
-
-  current_specular = (current_specular.mul(1.0 - alpha) + ov.get_channel(0)).cut(0.0, 255.0);
+  apply_overlay(TextureTypes::SpecularOverlay, current_specular);
 
   specular_ready.lock();
   sprite.set_image(TextureTypes::Specular, CImg2QImage(current_specular));
   specular_ready.unlock();
 
+  map_ready(TextureTypes::Specular);
   processed();
   specular_mutex.unlock();
 }
@@ -303,24 +594,17 @@ void ImageProcessor::calculate_occlusion()
     return;
   }
 
-  current_occlusion = modify_occlusion();
-  QImage ovi = get_occlusion_overlay();
-
-  CImg<float> ov(QImage2CImg(ovi));
-  CImg<float> alpha = ov.get_channel(3) / 255.0;
-
   /* TODO IMPORTANT make occlussion tileable */
-  QSize s = sprite.size();
-  if (tileable)
-  {
-    current_occlusion.crop(s.width(), s.height(), 2 * s.width() - 1, 2 * s.height() - 1);
-  }
+  ScratchArena::Plane work;
+  modify_occlusion(*work);
+  store_map(*work, current_occlusion);
 
-  current_occlusion = (current_occlusion.mul(1.0 - alpha) + ov.get_channel(0)).cut(0.0, 255.0);
+  apply_overlay(TextureTypes::OcclussionOverlay, current_occlusion);
   occlussion_ready.lock();
   sprite.set_image(TextureTypes::Occlussion, CImg2QImage(current_occlusion));
   occlussion_ready.unlock();
 
+  map_ready(TextureTypes::Occlussion);
   processed();
   occlusion_mutex.unlock();
 }
@@ -332,15 +616,20 @@ void ImageProcessor::calculate_heightmap()
 
 int ImageProcessor::fill_neighbours(QString fileName, QImage image)
 {
+  Q_UNUSED(image);
 
-  QSize s = sprite.size();
-  image = image.scaled(s);
-
+  /* The diffuse is tiled into the 3x3 grid when the neighbours are first used */
   for (int x = 0; x < 3; x++)
   {
     for (int y = 0; y < 3; y++)
-      set_neighbour_image(fileName, image, x, y);
+      sprite.neighbours_paths[x][y] = fileName;
   }
+  {
+    QMutexLocker locker(&frames_mutex);
+    neighbours_tiled = true;
+  }
+  neighbours_custom = false;
+  sprite.set_image(TextureTypes::Neighbours, QImage());
   calculate();
 
   return 0;
@@ -348,22 +637,68 @@ int ImageProcessor::fill_neighbours(QString fileName, QImage image)
 
 void ImageProcessor::reset_neighbours()
 {
-  QImage diffuse;
+  /* Rebuilt from the frames when the neighbours are first used */
+  {
+    QMutexLocker locker(&frames_mutex);
+    neighbours_tiled = false;
+  }
+  neighbours_custom = false;
+  sprite.set_image(TextureTypes::Neighbours, QImage());
+}
+
+void ImageProcessor::ensure_neighbours()
+{
   QImage neighbours;
   sprite.get_image(TextureTypes::Neighbours, &neighbours);
-  sprite.get_image(TextureTypes::Diffuse, &diffuse);
-  float w = (float)texture.width() / h_frames;
-  float h = (float)texture.height() / v_frames;
-  QRect neighbor_rect(0, 0, w, h);
+  if (!neighbours.isNull())
+    return;
+
+  /* This runs on pool threads while the gui thread may replace the texture
+   * or split it again, so the inputs are copied under frames_mutex first */
+  QImage source;
+  bool tiled;
+  int columns, rows;
+  QVector<QRect> frames;
+  {
+    QMutexLocker locker(&frames_mutex);
+    source = texture;
+    tiled = neighbours_tiled;
+    columns = h_frames;
+    rows = v_frames;
+    for (int i = 0; i < vertices.count(); i++)
+      frames.append(getFrameRect(i));
+  }
+
+  neighbours = QImage(3 * sprite.size(), PixelFormat::canonical);
   QPainter p(&neighbours);
   p.setCompositionMode(QPainter::CompositionMode_Source);
+  neighbours.fill(Qt::transparent);
+
+  if (tiled)
+  {
+    QImage diffuse;
+    sprite.get_image(TextureTypes::Diffuse, &diffuse);
+    QSize s = sprite.size();
+    PixelFormat::expect(diffuse, PixelFormat::canonical, "ensure_neighbours");
+    for (int x = 0; x < 3; x++)
+    {
+      for (int y = 0; y < 3; y++)
+        p.drawImage(QRect(x * s.width(), y * s.height(), s.width(), s.height()), diffuse);
+    }
+    p.end();
+    sprite.set_image(TextureTypes::Neighbours, neighbours);
+    return;
+  }
+
+  float w = (float)source.width() / columns;
+  float h = (float)source.height() / rows;
+  QRect neighbor_rect(0, 0, w, h);
   int base_top = 0, base_left = 0;
 
-  neighbours.fill(Qt::transparent);
-  for (int i = 0; i < h_frames; i++)
+  for (int i = 0; i < columns; i++)
   {
     base_left = i * w * 3;
-    for (int j = 0; j < v_frames; j++)
+    for (int j = 0; j < rows; j++)
     {
       base_top = j * h * 3;
       neighbor_rect.moveLeft(base_left);
@@ -372,8 +707,14 @@ void ImageProcessor::reset_neighbours()
       {
         for (int y = -1; y <= 1; y++)
         {
-          QImage neighbour = getFrameImage(i + x, j + y);
-          p.drawImage(neighbor_rect, neighbour);
+          /* Frames outside the sheet leave their cell transparent */
+          int frame = columns * (j + y) + i + x;
+          if (i + x >= 0 && j + y >= 0 && i + x < columns && j + y < rows && frame < frames.count())
+          {
+            QImage neighbour = source.copy(frames[frame]);
+            PixelFormat::expect(neighbour, PixelFormat::canonical, "ensure_neighbours frame");
+            p.drawImage(neighbor_rect, neighbour);
+          }
           neighbor_rect.moveTop(neighbor_rect.top() + h);
         }
         neighbor_rect.moveTop(base_top);
@@ -381,13 +722,14 @@ void ImageProcessor::reset_neighbours()
       }
     }
   }
+  p.end();
 
   sprite.set_image(TextureTypes::Neighbours, neighbours);
 }
 
 int ImageProcessor::empty_neighbour(int x, int y)
 {
-  QImage image(sprite.size(), QImage::Format_RGBA64_Premultiplied);
+  QImage image(sprite.size(), PixelFormat::canonical);
   image.fill(0);
   set_neighbour_image("", image, x, y);
 
@@ -397,6 +739,9 @@ int ImageProcessor::empty_neighbour(int x, int y)
 int ImageProcessor::set_neighbour_image(QString fileName, QImage image, int x,
                                         int y)
 {
+  image = PixelFormat::toCanonical(image, "set_neighbour_image");
+  ensure_neighbours();
+  neighbours_custom = true;
   QImage neighbours;
   sprite.get_image(TextureTypes::Neighbours, &neighbours);
   QSize s = sprite.size();
@@ -404,6 +749,7 @@ int ImageProcessor::set_neighbour_image(QString fileName, QImage image, int x,
   int aleft = x * s.width();
   int atop = y * s.height();
   QRect r(aleft, atop, s.width(), s.height());
+  PixelFormat::expect(image, PixelFormat::canonical, "loadNeighbour");
   QPainter p(&neighbours);
   p.setCompositionMode(QPainter::CompositionMode_Source);
   p.drawImage(r, image);
@@ -415,6 +761,9 @@ int ImageProcessor::set_neighbour_image(QString fileName, QImage image, int x,
 int ImageProcessor::set_neighbour_image(QImage image, int x,
                                         int y)
 {
+  image = PixelFormat::toCanonical(image, "set_neighbour_image");
+  ensure_neighbours();
+  neighbours_custom = true;
   QImage neighbours;
   sprite.get_image(TextureTypes::Neighbours, &neighbours);
 
@@ -444,6 +793,15 @@ QImage ImageProcessor::get_neighbour(int x, int y)
 {
   QImage neighbours;
   sprite.get_image(TextureTypes::Neighbours, &neighbours);
+  if (neighbours.isNull() && h_frames == 1 && v_frames == 1)
+  {
+    /* Answer single frame sprites without building the whole grid */
+    if (neighbours_tiled || (x == 1 && y == 1))
+      return texture.copy();
+    return getFrameImage(-1);
+  }
+  ensure_neighbours();
+  sprite.get_image(TextureTypes::Neighbours, &neighbours);
   QSize s = sprite.size();
   s.setHeight(s.height() / v_frames);
   s.setWidth(s.width() / h_frames);
@@ -486,7 +844,7 @@ int ImageProcessor::loadSpecularMap(QString fileName, QImage specular)
   }
 
   QSize s = sprite.size();
-  specular = specular.scaled(s.width(), s.height());
+  specular = PixelFormat::toCanonical(specular.scaled(s.width(), s.height()), "loadSpecularMap");
   sprite.set_image(TextureTypes::SpecularBase, specular);
   calculate();
 
@@ -507,7 +865,7 @@ int ImageProcessor::loadHeightMap(QString fileName, QImage height)
   }
 
   QSize s = sprite.size();
-  height = height.scaled(s.width(), s.height());
+  height = PixelFormat::toCanonical(height.scaled(s.width(), s.height()), "loadHeightMap");
   sprite.set_image(TextureTypes::Heightmap, height);
   calculate();
 
@@ -519,16 +877,14 @@ void ImageProcessor::calculate_gradient() {}
 void ImageProcessor::calculate_texture()
 {
   sprite.get_image(TextureTypes::Diffuse, &texture);
-  QPainter p(&texture);
-  QImage overlay;
-  sprite.get_image(TextureTypes::TextureOverlay, &overlay);
-  p.drawImage(QPoint(0, 0), overlay);
+  draw_overlay(TextureTypes::TextureOverlay, &texture);
 }
 
 void ImageProcessor::calculate_distance()
 {
-  m_distance = QImage2CImg(heightmap.convertToFormat(QImage::Format_RGBA8888));
-  m_distance.channel(3).threshold(0.1) * 255.0f;
+  m_distance.assign(current_heightmap.width(), current_heightmap.height(), 1, 1);
+  cimg_forXY(m_distance, x, y) m_distance(x, y) = current_heightmap(x, y, 0, 3);
+  m_distance.threshold(0.1);
   cimg_for_borderXY(m_distance, x, y, 1) m_distance(x, y) = 0.0;
   m_distance.distance(0.0f);
 
@@ -612,9 +968,9 @@ void ImageProcessor::set_tileable(bool t)
 
 bool ImageProcessor::get_tileable() { return tileable; }
 
-CImg<float> ImageProcessor::modify_distance()
+void ImageProcessor::modify_distance(CImg<float> &dist)
 {
-  CImg<float> dist(m_distance);
+  dist = m_distance;
 
   if (normal_bisel_distance != 0)
   {
@@ -622,57 +978,64 @@ CImg<float> ImageProcessor::modify_distance()
   }
   else
   {
-    dist.threshold(0.1f) * 255.0;
+    dist.threshold(0.1f);
   }
 
   dist.cut(0, 255);
   if (normal_bisel_soft)
   {
-    dist = (1.0 - (dist / 255.0 - 1).pow(2)).sqrt() * 255.0;
+    cimg_for(dist, p, float)
+    {
+      float t = *p / 255.0 - 1;
+      *p = std::sqrt(1.0 - t * t) * 255.0;
+    }
   }
-  return dist;
 }
 
-CImg<float> ImageProcessor::modify_occlusion()
+void ImageProcessor::modify_occlusion(CImg<float> &occ)
 {
   QMutexLocker locker(&heightmap_mutex);
   set_current_heightmap(current_frame_id);
 
-  CImg<float> occ(QImage2CImg(heightmap.convertToFormat(QImage::Format_Grayscale8)));
+  ScratchArena::borrow(occ, m_gray.width(), m_gray.height());
+  occ = m_gray;
 
   if (occlusion_invert)
   {
-    occ = 255.0f - occ;
+    cimg_for(occ, p, float) *p = 255.0f - *p;
   }
 
   if (occlusion_distance_mode)
   {
-    occ.threshold(occlusion_thresh) * 255.0;
+    occ.threshold(occlusion_thresh);
 
     if (occlusion_distance != 0)
     {
       occ.distance(0.0);
       occ *= 255.0 / occlusion_distance;
     }
-    occ.cut(0, 255);
-    occ = (1.0 - (occ / 255.0 - 1).pow(2)).sqrt() * 255.0;
+    cimg_for(occ, p, float)
+    {
+      float t = qBound(0.0f, *p, 255.0f) / 255.0 - 1;
+      *p = std::sqrt(1.0 - t * t) * 255.0;
+    }
   }
 
-  occ = occlusion_contrast * occ + occlusion_thresh * (1 - occlusion_contrast);
-  occ += occlusion_bright;
-  occ.cut(0, 255);
-  occ = occ.blur(occlusion_blur);
-
-  return occ;
+  cimg_for(occ, p, float)
+  {
+    float v = occlusion_contrast * *p + occlusion_thresh * (1 - occlusion_contrast) + occlusion_bright;
+    *p = qBound(0.0f, v, 255.0f);
+  }
+  occ.blur(occlusion_blur);
 }
 
-CImg<float> ImageProcessor::modify_parallax()
+void ImageProcessor::modify_parallax(CImg<float> &par)
 {
   QMutexLocker locker(&heightmap_mutex);
   set_current_heightmap(current_frame_id);
 
-  CImg<float> par(QImage2CImg(heightmap.convertToFormat(QImage::Format_Grayscale8)));
-  CImg<float> dist = modify_distance();
+  ScratchArena::borrow(par, m_gray.width(), m_gray.height());
+  par = m_gray;
   switch (parallax_type)
   {
     case ParallaxType::Binary:
@@ -683,7 +1046,7 @@ CImg<float> ImageProcessor::modify_parallax()
 
       if (!parallax_invert)
       {
-        par = 255.0 - par;
+        cimg_for(par, p, float) *p = 255.0f - *p;
       }
 
       if (parallax_erode_dilate > 0)
@@ -700,13 +1063,24 @@ CImg<float> ImageProcessor::modify_parallax()
     }
     case ParallaxType::HeightMap:
     {
-      par = (par + dist - 1) / 2.0 + 0.5;
-      par = parallax_contrast * par + parallax_max * (1 - parallax_contrast);
-      par += parallax_brightness;
+      /* The distance is walked in step with par, so it has to be rebuilt
+       * when it was computed for another size (e.g. before tileable changed) */
+      if (m_distance.is_empty() || m_distance.width() != par.width() || m_distance.height() != par.height())
+        calculate_distance();
+      ScratchArena::Plane dist(m_distance.width(), m_distance.height());
+      modify_distance(*dist);
+      if (dist->size() != par.size())
+        break;
+      const float *d = dist->data();
+      cimg_for(par, p, float)
+      {
+        float v = (*p + *d++ - 1) / 2.0 + 0.5;
+        *p = parallax_contrast * v + parallax_max * (1 - parallax_contrast) + parallax_brightness;
+      }
       par.blur(parallax_soft);
       if (parallax_invert)
       {
-        par = 255.0 - par;
+        cimg_for(par, p, float) *p = 255.0f - *p;
       }
       break;
     }
@@ -721,27 +1095,27 @@ CImg<float> ImageProcessor::modify_parallax()
     }
   }
   par.cut(0, 255);
-  return par;
 }
 
-CImg<float> ImageProcessor::modify_specular()
+void ImageProcessor::modify_specular(CImg<float> &img_float)
 {
   sprite.get_image(TextureTypes::SpecularBase, &specular);
-  specular = specular.convertToFormat(QImage::Format_Grayscale8);
-  CImg<uchar> img = QImage2CImg(specular);
-  CImg<float> img_float(img);
-  img_float = specular_contrast * img_float + specular_thresh * (1 - specular_contrast);
-  img_float += specular_bright;
-  img_float.cut(0, 255);
+  specular = PixelFormat::toCanonical(specular, "modify_specular");
+  ScratchArena::borrow(img_float, specular.width(), specular.height());
+  fill_gray_plane(specular, img_float);
+
+  cimg_for(img_float, p, float)
+  {
+    float v = specular_contrast * *p + specular_thresh * (1 - specular_contrast) + specular_bright;
+    *p = qBound(0.0f, v, 255.0f);
+  }
 
   img_float.blur(specular_blur);
 
   if (specular_invert)
   {
-    img_float = 255.0 - img_float;
+    cimg_for(img_float, p, float) *p = 255.0f - *p;
   }
-
-  return img_float;
 }
 
 void ImageProcessor::set_normal_bisel_blur_radius(int radius)
@@ -764,6 +1138,21 @@ void ImageProcessor::generate_normal_map(bool updateEnhance, bool updateBump, bo
   }
   QMutexLocker hlocker(&heightmap_mutex);
 
+  /* Planes dropped by the memory budget have to be computed in full */
+  if (current_heightmap.is_empty() || m_distance.is_empty())
+  {
+    set_current_heightmap(current_frame_id);
+    calculate_distance();
+  }
+  if (m_emboss_normal.is_empty())
+    updateEnhance = true;
+  if (new_distance.is_empty())
+    updateDistance = true;
+  if (m_distance_normal.is_empty())
+    updateBump = true;
+  if (m_normal.is_empty())
+    rect = QRect(0, 0, 0, 0);
+
   /* Calculate rects to update */
   QList<QRect> rlist;
   bool diagonal = true;
@@ -803,20 +1192,7 @@ void ImageProcessor::generate_normal_map(bool updateEnhance, bool updateBump, bo
   if (rlist.count() == 0)
     rlist.append(QRect(0, 0, 0, 0));
 
-  QImage heightOverlay = get_heightmap_overlay();
-  CImg<float> heightOv = QImage2CImg(heightOverlay);
-  if (heightOv.is_empty())
-  {
-    qDebug() << "empty";
-
-    normal_mutex.unlock();
-    return;
-  }
-  heightOv = heightOv.mul(heightOv.get_channel(3) / 255.0);
-  for (int i = 0; i < rlist.count(); i++)
-  {
-    m_height_ov = calculate_normal(heightOv.channel(0), 5000, 0, rlist.at(i));
-  }
+  calculate_overlay_normal();
 
   if (update_tileable)
   {
@@ -835,20 +1211,20 @@ void ImageProcessor::generate_normal_map(bool updateEnhance, bool updateBump, bo
   {
     for (int i = 0; i < rlist.count(); i++)
     {
-      m_emboss_normal = calculate_normal(m_gray * 10.0, normal_depth, normal_blur_radius);
+      calculate_normal(m_gray, m_emboss_normal, normal_depth, normal_blur_radius, 10.0);
     }
   }
 
   if (updateDistance)
   {
-    new_distance = modify_distance();
+    modify_distance(new_distance);
   }
 
   if (updateBump)
   {
     for (int i = 0; i < rlist.count(); i++)
     {
-      m_distance_normal = calculate_normal(new_distance, normal_bisel_depth * normal_bisel_distance, normal_bisel_blur_radius);
+      calculate_normal(new_distance, m_distance_normal, normal_bisel_depth * normal_bisel_distance, normal_bisel_blur_radius);
     }
   }
 
@@ -857,6 +1233,10 @@ void ImageProcessor::generate_normal_map(bool updateEnhance, bool updateBump, bo
     m_normal = m_emboss_normal;
   }
 
+  /* Walk the rects one overlay tile at a time, so the painted normal tile
+   * (if any) is looked up once per block instead of once per pixel */
+  TiledOverlay normal_overlay = *sprite.get_overlay(TextureTypes::NormalOverlay);
+  const int ts = TiledOverlay::tile_size;
   foreach (QRect rect, rlist)
   {
     int xmin = 0, xmax = texture.width() - 1;
@@ -866,34 +1246,45 @@ void ImageProcessor::generate_normal_map(bool updateEnhance, bool updateBump, bo
     {
       rect.getCoords(&xmin, &ymin, &xmax, &ymax);
     }
-    for (int x = xmin; x <= xmax; ++x)
+    QRect bounds(QPoint(xmin, ymin), QPoint(xmax, ymax));
+    for (int ty = ymin / ts; ty <= ymax / ts; ty++)
     {
-      for (int y = ymin; y <= ymax; ++y)
+      for (int tx = xmin / ts; tx <= xmax / ts; tx++)
       {
-        float nr, ng, nb, norm, r, g, b, a;
-        QColor ov = normalOverlay.pixelColor(x, y);
-        r = ov.redF() * 2 - 1;
-        g = ov.greenF() * 2 - 1;
-        b = ov.blueF() * 2 - 1;
-        a = ov.alphaF();
-        nr = m_emboss_normal(x, y, 0, 0) * 3 / 2.0 + m_distance_normal(x, y, 0, 0) * 3 / 2.0 + m_height_ov(x, y, 0, 0);
-        ng = m_emboss_normal(x, y, 0, 1) * 3 / 2.0 + m_distance_normal(x, y, 0, 1) * 3 / 2.0 + m_height_ov(x, y, 0, 1);
-        nb = m_emboss_normal(x, y, 0, 2) * 3 / 2.0 + m_distance_normal(x, y, 0, 2) * 3 / 2.0 + m_height_ov(x, y, 0, 2);
-
-        nr = nr * (1 - a) + (r)*a;
-        ng = ng * (1 - a) + (g)*a;
-        nb = nb * (1 - a) + (b)*a;
-        norm = sqrtf(nr * nr + ng * ng + nb * nb);
-
-        m_normal(x, y, 0, 0) = 255.0 * (nr / norm * 0.5 + 0.5);
-        m_normal(x, y, 0, 1) = 255.0 * (ng / norm * 0.5 + 0.5);
-        m_normal(x, y, 0, 2) = 255.0 * (nb / norm * 0.5 + 0.5);
-
-        //          if (!active)
-        //          {
-        //            normal_mutex.unlock();
-        //            return;
-        //          }
+        QRect block = QRect(tx * ts, ty * ts, ts, ts).intersected(bounds);
+        QImage ov_tile = normal_overlay.tile(QPoint(tx, ty));
+        for (int y = block.top(); y <= block.bottom(); ++y)
+        {
+          const uchar *ov = ov_tile.isNull() ? nullptr : ov_tile.constScanLine(y - ty * ts) + 4 * (block.left() - tx * ts);
+          for (int x = block.left(); x <= block.right(); ++x)
+          {
+            float nr, ng, nb, norm, r = 0, g = 0, b = 0, a = 0;
+            if (ov)
+            {
+              /* Tiles are premultiplied */
+              if (ov[3])
+              {
+                a = ov[3] / 255.0;
+                r = ov[0] / (float)ov[3] * 2 - 1;
+                g = ov[1] / (float)ov[3] * 2 - 1;
+                b = ov[2] / (float)ov[3] * 2 - 1;
+              }
+              ov += 4;
+            }
+            nr = m_emboss_normal(x, y, 0, 0) * 3 / 2.0 + m_distance_normal(x, y, 0, 0) * 3 / 2.0 + m_height_ov(x, y, 0, 0);
+            ng = m_emboss_normal(x, y, 0, 1) * 3 / 2.0 + m_distance_normal(x, y, 0, 1) * 3 / 2.0 + m_height_ov(x, y, 0, 1);
+            nb = m_emboss_normal(x, y, 0, 2) * 3 / 2.0 + m_distance_normal(x, y, 0, 2) * 3 / 2.0 + m_height_ov(x, y, 0, 2);
+
+            nr = nr * (1 - a) + (r)*a;
+            ng = ng * (1 - a) + (g)*a;
+            nb = nb * (1 - a) + (b)*a;
+            norm = sqrtf(nr * nr + ng * ng + nb * nb);
+
+            m_normal(x, y, 0, 0) = 255.0 * (nr / norm * 0.5 + 0.5);
+            m_normal(x, y, 0, 1) = 255.0 * (ng / norm * 0.5 + 0.5);
+            m_normal(x, y, 0, 2) = 255.0 * (nb / norm * 0.5 + 0.5);
+          }
+        }
       }
     }
   }
@@ -901,16 +1292,23 @@ void ImageProcessor::generate_normal_map(bool updateEnhance, bool updateBump, bo
   sprite.set_image(TextureTypes::Normal, CImg2QImage(m_normal));
   normal_ready.unlock();
 
+  map_ready(TextureTypes::Normal);
   processed();
   normal_mutex.unlock();
 }
 
-CImg<float> ImageProcessor::calculate_normal(CImg<float> in, int depth, int blur_radius, QRect r)
+void ImageProcessor::calculate_normal(const CImg<float> &in, CImg<float> &out, int depth, int blur_radius, float scale, QRect r)
 {
   QSize s = sprite.size();
   float dx, dy;
 
-  CImg<float> img(in);
+  ScratchArena::Plane plane(in.width(), in.height());
+  CImg<float> &img = *plane;
+  img = in;
+  if (scale != 1.0)
+  {
+    img *= scale;
+  }
 
   if (img.width() == s.width() * 3)
   {
@@ -938,9 +1336,14 @@ CImg<float> ImageProcessor::calculate_normal(CImg<float> in, int depth, int blur
     ye = r.bottom();
   }
 
-  CImg<float> normals(img.width(), img.height(), 1, 3);
-
-  CImg<float> out(s.width(), s.height(), 1, 3);
+  /* Tileable sprites are computed on the 3x3 grid and cropped into out */
+  ScratchArena::Plane grid;
+  if (tileable)
+  {
+    ScratchArena::borrow(*grid, img.width(), img.height(), 3);
+  }
+  CImg<float> &normals = tileable ? *grid : out;
+  out.assign(s.width(), s.height(), 1, 3);
 
   img /= 255.0;
 
@@ -998,16 +1401,88 @@ CImg<float> ImageProcessor::calculate_normal(CImg<float> in, int depth, int blur
       {
         int si = i * 3 + 1;
         int sj = j * 3 + 1;
-        CImg<float> frame_normal = normals.get_crop(si * w, sj * h, (si + 1) * w - 1, (sj + 1) * h - 1);
-        out.draw_image(i * w, j * h, frame_normal);
+        for (int c = 0; c < 3; c++)
+          for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+              out(i * w + x, j * h + y, 0, c) = normals.atXY(si * w + x, sj * h + y, 0, c, 0);
       }
     }
   }
-  else
+}
+
+void ImageProcessor::apply_overlay(TextureTypes type, CImg<float> &map)
+{
+  /* Premultiplied paint over the map, only where tiles exist */
+  TiledOverlay overlay = *sprite.get_overlay(type);
+  foreach (QPoint t, overlay.allocated_tiles())
   {
-    out = normals;
+    QRect r = overlay.tile_rect(t).intersected(QRect(0, 0, map.width(), map.height()));
+    QImage tile = overlay.tile(t);
+    for (int y = r.top(); y <= r.bottom(); y++)
+    {
+      const uchar *ov = tile.constScanLine(y - t.y() * TiledOverlay::tile_size) + 4 * (r.left() - t.x() * TiledOverlay::tile_size);
+      for (int x = r.left(); x <= r.right(); x++, ov += 4)
+      {
+        float v = map(x, y) * (1.0 - ov[3] / 255.0) + ov[0];
+        map(x, y) = qBound(0.0f, v, 255.0f);
+      }
+    }
+  }
+}
+
+void ImageProcessor::calculate_overlay_normal()
+{
+  QSize s = sprite.size();
+  /* Unpainted areas contribute a flat normal */
+  m_height_ov.assign(s.width(), s.height(), 1, 3, 0.0f);
+  m_height_ov.get_shared_channel(2).fill(1.0f);
+
+  TiledOverlay overlay = *sprite.get_overlay(TextureTypes::HeightmapOverlay);
+  QRect bounds(QPoint(0, 0), s);
+  float depth = 5000 / 100.0;
+  foreach (QPoint t, overlay.allocated_tiles())
+  {
+    /* Gradients reach one pixel past the painted tile, so sample two */
+    QRect out = overlay.tile_rect(t).adjusted(-1, -1, 1, 1).intersected(bounds);
+    QRect in = out.adjusted(-1, -1, 1, 1).intersected(bounds);
+    QImage region = overlay.get_region(in);
+    CImg<float> img(in.width(), in.height());
+    /* Height times alpha, over 255 for the alpha and 255 for the 0..1
+     * range calculate_normal works in */
+    cimg_forXY(img, x, y)
+    {
+      const uchar *p = region.constScanLine(y) + 4 * x;
+      img(x, y) = p[0] * p[3] / (255.0 * 255.0);
+    }
+
+    for (int y = out.top(); y <= out.bottom(); y++)
+    {
+      for (int x = out.left(); x <= out.right(); x++)
+      {
+        if (current_heightmap(x, y, 0, 3) == 0.0)
+          continue;
+
+        int ix = x - in.left(), iy = y - in.top();
+        float dx, dy;
+        if (x == 0)
+          dx = -3 * img(ix, iy) + 4 * img(ix + 1, iy) - img(ix + 2, iy);
+        else if (x == s.width() - 1)
+          dx = 3 * img(ix, iy) - 4 * img(ix - 1, iy) + img(ix - 2, iy);
+        else
+          dx = -img(ix - 1, iy) + img(ix + 1, iy);
+
+        if (y == 0)
+          dy = -3 * img(ix, iy) + 4 * img(ix, iy + 1) - img(ix, iy + 2);
+        else if (y == s.height() - 1)
+          dy = 3 * img(ix, iy) - 4 * img(ix, iy - 1) + img(ix, iy - 2);
+        else
+          dy = -img(ix, iy - 1) + img(ix, iy + 1);
+
+        m_height_ov(x, y, 0, 0) = -dx * depth * normalInvertX;
+        m_height_ov(x, y, 0, 1) = dy * depth * normalInvertY;
+      }
+    }
   }
-  return out;
 }
 
 void ImageProcessor::copy_settings(ProcessorSettings s) { settings = s; }
@@ -1038,13 +1513,12 @@ int ImageProcessor::get_normal_invert_y() { return normalInvertY; }
 
 QImage *ImageProcessor::get_texture()
 {
-  sprite.get_image(TextureTypes::Diffuse, &texture);
-  QImage ov(texture.size(), QImage::Format_RGBA8888_Premultiplied);
-  sprite.get_image(TextureTypes::TextureOverlay, &ov);
-  last_texture.fill(Qt::transparent);
-  QPainter p(&last_texture);
-  p.drawImage(last_texture.rect(), texture);
-  p.drawImage(last_texture.rect(), ov);
+  {
+    QMutexLocker locker(&frames_mutex);
+    sprite.get_image(TextureTypes::Diffuse, &texture);
+  }
+  last_texture = texture;
+  draw_overlay(TextureTypes::TextureOverlay, &last_texture);
   sprite.set_image(TextureTypes::Color, last_texture);
   return &last_texture;
 }
@@ -1054,7 +1528,7 @@ QImage *ImageProcessor::get_normal()
   sprite.get_image(TextureTypes::Normal, &last_normal);
   if (useNormalAlpha)
   {
-    last_normal.setAlphaChannel(texture.alphaChannel());
+    PixelFormat::applyAlpha(&last_normal, texture);
   }
   return &last_normal;
 }
@@ -1064,7 +1538,7 @@ QImage *ImageProcessor::get_parallax()
   sprite.get_image(TextureTypes::Parallax, &last_parallax);
   if (useParallaxAlpha)
   {
-    last_parallax.setAlphaChannel(texture.alphaChannel());
+    PixelFormat::applyAlpha(&last_parallax, texture);
   }
   return &last_parallax;
 }
@@ -1074,7 +1548,7 @@ QImage *ImageProcessor::get_specular()
   sprite.get_image(TextureTypes::Specular, &last_specular);
   if (useSpecularAlpha)
   {
-    last_specular.setAlphaChannel(texture.alphaChannel());
+    PixelFormat::applyAlpha(&last_specular, texture);
   }
   return &last_specular;
 }
@@ -1084,79 +1558,312 @@ QImage *ImageProcessor::get_occlusion()
   sprite.get_image(TextureTypes::Occlussion, &last_occlussion);
   if (useOcclusionAlpha)
   {
-    last_occlussion.setAlphaChannel(texture.alphaChannel());
+    PixelFormat::applyAlpha(&last_occlussion, texture);
   }
   return &last_occlussion;
 }
 
+QImage ImageProcessor::materialize_overlay(QImage overlay)
+{
+  /* Overlays are null until painted; hand painters a transparent canvas */
+  if (overlay.isNull())
+  {
+    overlay = QImage(sprite.size(), PixelFormat::canonical);
+    overlay.fill(Qt::transparent);
+  }
+  return overlay;
+}
+
+void ImageProcessor::draw_overlay(TextureTypes type, QImage *dst)
+{
+  TiledOverlay *overlay = sprite.get_overlay(type);
+  if (overlay->is_empty())
+    return;
+
+  QPainter p(dst);
+  PixelFormat::expect(*dst, PixelFormat::canonical, "draw_overlay");
+  foreach (QPoint t, overlay->allocated_tiles())
+    p.drawImage(overlay->tile_rect(t).topLeft(), overlay->tile(t));
+}
+
+void ImageProcessor::set_headless(bool h)
+{
+  headless = h;
+  if (headless)
+    recalculate_timer.stop();
+}
+
+bool ImageProcessor::get_headless()
+{
+  return headless;
+}
+
+void ImageProcessor::set_calculation_deferred(bool d)
+{
+  calculation_deferred = d;
+}
+
+void ImageProcessor::wait_idle()
+{
+  /* Completion barrier: every map job takes its lock while running */
+  QMutex *locks[] = {&normal_mutex, &parallax_mutex, &specular_mutex, &occlusion_mutex, &heightmap_mutex};
+  for (QMutex *lock : locks)
+  {
+    lock->lock();
+    lock->unlock();
+  }
+}
+
+bool ImageProcessor::maps_evicted()
+{
+  return evicted.loadAcquire();
+}
+
+bool ImageProcessor::evict_maps()
+{
+  /* Only evict between recomputes; a rebuild still queued would find its
+   * planes gone */
+  if (maps_future.isRunning())
+    return false;
+
+  QMutex *locks[] = {&normal_mutex, &parallax_mutex, &specular_mutex, &occlusion_mutex, &heightmap_mutex};
+  int locked = 0;
+  for (; locked < 5; locked++)
+  {
+    if (!locks[locked]->tryLock())
+      break;
+  }
+  if (locked == 5)
+  {
+    sprite.set_image(TextureTypes::Normal, QImage());
+    sprite.set_image(TextureTypes::Specular, QImage());
+    sprite.set_image(TextureTypes::Parallax, QImage());
+    sprite.set_image(TextureTypes::Occlussion, QImage());
+    sprite.set_image(TextureTypes::Color, QImage());
+    /* Neighbours edited by hand are user data and stay */
+    if (!neighbours_custom)
+      sprite.set_image(TextureTypes::Neighbours, QImage());
+
+    last_normal = last_specular = last_parallax = last_occlussion = QImage();
+    drop_planes();
+    maps_key.clear();
+    evicted.storeRelease(1);
+  }
+  while (locked > 0)
+    locks[--locked]->unlock();
+
+  return evicted.loadAcquire();
+}
+
+void ImageProcessor::drop_planes()
+{
+  heightmap = specular = QImage();
+  current_heightmap.assign();
+  current_occlusion.assign();
+  current_parallax.assign();
+  current_specular.assign();
+  m_distance.assign();
+  new_distance.assign();
+  m_distance_normal.assign();
+  m_emboss_normal.assign();
+  m_normal.assign();
+  m_gray.assign();
+  m_height_ov.assign();
+}
+
+void ImageProcessor::restore_maps(bool wait)
+{
+  /* Only the caller that clears the flag rebuilds. A caller that needs the
+   * maps waits for the rebuild already dispatched; waitForFinished runs it
+   * right here if the pool has not started it yet */
+  if (!evicted.testAndSetOrdered(1, 0))
+  {
+    if (wait)
+      maps_future.waitForFinished();
+    return;
+  }
+
+  if (wait)
+    calculate();
+  else
+    maps_future = run_job([this]() { calculate(); });
+}
+
+QThreadPool *ImageProcessor::background_pool()
+{
+  /* One core is left to the gui and to the maps of the sprite on screen */
+  static QThreadPool *pool = []() {
+    QThreadPool *p = new QThreadPool;
+    p->setMaxThreadCount(qMax(1, QThread::idealThreadCount() - 1));
+    return p;
+  }();
+  return pool;
+}
+
+void ImageProcessor::restore_maps_background()
+{
+  if (!evicted.testAndSetOrdered(1, 0))
+    return;
+
+  maps_future = run_job(
+      [this]() {
+        QThread::currentThread()->setPriority(QThread::LowestPriority);
+        calculate();
+      },
+      background_pool());
+}
+
+void ImageProcessor::stop_maps()
+{
+  /* A queued rebuild is dropped, a running one finishes first */
+  maps_future.cancel();
+  maps_future.waitForFinished();
+}
+
+void ImageProcessor::defer_maps()
+{
+  /* Nothing is computed yet: the maps are built like evicted ones, the
+   * first time the sprite is drawn or exported */
+  normal_counter = specular_counter = parallax_counter = occlussion_counter = 0;
+  calculation_deferred = false;
+  evicted.storeRelease(1);
+}
+
+qint64 ImageProcessor::resident_bytes()
+{
+  QSet<qint64> seen;
+  qint64 total = sprite.resident_bytes(&seen);
+  QImage images[] = {texture, last_texture, last_normal, last_specular, last_parallax, last_occlussion, heightmap, specular};
+  for (const QImage &image : images)
+  {
+    if (image.isNull() || seen.contains(image.cacheKey()))
+      continue;
+    seen.insert(image.cacheKey());
+    total += image.sizeInBytes();
+  }
+
+  const CImg<float> *planes[] = {&current_heightmap, &current_occlusion, &current_parallax, &current_specular,
+                                 &m_distance, &new_distance, &m_distance_normal, &m_emboss_normal,
+                                 &m_normal, &m_gray, &m_height_ov};
+  for (const CImg<float> *plane : planes)
+    total += plane->size() * sizeof(float);
+
+  return total;
+}
+
+QList<QPoint> ImageProcessor::get_overlay_tiles(TextureTypes type)
+{
+  TiledOverlay *overlay = sprite.get_overlay(type);
+  return overlay ? overlay->allocated_tiles() : QList<QPoint>();
+}
+
+QRect ImageProcessor::get_overlay_tile_rect(TextureTypes type, QPoint tile)
+{
+  TiledOverlay *overlay = sprite.get_overlay(type);
+  return overlay ? overlay->tile_rect(tile) : QRect();
+}
+
+QImage ImageProcessor::get_overlay_tile(TextureTypes type, QPoint tile)
+{
+  /* Unpainted tiles read as transparent */
+  TiledOverlay *overlay = sprite.get_overlay(type);
+  if (!overlay)
+    return QImage();
+
+  QImage image = overlay->tile(tile);
+  if (image.isNull())
+  {
+    image = QImage(overlay->tile_rect(tile).size(), PixelFormat::canonical);
+    image.fill(Qt::transparent);
+  }
+  return image;
+}
+
+void ImageProcessor::set_overlay_tile(TextureTypes type, QPoint tile, QImage image)
+{
+  TiledOverlay *overlay = sprite.get_overlay(type);
+  if (overlay)
+    overlay->set_tile(tile, image);
+}
+
 QImage ImageProcessor::get_texture_overlay()
 {
   sprite.get_image(TextureTypes::TextureOverlay, &textureOverlay);
-  return textureOverlay;
+  return materialize_overlay(textureOverlay);
 }
 
 void ImageProcessor::set_texture_overlay(QImage to)
 {
-  sprite.set_image(TextureTypes::TextureOverlay, to);
+  sprite.set_image(TextureTypes::TextureOverlay, PixelFormat::toCanonical(to, "set_texture_overlay"));
+}
+
+void ImageProcessor::set_encoded_overlay(TextureTypes type, QByteArray data, QByteArray digest)
+{
+  TiledOverlay *overlay = sprite.get_overlay(type);
+  if (!overlay)
+    return;
+
+  /* Raw payloads are as cheap to decode as to keep */
+  if (ProjectArchive::is_raw(data))
+    overlay->set_image(ProjectArchive::decode_raw(data));
+  else
+    overlay->set_encoded(data, digest);
 }
 
 QImage ImageProcessor::get_normal_overlay()
 {
   sprite.get_image(TextureTypes::NormalOverlay, &normalOverlay);
-  return normalOverlay;
+  return materialize_overlay(normalOverlay);
 }
 
 void ImageProcessor::set_normal_overlay(QImage no)
 {
-  sprite.set_image(TextureTypes::NormalOverlay, no);
-  normal_mutex.lock();
-  get_normal_overlay();
-  normal_mutex.unlock();
+  sprite.set_image(TextureTypes::NormalOverlay, PixelFormat::toCanonical(no, "set_normal_overlay"));
 }
 
 QImage ImageProcessor::get_parallax_overlay()
 {
   sprite.get_image(TextureTypes::ParallaxOverlay, &parallaxOverlay);
-  return parallaxOverlay;
+  return materialize_overlay(parallaxOverlay);
 }
 
 void ImageProcessor::set_parallax_overlay(QImage po)
 {
-  sprite.set_image(TextureTypes::ParallaxOverlay, po);
+  sprite.set_image(TextureTypes::ParallaxOverlay, PixelFormat::toCanonical(po, "set_parallax_overlay"));
 }
 
 QImage ImageProcessor::get_specular_overlay()
 {
   sprite.get_image(TextureTypes::SpecularOverlay, &specularOverlay);
-  return specularOverlay;
+  return materialize_overlay(specularOverlay);
 }
 
 void ImageProcessor::set_specular_overlay(QImage so)
 {
-  sprite.set_image(TextureTypes::SpecularOverlay, so);
+  sprite.set_image(TextureTypes::SpecularOverlay, PixelFormat::toCanonical(so, "set_specular_overlay"));
 }
 
 QImage ImageProcessor::get_heightmap_overlay()
 {
   sprite.get_image(TextureTypes::HeightmapOverlay, &heightOverlay);
-  return heightOverlay;
+  return materialize_overlay(heightOverlay);
 }
 
 void ImageProcessor::set_heightmap_overlay(QImage ho)
 {
-  sprite.set_image(TextureTypes::HeightmapOverlay, ho);
+  sprite.set_image(TextureTypes::HeightmapOverlay, PixelFormat::toCanonical(ho, "set_heightmap_overlay"));
 }
 
 QImage ImageProcessor::get_occlusion_overlay()
 {
   sprite.get_image(TextureTypes::OcclussionOverlay,
                    &occlussionOverlay);
-  return occlussionOverlay;
+  return materialize_overlay(occlussionOverlay);
 }
 
 void ImageProcessor::set_occlussion_overlay(QImage oo)
 {
-  sprite.set_image(TextureTypes::OcclussionOverlay, oo);
+  sprite.set_image(TextureTypes::OcclussionOverlay, PixelFormat::toCanonical(oo, "set_occlussion_overlay"));
 }
 
 bool ImageProcessor::get_parallax_invert() { return parallax_invert; }
@@ -1577,8 +2284,10 @@ QImage ImageProcessor::CImg2QImage(CImg<uchar> in)
 {
   int w = in.width(), h = in.height(), channels = in.spectrum();
 
+  /* Gray and RGB maps stay compact (1 and 3 bytes per pixel): they are
+   * resident for every sprite and only expanded when uploaded to GL. Only
+   * 4 channel results use the canonical format, premultiplied */
   QImage::Format format;
-
   switch (channels)
   {
     case 1:
@@ -1587,27 +2296,39 @@ QImage ImageProcessor::CImg2QImage(CImg<uchar> in)
     case 3:
       format = QImage::Format_RGB888;
       break;
-    case 4:
-      format = QImage::Format_RGBA8888;
+    default:
+      format = PixelFormat::canonical;
       break;
   }
 
   QImage out(w, h, format);
-
   for (int y = 0; y < h; y++)
   {
     unsigned char *dst = out.scanLine(y);
     for (int x = 0; x < w; x++)
     {
-      for (int c = 0; c < channels; c++)
+      if (channels != 4)
       {
-        *dst = in(x, y, 0, c);
-        dst++;
+        for (int c = 0; c < channels; c++)
+          *dst++ = in(x, y, 0, c);
+        continue;
       }
+
+      uint a = in(x, y, 0, 3);
+      for (int c = 0; c < 3; c++)
+      {
+        uint v = in(x, y, 0, c);
+        if (a != 255)
+        {
+          v = v * a + 128;
+          v = (v + (v >> 8)) >> 8;
+        }
+        dst[c] = v;
+      }
+      dst[3] = a;
+      dst += 4;
     }
   }
-  //  in.permute_axes("cxyz");
-  //  return QImage(in.data(), in.height(), in.depth(), format);
 
   return out;
 }
@@ -1618,7 +2339,7 @@ CImg<uchar> ImageProcessor::QImage2CImg(QImage in)
   switch (in.format())
   {
     case QImage::Format_RGBA8888:
-    case QImage::Format_RGBA8888_Premultiplied:
+    case PixelFormat::canonical:
       channels = 4;
       break;
     case QImage::Format_RGB888:
@@ -1629,15 +2350,15 @@ CImg<uchar> ImageProcessor::QImage2CImg(QImage in)
       break;
     case QImage::Format_RGB32:
       channels = 3;
-      in = in.convertToFormat(QImage::Format_RGB888);
+      in = PixelFormat::convert(in, QImage::Format_RGB888, "QImage2CImg");
       break;
     case QImage::Format_ARGB32:
       channels = 4;
-      in.convertTo(QImage::Format_RGBA8888);
+      in = PixelFormat::convert(in, QImage::Format_RGBA8888, "QImage2CImg");
       break;
     case QImage::Format_ARGB32_Premultiplied:
       channels = 4;
-      in.convertTo(QImage::Format_RGBA8888_Premultiplied);
+      in = PixelFormat::toCanonical(in, "QImage2CImg");
       break;
     default:
       channels = 0;
@@ -1789,7 +2510,7 @@ QImage ImageProcessor::getFrameImage(int x, int y)
 {
   if ((x < 0) || (y < 0) || (x >= h_frames) || (y >= v_frames))
   {
-    QImage empty(texture.size(), QImage::Format_RGBA8888_Premultiplied);
+    QImage empty(texture.size(), PixelFormat::canonical);
     empty.fill(Qt::transparent);
     return empty;
   }
@@ -1813,11 +2534,13 @@ QRect ImageProcessor::getFrameRect(int x, int y)
 
 void ImageProcessor::setHFrames(int h)
 {
+  QMutexLocker locker(&frames_mutex);
   h_frames = h;
 }
 
 void ImageProcessor::setVFrames(int v)
 {
+  QMutexLocker locker(&frames_mutex);
   v_frames = v;
 }
 
@@ -1855,7 +2578,7 @@ void ImageProcessor::splitInFrames(int h_frames, int v_frames)
   QImage original;
   get_current_frame()->get_image(TextureTypes::Diffuse, &original);
 
-  vertices.clear();
+  QVector<QVector<float>> layout;
   animation_list.clear();
   animation_list.append(Animation("Default"));
   Animation *animation = getAnimation("Default");
@@ -1889,12 +2612,16 @@ void ImageProcessor::splitInFrames(int h_frames, int v_frames)
         vertices.append(current_vertices[i]);
       }
 
-      this->vertices.append(vertices);
+      layout.append(vertices);
     }
   }
 
-  setHFrames(h_frames);
-  setVFrames(v_frames);
+  {
+    QMutexLocker locker(&frames_mutex);
+    this->vertices = layout;
+    this->h_frames = h_frames;
+    this->v_frames = v_frames;
+  }
   reset_neighbours();
 }
 
@@ -21,8 +21,11 @@
 #define IMAGEPROCESSOR_H
 
 #include "src/light_source.h"
+#include "src/pixel_format.h"
+#include "src/scratch_arena.h"
 #include "src/sprite.h"
 
+#include <QAtomicInt>
 #include <QBrush>
 #include <QFuture>
 #include <QImage>
@@ -32,8 +35,10 @@
 #include <QPainter>
 #include <QPixmap>
 #include <QSemaphore>
+#include <QThreadPool>
 #include <QTimer>
 #include <QVector2D>
+#include <functional>
 
 #define cimg_display 0
 #include "thirdparty/CImg.h"
@@ -138,19 +143,19 @@ class ImageProcessor : public QObject
   Q_OBJECT
 
 public:
-  QImage heightOverlay = QImage(0, 0, QImage::Format_RGBA8888);
+  QImage heightOverlay = QImage(0, 0, PixelFormat::canonical);
   QImage heightmap;
   QImage last_normal;
-  QImage normalOverlay = QImage(0, 0, QImage::Format_RGBA8888);
+  QImage normalOverlay = QImage(0, 0, PixelFormat::canonical);
   QImage occlussion, last_occlussion;
-  QImage occlussionOverlay = QImage(0, 0, QImage::Format_RGBA8888);
+  QImage occlussionOverlay = QImage(0, 0, PixelFormat::canonical);
   QImage parallax, last_parallax;
-  QImage parallaxOverlay = QImage(0, 0, QImage::Format_RGBA8888);
+  QImage parallaxOverlay = QImage(0, 0, PixelFormat::canonical);
   QImage specular, last_specular;
-  QImage specularOverlay = QImage(0, 0, QImage::Format_RGBA8888);
+  QImage specularOverlay = QImage(0, 0, PixelFormat::canonical);
   QImage specular_base;
   QImage texture, last_texture;
-  QImage textureOverlay = QImage(0, 0, QImage::Format_RGBA8888);
+  QImage textureOverlay = QImage(0, 0, PixelFormat::canonical);
   QMutex heightmap_overlay_mutex;
   QMutex normal_overlay_mutex;
   QMutex occlussion_overlay_mutex;
@@ -188,8 +193,14 @@ private:
   QBrush normal_brush;
   QFuture<void> normal_future;
   QList<LightSource *> lightList;
-  QMutex normal_mutex, parallax_mutex, specular_mutex, occlusion_mutex, heightmap_mutex,
+  QMutex normal_mutex, parallax_mutex, specular_mutex, occlusion_mutex,
       normal_ready, specular_ready, parallax_ready, occlussion_ready;
+  /* Recursive: calculate holds it around the jobs that also take it */
+  QMutex heightmap_mutex{QMutex::Recursive};
+  /* Full rebuild started by restore_maps, waited for before eviction */
+  QFuture<void> maps_future;
+  /* Map jobs queued or running; maps_fingerprint has nothing while any are */
+  QAtomicInt maps_jobs{0};
   QPainter normal_painter;
   QString m_name, m_heightmapPath, m_specularPath;
   QVector3D offset;
@@ -247,7 +258,31 @@ private:
   int specular_bright;
   int specular_thresh;
 
+  /* Guards texture, the frame layout and neighbours_tiled, which
+   * ensure_neighbours reads on pool threads */
+  QMutex frames_mutex;
   int h_frames = 1, v_frames = 1;
+  bool neighbours_tiled = true;
+  bool neighbours_custom = false;
+  /* Set by evict_maps / defer_maps, cleared by whoever rebuilds */
+  QAtomicInt evicted{0};
+  bool headless = false;
+  bool calculation_deferred = false;
+  /* Fingerprint of the maps held, when it is known */
+  QByteArray maps_key;
+
+  QImage materialize_overlay(QImage overlay);
+  void apply_overlay(TextureTypes type, cimg_library::CImg<float> &map);
+  void calculate_overlay_normal();
+  void draw_overlay(TextureTypes type, QImage *dst);
+  void store_map(cimg_library::CImg<float> &work, cimg_library::CImg<float> &map);
+  static void fill_gray_plane(const QImage &image, cimg_library::CImg<float> &gray);
+  void ensure_neighbours();
+  void drop_planes();
+  QFuture<void> run_job(std::function<void()> job, QThreadPool *pool = nullptr);
+  bool install_cached_maps(const QByteArray &key);
+  bool install_maps(QImage normal, QImage specular, QImage parallax, QImage occlusion);
+  void store_cached_maps(const QByteArray &key);
 
 public:
   explicit ImageProcessor(QObject *parent = nullptr);
@@ -262,10 +297,10 @@ public:
   QString get_heightmap_path();
   QString get_name();
   QString get_specular_path();
-  cimg_library::CImg<float> modify_distance();
-  cimg_library::CImg<float> modify_occlusion();
-  cimg_library::CImg<float> modify_parallax();
-  cimg_library::CImg<float> modify_specular();
+  void modify_distance(cimg_library::CImg<float> &dist);
+  void modify_occlusion(cimg_library::CImg<float> &occ);
+  void modify_parallax(cimg_library::CImg<float> &par);
+  void modify_specular(cimg_library::CImg<float> &img_float);
   int loadHeightMap(QString fileName, QImage height);
   int loadImage(QString fileName, QImage image, QString basePath = "");
   int loadSpecularMap(QString fileName, QImage specular);
@@ -273,7 +308,7 @@ public:
   void calculate_gradient();
   void calculate_heightmap();
   void calculate_texture();
-  cimg_library::CImg<float> calculate_normal(cimg_library::CImg<float> in, int depth, int blur_radius, QRect r = QRect(0, 0, 0, 0));
+  void calculate_normal(const cimg_library::CImg<float> &in, cimg_library::CImg<float> &out, int depth, int blur_radius, float scale = 1.0, QRect r = QRect(0, 0, 0, 0));
   void generate_normal_map(bool updateEnhance = true, bool updateBump = true,
                            bool updateDistance = true,
                            QRect rect = QRect(0, 0, 0, 0));
@@ -284,6 +319,27 @@ public:
   QImage get_occlusion_overlay();
   QImage get_parallax_overlay();
   QImage get_specular_overlay();
+  void set_headless(bool h);
+  bool get_headless();
+  void set_calculation_deferred(bool d);
+  void wait_idle();
+  QByteArray fingerprint(QImage diffuse = QImage());
+  QByteArray maps_fingerprint();
+  bool install_stored_maps(const QByteArray &key, QImage normal, QImage specular, QImage parallax, QImage occlusion);
+  bool maps_evicted();
+  bool evict_maps();
+  void restore_maps(bool wait);
+  /* Like restore_maps(false), on background_pool() */
+  void restore_maps_background();
+  /* Waits for the rebuild started by either restore, dropping it if queued */
+  void stop_maps();
+  static QThreadPool *background_pool();
+  void defer_maps();
+  qint64 resident_bytes();
+  QList<QPoint> get_overlay_tiles(TextureTypes type);
+  QRect get_overlay_tile_rect(TextureTypes type, QPoint tile);
+  QImage get_overlay_tile(TextureTypes type, QPoint tile);
+  void set_overlay_tile(TextureTypes type, QPoint tile, QImage image);
   void calculate();
   void calculate_occlusion();
   void calculate_parallax();
@@ -294,6 +350,7 @@ public:
   void set_parallax_overlay(QImage po);
   void set_specular_overlay(QImage so);
   void set_texture_overlay(QImage to);
+  void set_encoded_overlay(TextureTypes type, QByteArray data, QByteArray digest = QByteArray());
   int WrapCoordinate(int coord, int interval);
   QImage CImg2QImage(cimg_library::CImg<uchar> in);
   cimg_library::CImg<uchar> QImage2CImg(QImage in);
@@ -443,6 +500,7 @@ signals:
   void processed();
   void positionChanged();
   void frameChanged(int index);
+  void map_ready(TextureTypes type);
   void on_idle();
 };
 
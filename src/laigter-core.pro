@@ -0,0 +1,77 @@
+#Laigter: an automatic map generator for lighting effects.
+#Copyright (C) 2019  Pablo Ivan Fonovich
+#
+#This program is free software: you can redistribute it and/or modify
+#it under the terms of the GNU General Public License as published by
+#the Free Software Foundation, either version 3 of the License, or
+#(at your option) any later version.
+#
+#This program is distributed in the hope that it will be useful,
+#but WITHOUT ANY WARRANTY; without even the implied warranty of
+#MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#GNU General Public License for more details.
+#
+#You should have received a copy of the GNU General Public License
+#along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#Contact: azagaya.games@gmail.com
+
+# Map generation without widgets or OpenGL. The laigter executable links
+# it, and laigter_core.h is its plain C++ API for embedding.
+
+QT       += core gui concurrent
+
+TARGET = laigter-core
+TEMPLATE = lib
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+CONFIG += staticlib c++11
+
+QMAKE_CXXFLAGS_RELEASE *= -O3
+
+# Sources include each other as "src/..." and "thirdparty/..."
+INCLUDEPATH += $$PWD/..
+
+SOURCES += \
+	batch_engine.cpp \
+	image_loader.cpp \
+	image_processor.cpp \
+	laigter_core.cpp \
+	light_source.cpp \
+	map_cache.cpp \
+	map_exporter.cpp \
+	memory_budget.cpp \
+	pixel_format.cpp \
+	presets.cpp \
+	project.cpp \
+	project_archive.cpp \
+	scratch_arena.cpp \
+	sequence_index.cpp \
+	sprite.cpp \
+	tar_writer.cpp \
+	texture.cpp \
+	tiled_overlay.cpp \
+	../thirdparty/zip.c
+
+HEADERS += \
+	batch_engine.h \
+	image_loader.h \
+	image_processor.h \
+	laigter_core.h \
+	light_source.h \
+	map_cache.h \
+	map_exporter.h \
+	memory_budget.h \
+	pixel_format.h \
+	presets.h \
+	project.h \
+	project_archive.h \
+	scratch_arena.h \
+	sequence_index.h \
+	sprite.h \
+	tar_writer.h \
+	texture.h \
+	tiled_overlay.h \
+	../thirdparty/CImg.h \
+	../thirdparty/miniz.h \
+	../thirdparty/zip.h
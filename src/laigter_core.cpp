@@ -0,0 +1,72 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "laigter_core.h"
+#include "image_processor.h"
+#include "map_cache.h"
+#include "pixel_format.h"
+#include "presets.h"
+
+#include <cstring>
+
+static void copy_map(QImage image, const QImage &alpha, bool use_alpha, laigter::Map *map)
+{
+  if (use_alpha)
+    PixelFormat::applyAlpha(&image, alpha);
+  image = PixelFormat::convert(image, QImage::Format_RGBA8888, "laigter::generate_maps");
+
+  map->width = image.width();
+  map->height = image.height();
+  map->pixels.resize(size_t(map->width) * map->height * 4);
+  for (int y = 0; y < map->height; y++)
+    memcpy(map->pixels.data() + size_t(y) * map->width * 4, image.constScanLine(y), size_t(map->width) * 4);
+}
+
+bool laigter::generate_maps(const ImageView &image, const Settings &settings, Maps *maps, std::string *error)
+{
+  if (!image.pixels || image.width <= 0 || image.height <= 0 || image.stride < image.width * 4)
+  {
+    if (error)
+      *error = "invalid image view";
+    return false;
+  }
+
+  /* The view wraps the caller's pixels, toCanonical makes our own copy */
+  QImage view(image.pixels, image.width, image.height, image.stride, QImage::Format_RGBA8888);
+  QImage diffuse = PixelFormat::toCanonical(view, "laigter::generate_maps");
+
+  ImageProcessor processor;
+  processor.set_headless(true);
+  if (!settings.preset.empty())
+    Presets::apply_string(QString::fromStdString(settings.preset), &processor);
+
+  processor.loadImage("embedded", diffuse);
+  processor.wait_idle();
+
+  copy_map(*processor.get_normal(), diffuse, settings.use_alpha, &maps->normal);
+  copy_map(*processor.get_specular(), diffuse, settings.use_alpha, &maps->specular);
+  copy_map(*processor.get_occlusion(), diffuse, settings.use_alpha, &maps->occlusion);
+  copy_map(*processor.get_parallax(), diffuse, settings.use_alpha, &maps->parallax);
+  return true;
+}
+
+void laigter::set_map_cache(bool enabled)
+{
+  MapCache::set_enabled(enabled);
+}
@@ -0,0 +1,73 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+
+#ifndef LAIGTERCORE_H
+#define LAIGTERCORE_H
+
+#include <string>
+#include <vector>
+
+/* Plain C++ entry point of the laigter-core library, for tools that embed
+ * the map generator instead of running the laigter executable. No Qt type
+ * shows up here. Calls are reentrant: each one works on its own processor,
+ * so several images can be processed from different threads at once. */
+namespace laigter
+{
+
+/* 8 bit RGBA pixels, not premultiplied, rows stride bytes apart. The
+ * pixels are only read during the call. */
+struct ImageView
+{
+  const unsigned char *pixels = nullptr;
+  int width = 0;
+  int height = 0;
+  int stride = 0;
+};
+
+/* Settings snapshot in the .presset text format, as written by the presets
+ * dialog. Settings missing from it keep their defaults. */
+struct Settings
+{
+  std::string preset;
+  bool use_alpha = false;
+};
+
+/* Tightly packed 8 bit RGBA, width * height * 4 bytes */
+struct Map
+{
+  int width = 0;
+  int height = 0;
+  std::vector<unsigned char> pixels;
+};
+
+struct Maps
+{
+  Map normal;
+  Map specular;
+  Map occlusion;
+  Map parallax;
+};
+
+bool generate_maps(const ImageView &image, const Settings &settings, Maps *maps, std::string *error = nullptr);
+void set_map_cache(bool enabled);
+
+} // namespace laigter
+
+#endif // LAIGTERCORE_H
@@ -0,0 +1,213 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "map_cache.h"
+#include "map_exporter.h"
+
+#include <QAtomicInt>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QSaveFile>
+#include <QSettings>
+#include <QStandardPaths>
+
+#include <algorithm>
+
+static QAtomicInt cache_state(-1);
+static QAtomicInt hit_count(0);
+static QAtomicInt miss_count(0);
+
+/* Bytes on disk, scanned on the first store of the session */
+static QMutex size_mutex;
+static qint64 cache_bytes = -1;
+
+static QString map_suffix(TextureTypes type)
+{
+  switch (type)
+  {
+    case TextureTypes::Normal:
+      return "n";
+    case TextureTypes::Specular:
+      return "s";
+    case TextureTypes::Occlussion:
+      return "o";
+    case TextureTypes::Parallax:
+      return "p";
+    default:
+      return QString::number(int(type));
+  }
+}
+
+QString MapCache::directory()
+{
+#ifndef PORTABLE
+  return QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/maps";
+#else
+  return "./cache/maps";
+#endif
+}
+
+bool MapCache::enabled()
+{
+  int state = cache_state.loadAcquire();
+  if (state < 0)
+  {
+    QSettings settings("Azagaya", "Laigter");
+    state = settings.value("map cache", true).toBool() ? 1 : 0;
+    cache_state.testAndSetOrdered(-1, state);
+    state = cache_state.loadAcquire();
+  }
+  return state > 0;
+}
+
+void MapCache::set_enabled(bool e)
+{
+  cache_state.storeRelease(e ? 1 : 0);
+}
+
+qint64 MapCache::limit()
+{
+  QSettings settings("Azagaya", "Laigter");
+  return settings.value("map cache mb", 512).toLongLong() * 1024 * 1024;
+}
+
+static QList<QFileInfo> entries()
+{
+  QList<QFileInfo> list;
+  QDirIterator it(MapCache::directory(), QStringList() << "*.png", QDir::Files,
+                  QDirIterator::Subdirectories);
+  while (it.hasNext())
+  {
+    it.next();
+    list.append(it.fileInfo());
+  }
+  return list;
+}
+
+static qint64 total(const QList<QFileInfo> &list)
+{
+  qint64 bytes = 0;
+  foreach (const QFileInfo &f, list)
+    bytes += f.size();
+  return bytes;
+}
+
+static void account(qint64 bytes)
+{
+  QMutexLocker locker(&size_mutex);
+  /* The first scan already counts the new entry */
+  if (cache_bytes < 0)
+    cache_bytes = total(entries());
+  else
+    cache_bytes += bytes;
+
+  qint64 max = MapCache::limit();
+  if (cache_bytes <= max)
+    return;
+
+  /* Loads refresh the modification time, so the oldest are the least
+   * recently used. Prune to three quarters so this does not run on every
+   * store */
+  QList<QFileInfo> list = entries();
+  std::sort(list.begin(), list.end(), [](const QFileInfo &a, const QFileInfo &b) {
+    return a.lastModified() < b.lastModified();
+  });
+  cache_bytes = total(list);
+  for (int i = 0; i < list.count() && cache_bytes > max * 3 / 4; i++)
+  {
+    if (QFile::remove(list[i].filePath()))
+      cache_bytes -= list[i].size();
+  }
+}
+
+QString MapCache::path(const QByteArray &key, TextureTypes type)
+{
+  /* Two level layout keeps directories small */
+  QString hex = QString::fromLatin1(key.toHex());
+  return directory() + "/" + hex.left(2) + "/" + hex + "_" + map_suffix(type) + ".png";
+}
+
+bool MapCache::contains(const QByteArray &key, TextureTypes type)
+{
+  return !key.isEmpty() && QFileInfo::exists(path(key, type));
+}
+
+bool MapCache::load(const QByteArray &key, TextureTypes type, QImage *map)
+{
+  if (key.isEmpty())
+    return false;
+
+  QFile file(path(key, type));
+  QImage image;
+  if (!file.open(QIODevice::ReadOnly) || !image.load(&file, "PNG"))
+    return false;
+
+  /* Best effort: marks the entry as recently used for pruning */
+  file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+
+  /* Entries are stored RGB / grayscale; RGB comes back as RGB32 */
+  *map = MapExporter::file_image(type, image);
+  return true;
+}
+
+bool MapCache::store(const QByteArray &key, TextureTypes type, const QImage &map)
+{
+  if (key.isEmpty() || map.isNull())
+    return false;
+
+  QString name = path(key, type);
+  if (QFileInfo::exists(name))
+    return true;
+
+  QDir().mkpath(QFileInfo(name).path());
+
+  /* Readers never see a half written entry */
+  QSaveFile file(name);
+  if (!file.open(QIODevice::WriteOnly) || !MapExporter::file_image(type, map).save(&file, "PNG") ||
+      !file.commit())
+  {
+    qWarning() << "could not store cached map" << name;
+    return false;
+  }
+  account(QFileInfo(name).size());
+  return true;
+}
+
+int MapCache::hits()
+{
+  return hit_count.loadAcquire();
+}
+
+int MapCache::misses()
+{
+  return miss_count.loadAcquire();
+}
+
+void MapCache::count(bool hit)
+{
+  if (hit)
+    hit_count.fetchAndAddRelaxed(1);
+  else
+    miss_count.fetchAndAddRelaxed(1);
+}
@@ -0,0 +1,55 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef MAPCACHE_H
+#define MAPCACHE_H
+
+#include "sprite.h"
+
+#include <QByteArray>
+#include <QImage>
+#include <QString>
+
+/* Generated maps stored on disk by content: the key is the fingerprint of
+ * an ImageProcessor (input pixels, custom inputs, settings and generator
+ * version), so any change to those simply misses. Bump generator_version
+ * whenever the generator output changes for the same inputs. */
+class MapCache
+{
+public:
+  static const int generator_version = 2;
+
+public:
+  static QString directory();
+  static bool enabled();
+  static void set_enabled(bool e);
+  /* Bytes kept on disk before the least recently used entries go */
+  static qint64 limit();
+
+  static QString path(const QByteArray &key, TextureTypes type);
+  static bool contains(const QByteArray &key, TextureTypes type);
+  static bool load(const QByteArray &key, TextureTypes type, QImage *map);
+  static bool store(const QByteArray &key, TextureTypes type, const QImage &map);
+
+  static int hits();
+  static int misses();
+  static void count(bool hit);
+};
+
+#endif // MAPCACHE_H
@@ -0,0 +1,342 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "map_exporter.h"
+#include "pixel_format.h"
+
+#include <QAtomicInt>
+#include <QDir>
+#include <QFileInfo>
+#include <QImageWriter>
+#include <QPainter>
+#include <QtConcurrent/QtConcurrent>
+#include <cmath>
+
+QString MapExporter::output_name(ImageProcessor *p, QString postfix, const ExportOptions &o)
+{
+  QString file_name = p->sprite.get_file_name();
+  QFileInfo info(file_name);
+  if (!info.exists())
+  {
+    info = QFileInfo(o.project_path);
+    file_name = info.dir().path() + "/" + file_name.split("/").last();
+    info = QFileInfo(file_name);
+  }
+  QString suffix = info.completeSuffix();
+  if (!QImageWriter::supportedImageFormats().contains(suffix.toUtf8()))
+  {
+    suffix = "png";
+  }
+  if (o.destination == "")
+  {
+    return p->m_absolute_path + "/" + info.baseName() + postfix + "." + suffix;
+  }
+  return o.destination + "/" + info.baseName() + postfix + "." + suffix;
+}
+
+bool MapExporter::save(QImage n, QString name, ImageProcessor *p, const ExportOptions &o)
+{
+  bool saved = true;
+  if (o.layout == FrameLayout::Separate)
+  {
+    int digits = log10((float)p->get_frame_count()) + 1;
+    for (int i = 0; i < p->get_frame_count(); i++)
+    {
+      QString frame_number = QStringLiteral("%1").arg(i, digits, 10, QLatin1Char('0'));
+      QStringList path_parts = name.split("/");
+      path_parts.last() = path_parts.last().split(".").join("_" + frame_number + ".");
+      QString i_name = path_parts.join("/");
+      QImage image = n.copy(p->getFrameRect(i));
+      saved &= image.save(i_name);
+    }
+  }
+  else
+  {
+    saved &= n.save(name);
+  }
+  return saved;
+}
+
+QImage MapExporter::file_image(TextureTypes type, const QImage &map)
+{
+  switch (type)
+  {
+    case TextureTypes::Normal:
+      return PixelFormat::convert(map, QImage::Format_RGB888, "MapExporter::file_image");
+    case TextureTypes::Specular:
+    case TextureTypes::Parallax:
+    case TextureTypes::Occlussion:
+      return PixelFormat::convert(map, QImage::Format_Grayscale8, "MapExporter::file_image");
+    default:
+      return map;
+  }
+}
+
+bool MapExporter::export_map(TextureTypes type, ImageProcessor *p, QString postfix, const ExportOptions &o,
+                             bool use_alpha)
+{
+  QImage n;
+  QString embedded = "None";
+
+  p->sprite.get_image(type, &n);
+
+  if (o.layout != FrameLayout::Default && o.layout != FrameLayout::Separate)
+  {
+    n = rearrange_frames(n, p, o);
+  }
+
+  if (type == TextureTypes::Normal)
+  {
+    if (o.invert_x)
+    {
+      for (int x = 0; x < n.width(); x++)
+      {
+        for (int y = 0; y < n.height(); y++)
+        {
+          QColor color = n.pixelColor(x, y);
+          color.setRedF(1.0 - color.redF());
+          n.setPixelColor(x, y, color);
+        }
+      }
+    }
+
+    if (o.invert_y)
+    {
+      for (int x = 0; x < n.width(); x++)
+      {
+        for (int y = 0; y < n.height(); y++)
+        {
+          QColor color = n.pixelColor(x, y);
+          color.setGreenF(1.0 - color.greenF());
+          n.setPixelColor(x, y, color);
+        }
+      }
+    }
+
+    embedded = o.normal_alpha;
+
+    if (embedded != "None")
+    {
+      n = PixelFormat::toCanonical(n, "MapExporter::export_map embedded");
+      QImage alpha;
+      if (embedded == "Specular")
+      {
+        p->sprite.get_image(TextureTypes::Specular, &alpha);
+      }
+      else if (embedded == "Parallax")
+      {
+        p->sprite.get_image(TextureTypes::Parallax, &alpha);
+      }
+      else if (embedded == "Occlusion")
+      {
+        p->sprite.get_image(TextureTypes::Occlussion, &alpha);
+      }
+
+      for (int x = 0; x < n.width(); x++)
+      {
+        for (int y = 0; y < n.height(); y++)
+        {
+          QColor color = n.pixelColor(x, y);
+          color.setAlphaF(alpha.pixelColor(x, y).redF());
+          n.setPixelColor(x, y, color);
+        }
+      }
+    }
+  }
+
+  QString name = output_name(p, postfix, o);
+  if (use_alpha)
+  {
+    PixelFormat::applyAlpha(&n, *p->get_texture());
+  }
+  else if (embedded == "None")
+  {
+    n = file_image(type, n);
+  }
+
+  return save(n, name, p, o);
+}
+
+bool MapExporter::export_combined(ImageProcessor *p, const ExportOptions &o)
+{
+  QImage combined(p->sprite.size(), QImage::Format_RGB888);
+  QImage specular, occlusion, parallax;
+  p->sprite.get_image(TextureTypes::Specular, &specular);
+  p->sprite.get_image(TextureTypes::Occlussion, &occlusion);
+  p->sprite.get_image(TextureTypes::Parallax, &parallax);
+  for (int x = 0; x < combined.width(); x++)
+  {
+    for (int y = 0; y < combined.height(); y++)
+    {
+      QColor color(specular.pixelColor(x, y).red(), occlusion.pixelColor(x, y).red(), parallax.pixelColor(x, y).red());
+      combined.setPixelColor(x, y, color);
+    }
+  }
+
+  QFileInfo info = QFileInfo(p->sprite.get_file_name());
+  QString suffix = info.completeSuffix();
+  QString path = o.destination == "" ? info.absolutePath() : o.destination;
+  QString name = path + "/" + info.fileName().remove("." + suffix) + "_sop." + suffix;
+  return combined.save(name);
+}
+
+bool MapExporter::export_processor(ImageProcessor *p, const ExportOptions &o)
+{
+  bool saved = true;
+
+  /* Maps evicted by the memory budget or still building in the background
+   * are needed now, and so are edits still being applied */
+  p->restore_maps(true);
+  p->wait_idle();
+
+  if (o.normal)
+  {
+    saved &= export_map(TextureTypes::Normal, p, o.normal_postfix, o, p->get_use_normal_alpha());
+  }
+  if (o.parallax)
+  {
+    saved &= export_map(TextureTypes::Parallax, p, o.parallax_postfix, o, p->get_use_parallax_alpha());
+  }
+  if (o.specular)
+  {
+    saved &= export_map(TextureTypes::Specular, p, o.specular_postfix, o, p->get_use_specular_alpha());
+  }
+  if (o.occlusion)
+  {
+    saved &= export_map(TextureTypes::Occlussion, p, o.occlusion_postfix, o, p->get_use_occlusion_alpha());
+  }
+  if (o.diffuse)
+  {
+    saved &= export_map(TextureTypes::Color, p, o.diffuse_postfix, o);
+  }
+  if (o.combined)
+  {
+    saved &= export_combined(p, o);
+  }
+  return saved;
+}
+
+bool MapExporter::export_all(QList<ImageProcessor *> processors, const ExportOptions &o)
+{
+  if (o.destination != "")
+    QDir(o.destination).mkpath(".");
+
+  /* Each processor computes and writes its maps on its own pool thread.
+   * Maps loaded along with a project are used as they are */
+  QAtomicInt failed(0);
+  QtConcurrent::blockingMap(processors, [&failed, &o](ImageProcessor *p) {
+    if (!export_processor(p, o))
+      failed.fetchAndAddRelaxed(1);
+  });
+  return failed.loadAcquire() == 0;
+}
+
+bool MapExporter::parse_layout(QString layout, ExportOptions *o)
+{
+  /* default, horizontal, vertical, rows:N, columns:N or separate */
+  QStringList parts = layout.toLower().split(":");
+  QString kind = parts.first();
+  if (kind == "default")
+    o->layout = FrameLayout::Default;
+  else if (kind == "horizontal")
+    o->layout = FrameLayout::Horizontal;
+  else if (kind == "vertical")
+    o->layout = FrameLayout::Vertical;
+  else if (kind == "rows")
+    o->layout = FrameLayout::FixedRows;
+  else if (kind == "columns")
+    o->layout = FrameLayout::FixedColumns;
+  else if (kind == "separate")
+    o->layout = FrameLayout::Separate;
+  else
+    return false;
+
+  if (o->layout == FrameLayout::FixedRows || o->layout == FrameLayout::FixedColumns)
+  {
+    bool ok = parts.count() == 2;
+    o->layout_count = ok ? parts.at(1).toInt(&ok) : 0;
+    if (!ok || o->layout_count < 1)
+      return false;
+  }
+  return true;
+}
+
+QImage MapExporter::rearrange_frames(QImage n, ImageProcessor *p, const ExportOptions &o)
+{
+  QSize s = p->getFrameImage(0).size();
+  int frames = p->get_frame_count();
+  int h_frames = 1, v_frames = 1;
+  bool by_rows = false;
+  switch (o.layout)
+  {
+    case FrameLayout::Horizontal:
+      h_frames = frames;
+      break;
+    case FrameLayout::Vertical:
+      v_frames = frames;
+      break;
+    case FrameLayout::FixedRows:
+      v_frames = o.layout_count;
+      h_frames = ceil((float)frames / v_frames);
+      break;
+    case FrameLayout::FixedColumns:
+      by_rows = true;
+      h_frames = o.layout_count;
+      v_frames = ceil((float)frames / h_frames);
+      break;
+    default:
+      break;
+  }
+
+  QImage aux(h_frames * s.width(), v_frames * s.height(), n.format());
+  if (aux.hasAlphaChannel())
+    aux.fill(Qt::transparent);
+  else
+    aux.fill(Qt::black);
+  QPainter painter(&aux);
+  int index = 0;
+  if (!by_rows)
+  {
+    for (int i = 0; i < h_frames; i++)
+      for (int j = 0; j < v_frames; j++)
+      {
+        {
+          if (index >= frames)
+            break;
+          painter.drawImage(QRectF(i * s.width(), j * s.height(), s.width(), s.height()), n.copy(p->getFrameRect(index)));
+          index++;
+        }
+      }
+  }
+  else
+  {
+    for (int j = 0; j < v_frames; j++)
+      for (int i = 0; i < h_frames; i++)
+      {
+        {
+          if (index >= frames)
+            break;
+          painter.drawImage(QRectF(i * s.width(), j * s.height(), s.width(), s.height()), n.copy(p->getFrameRect(index)));
+          index++;
+        }
+      }
+  }
+
+  return aux.copy();
+}
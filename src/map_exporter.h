@@ -0,0 +1,75 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef MAPEXPORTER_H
+#define MAPEXPORTER_H
+
+#include "image_processor.h"
+
+#include <QList>
+#include <QString>
+
+/* Same order as the animation combo box of the export dialog */
+enum class FrameLayout
+{
+  Default,
+  Horizontal,
+  Vertical,
+  FixedRows,
+  FixedColumns,
+  Separate
+};
+
+struct ExportOptions
+{
+  bool normal = true, specular = true, parallax = true, occlusion = true;
+  bool diffuse = false, combined = false;
+  QString normal_postfix = "_n", specular_postfix = "_s", parallax_postfix = "_p";
+  QString occlusion_postfix = "_o", diffuse_postfix = "_d";
+  FrameLayout layout = FrameLayout::Default;
+  int layout_count = 1; /* rows or columns for the fixed layouts */
+  bool invert_x = false, invert_y = false;
+  QString normal_alpha = "None"; /* Specular, Parallax or Occlusion */
+  QString destination;           /* empty writes next to each image */
+  QString project_path;          /* images missing on disk are placed next to it */
+};
+
+/* Writes the maps of processors the way the export dialog does, without
+ * needing a window. */
+class MapExporter
+{
+public:
+  static bool export_map(TextureTypes type, ImageProcessor *p, QString postfix, const ExportOptions &o,
+                         bool use_alpha = false);
+  static bool export_combined(ImageProcessor *p, const ExportOptions &o);
+  static bool export_processor(ImageProcessor *p, const ExportOptions &o);
+  static bool export_all(QList<ImageProcessor *> processors, const ExportOptions &o);
+  static QImage rearrange_frames(QImage n, ImageProcessor *p, const ExportOptions &o);
+  static bool parse_layout(QString layout, ExportOptions *o);
+  static bool save(QImage n, QString name, ImageProcessor *p, const ExportOptions &o);
+  /* Maps are opaque canonical images in memory. Files keep normal maps as
+   * RGB and the single channel maps as grayscale; maps given an alpha
+   * channel are written as they are. */
+  static QImage file_image(TextureTypes type, const QImage &map);
+
+private:
+  static QString output_name(ImageProcessor *p, QString postfix, const ExportOptions &o);
+};
+
+#endif // MAPEXPORTER_H
@@ -0,0 +1,209 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "map_server.h"
+#include "map_cache.h"
+#include "pixel_format.h"
+#include "scratch_arena.h"
+
+#include <QBuffer>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonDocument>
+#include <QThread>
+#include <QtConcurrent/QtConcurrent>
+
+MapServer::MapServer(BatchEngine *engine, int threads, QObject *parent)
+    : QObject(parent), engine(engine)
+{
+  pool.setMaxThreadCount(threads > 0 ? threads : QThread::idealThreadCount());
+  pool.setExpiryTimeout(-1);
+  connect(&server, SIGNAL(newConnection()), this, SLOT(new_connection()));
+}
+
+MapServer::~MapServer()
+{
+  server.close();
+  pool.waitForDone();
+}
+
+bool MapServer::listen(QString name)
+{
+  /* A server that crashed leaves its socket file behind */
+  QLocalServer::removeServer(name);
+  if (!server.listen(name))
+  {
+    qWarning() << "could not listen on" << name << server.errorString();
+    return false;
+  }
+  qInfo() << "listening on" << server.fullServerName();
+  return true;
+}
+
+void MapServer::new_connection()
+{
+  while (QLocalSocket *socket = server.nextPendingConnection())
+  {
+    connect(socket, SIGNAL(readyRead()), this, SLOT(read_requests()));
+    connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+  }
+}
+
+void MapServer::read_requests()
+{
+  QLocalSocket *socket = qobject_cast<QLocalSocket *>(sender());
+  if (!socket)
+    return;
+
+  while (socket->canReadLine())
+  {
+    QByteArray line = socket->readLine().trimmed();
+    if (line.isEmpty())
+      continue;
+
+    QJsonParseError e;
+    QJsonDocument doc = QJsonDocument::fromJson(line, &e);
+    if (e.error != QJsonParseError::NoError || !doc.isObject())
+    {
+      QJsonObject reply;
+      reply.insert("done", true);
+      reply.insert("ok", false);
+      reply.insert("error", "invalid request: " + e.errorString());
+      send(socket, reply);
+      continue;
+    }
+    handle(socket, doc.object());
+  }
+}
+
+void MapServer::send(QPointer<QLocalSocket> socket, QJsonObject message)
+{
+  /* Workers reply through the event loop, sockets belong to this thread */
+  QByteArray data = QJsonDocument(message).toJson(QJsonDocument::Compact) + "\n";
+  QMetaObject::invokeMethod(this, [socket, data]() {
+    if (socket)
+      socket->write(data);
+  }, Qt::QueuedConnection);
+}
+
+void MapServer::handle(QLocalSocket *socket, const QJsonObject &request)
+{
+  QPointer<QLocalSocket> target(socket);
+  QJsonValue id = request.value("id");
+  QJsonObject reply;
+  reply.insert("id", id);
+  reply.insert("done", true);
+
+  QString command = request.value("command").toString("generate");
+  if (command == "quit")
+  {
+    reply.insert("ok", true);
+    send(target, reply);
+    QMetaObject::invokeMethod(QCoreApplication::instance(), "quit", Qt::QueuedConnection);
+    return;
+  }
+  if (command == "stats")
+  {
+    reply.insert("ok", true);
+    reply.insert("pixel_conversions", PixelFormat::conversionCount());
+    reply.insert("scratch", ScratchArena::stats());
+    reply.insert("cache_hits", MapCache::hits());
+    reply.insert("cache_misses", MapCache::misses());
+    reply.insert("active_jobs", pool.activeThreadCount());
+    send(target, reply);
+    return;
+  }
+
+  BatchJob job = engine->job_for(QString());
+  BatchEngine::read_job(request, QDir::current(), &job);
+  if (!job.preset.isEmpty() && !request.contains("preset_string"))
+  {
+    QFile preset(job.preset);
+    if (!preset.open(QIODevice::ReadOnly))
+    {
+      reply.insert("ok", false);
+      reply.insert("error", "could not read preset " + job.preset);
+      send(target, reply);
+      return;
+    }
+    job.preset_contents = QString::fromUtf8(preset.readAll());
+  }
+  if (request.contains("preset_string"))
+    job.preset_contents = request.value("preset_string").toString();
+
+  QImage image;
+  if (request.contains("png"))
+  {
+    image = QImage::fromData(QByteArray::fromBase64(request.value("png").toString().toLatin1()));
+    if (image.isNull())
+    {
+      reply.insert("ok", false);
+      reply.insert("error", "could not decode inline image");
+      send(target, reply);
+      return;
+    }
+    if (job.input.isEmpty())
+      job.input = request.value("name").toString("inline.png");
+  }
+  else if (job.input.isEmpty())
+  {
+    reply.insert("ok", false);
+    reply.insert("error", "request has no input or png");
+    send(target, reply);
+    return;
+  }
+
+  /* Inline images have no place to write to unless asked for one */
+  QString mode = request.value("return").toString(image.isNull() ? "path" : "inline");
+  if (mode == "inline")
+  {
+    job.on_map = [this, target, id](const QString &, TextureTypes type, const QImage &map) {
+      QByteArray png;
+      QBuffer buffer(&png);
+      buffer.open(QIODevice::WriteOnly);
+      if (!map.save(&buffer, "PNG"))
+        return false;
+
+      QJsonObject message;
+      message.insert("id", id);
+      message.insert("map", BatchEngine::map_name(type));
+      message.insert("png", QString::fromLatin1(png.toBase64()));
+      send(target, message);
+      return true;
+    };
+  }
+
+  QtConcurrent::run(&pool, [this, job, image, target, reply]() {
+    QElapsedTimer timer;
+    timer.start();
+    BatchResult result;
+    if (image.isNull())
+      engine->process(job, &result);
+    else
+      engine->process(job, image, &result);
+    result.process_ms = timer.elapsed();
+
+    QJsonObject done = BatchEngine::result_json(result);
+    done.insert("id", reply.value("id"));
+    done.insert("done", true);
+    send(target, done);
+  });
+}
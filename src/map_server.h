@@ -0,0 +1,66 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef MAPSERVER_H
+#define MAPSERVER_H
+
+#include "batch_engine.h"
+
+#include <QJsonObject>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QObject>
+#include <QPointer>
+#include <QThreadPool>
+
+/* Long lived generator for --serve. Clients connect to a local socket and
+ * send one JSON object per line; replies are JSON lines tagged with the
+ * request id. Jobs run on a pool whose threads never expire, so scratch
+ * planes and the map cache stay warm between requests.
+ *
+ * Request:  {"id": 1, "input": "/abs/sprite.png" | "png": "<base64>",
+ *            "preset": "/abs/preset", "maps": ["normal", ...],
+ *            "output_dir": "...", "postfixes": {...}, "alpha": false,
+ *            "return": "path" | "inline"}
+ *           {"command": "stats" | "quit"}
+ * Replies:  {"id": 1, "map": "normal", "png": "<base64>"} per inline map,
+ *           then {"id": 1, "done": true, "ok": true, ...} */
+class MapServer : public QObject
+{
+  Q_OBJECT
+
+public:
+  explicit MapServer(BatchEngine *engine, int threads = 0, QObject *parent = nullptr);
+  ~MapServer();
+  bool listen(QString name);
+
+private slots:
+  void new_connection();
+  void read_requests();
+
+private:
+  void handle(QLocalSocket *socket, const QJsonObject &request);
+  void send(QPointer<QLocalSocket> socket, QJsonObject message);
+
+  BatchEngine *engine;
+  QLocalServer server;
+  QThreadPool pool;
+};
+
+#endif // MAPSERVER_H
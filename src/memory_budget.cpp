@@ -0,0 +1,127 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "memory_budget.h"
+#include "image_processor.h"
+#include "scratch_arena.h"
+
+#include <QSettings>
+
+MemoryBudget *MemoryBudget::instance()
+{
+  static MemoryBudget *budget = new MemoryBudget;
+  return budget;
+}
+
+MemoryBudget::MemoryBudget(QObject *parent) : QObject(parent)
+{
+  QSettings settings("Azagaya", "Laigter");
+  m_budget = settings.value("memory budget mb", 4096).toLongLong() * 1024 * 1024;
+  clock.start();
+
+  enforce_timer.setInterval(idle_ms);
+  enforce_timer.setSingleShot(true);
+  connect(&enforce_timer, SIGNAL(timeout()), this, SLOT(enforce()));
+}
+
+void MemoryBudget::add(ImageProcessor *p)
+{
+  QMutexLocker locker(&mutex);
+  lru.prepend(p);
+  last_used[p] = clock.elapsed();
+}
+
+void MemoryBudget::remove(ImageProcessor *p)
+{
+  QMutexLocker locker(&mutex);
+  lru.removeOne(p);
+  last_used.remove(p);
+}
+
+void MemoryBudget::touch(ImageProcessor *p)
+{
+  {
+    QMutexLocker locker(&mutex);
+    int i = lru.indexOf(p);
+    if (i < 0)
+      return;
+    lru.move(i, 0);
+    last_used[p] = clock.elapsed();
+  }
+
+  if (p->maps_evicted())
+    p->restore_maps(false);
+
+  if (m_budget > 0 && !enforce_timer.isActive())
+    enforce_timer.start();
+}
+
+void MemoryBudget::set_budget(qint64 bytes)
+{
+  m_budget = bytes;
+}
+
+qint64 MemoryBudget::budget()
+{
+  return m_budget;
+}
+
+qint64 MemoryBudget::resident_bytes()
+{
+  QMutexLocker locker(&mutex);
+  qint64 total = ScratchArena::resident_bytes();
+  foreach (ImageProcessor *p, lru)
+    total += p->resident_bytes();
+  return total;
+}
+
+void MemoryBudget::enforce()
+{
+  if (m_budget <= 0)
+    return;
+
+  QMutexLocker locker(&mutex);
+  QHash<ImageProcessor *, qint64> bytes;
+  qint64 total = 0;
+  foreach (ImageProcessor *p, lru)
+  {
+    bytes[p] = p->resident_bytes();
+    total += bytes[p];
+  }
+
+  /* Spare scratch planes go before any map that may be shown again */
+  qint64 scratch = ScratchArena::resident_bytes();
+  total += scratch;
+  if (total > m_budget && scratch > 0)
+  {
+    ScratchArena::trim();
+    total -= scratch;
+  }
+
+  qint64 now = clock.elapsed();
+  for (int i = lru.count() - 1; i >= 0 && total > m_budget; i--)
+  {
+    ImageProcessor *p = lru.at(i);
+    if (p->get_selected() || p->maps_evicted() || now - last_used.value(p) < idle_ms)
+      continue;
+
+    if (p->evict_maps())
+      total -= bytes[p] - p->resident_bytes();
+  }
+}
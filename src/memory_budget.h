@@ -0,0 +1,67 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef MEMORYBUDGET_H
+#define MEMORYBUDGET_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QTimer>
+
+class ImageProcessor;
+
+/* Keeps the computed maps of all processors under a byte budget. When the
+ * budget is exceeded, the maps of the least recently viewed processors are
+ * dropped; they are computed again when the sprite is viewed or exported.
+ * A budget of 0 disables eviction. */
+class MemoryBudget : public QObject
+{
+  Q_OBJECT
+
+public:
+  static MemoryBudget *instance();
+
+  void add(ImageProcessor *p);
+  void remove(ImageProcessor *p);
+  void touch(ImageProcessor *p);
+  void set_budget(qint64 bytes);
+  qint64 budget();
+  qint64 resident_bytes();
+
+public slots:
+  void enforce();
+
+private:
+  explicit MemoryBudget(QObject *parent = nullptr);
+
+  /* Processors viewed this recently are never evicted */
+  static const int idle_ms = 2000;
+
+  QMutex mutex;
+  QList<ImageProcessor *> lru;
+  QHash<ImageProcessor *, qint64> last_used;
+  QElapsedTimer clock;
+  QTimer enforce_timer;
+  qint64 m_budget;
+};
+
+#endif // MEMORYBUDGET_H
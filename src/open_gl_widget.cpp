@@ -18,10 +18,12 @@
  */
 
 #include "open_gl_widget.h"
+#include "memory_budget.h"
 
 #include <math.h>
 
 #include <QApplication>
+#include <QCache>
 #include <QDebug>
 #include <QFileInfo>
 #include <QImageWriter>
@@ -280,6 +282,11 @@ void OpenGlWidget::update_scene()
     float zoomY = processor->get_zoom();
     transform.scale(zoomX, zoomY, 1);
 
+    /* Sprites on screen count as used; evicted ones are recomputed */
+    QRectF screen_rect = (projection * view * transform).mapRect(QRectF(-1, -1, 2, 2));
+    if (screen_rect.intersects(QRectF(-1, -1, 2, 2)))
+      MemoryBudget::instance()->touch(processor);
+
     /* Start first pass */
 
     VAO.bind();
@@ -434,7 +441,8 @@ void OpenGlWidget::update_scene()
     brushTexture->destroy();
     brushTexture->create();
     QImage b = currentBrush->getBrushSprite();
-    brushTexture->setData(currentBrush->getBrushSprite());
+    PixelFormat::expect(b, QImage::Format_RGBA8888, "OpenGlWidget brush upload");
+    brushTexture->setData(b);
     float x = static_cast<float>(brushTexture->width()) * 0.5f;
     float y = static_cast<float>(brushTexture->height()) * 0.5f;
 
@@ -498,7 +506,7 @@ void OpenGlWidget::setImage(QImage *image)
     m_texture->destroy();
 
   m_texture->create();
-  m_texture->setData(*image);
+  m_texture->setData(PixelFormat::convert(*image, QImage::Format_RGBA8888, "OpenGlWidget::setImage"));
   sx = (float)image->width() / m_width;
   sy = (float)image->height() / m_height;
   pixelsX = image->width();
@@ -507,37 +515,70 @@ void OpenGlWidget::setImage(QImage *image)
   m_texture->generateMipMaps();
 }
 
+static QImage placeholder(const QImage &image, QColor color)
+{
+  /* Maps evicted by the memory budget are shown flat until recomputed */
+  if (!image.isNull())
+    return image;
+
+  QImage flat(1, 1, PixelFormat::canonical);
+  flat.fill(color);
+  return flat;
+}
+
+/* QOpenGLTexture uploads RGBA8888 and converts anything else first.
+ * Canonical maps are read in place; compact gray and RGB maps are expanded
+ * here, once per map rather than on every paint */
+static QImage upload_view(const QImage &map)
+{
+  if (map.format() == PixelFormat::canonical)
+    return PixelFormat::opaqueView(map);
+
+  static QCache<qint64, QImage> expanded(64 * 1024);
+  QImage *hit = expanded.object(map.cacheKey());
+  if (hit)
+    return *hit;
+
+  QImage rgba = PixelFormat::convert(map, QImage::Format_RGBA8888, "OpenGlWidget map upload");
+  expanded.insert(map.cacheKey(), new QImage(rgba), int(qMax<qint64>(1, rgba.sizeInBytes() / 1024)));
+  return rgba;
+}
+
 void OpenGlWidget::setNormalMap(QImage *image)
 {
+  QImage map = placeholder(*image, QColor(128, 128, 255));
   m_normalTexture->destroy();
   if (m_normalTexture->create())
-    m_normalTexture->setData(*image);
+    m_normalTexture->setData(upload_view(map));
 
   m_normalTexture->generateMipMaps();
 }
 
 void OpenGlWidget::setOcclusionMap(QImage *image)
 {
+  QImage map = placeholder(*image, Qt::white);
   m_occlusionTexture->destroy();
   m_occlusionTexture->create();
-  m_occlusionTexture->setData(*image);
+  m_occlusionTexture->setData(upload_view(map));
 
   m_occlusionTexture->generateMipMaps();
 }
 
 void OpenGlWidget::setParallaxMap(QImage *image)
 {
+  QImage map = placeholder(*image, Qt::white);
   m_parallaxTexture->destroy();
   m_parallaxTexture->create();
-  m_parallaxTexture->setData(*image);
+  m_parallaxTexture->setData(upload_view(map));
   m_parallaxTexture->generateMipMaps();
 }
 
 void OpenGlWidget::setSpecularMap(QImage *image)
 {
+  QImage map = placeholder(*image, Qt::black);
   m_specularTexture->destroy();
   if (m_specularTexture->create())
-    m_specularTexture->setData(*image);
+    m_specularTexture->setData(upload_view(map));
   m_specularTexture->generateMipMaps();
 }
 
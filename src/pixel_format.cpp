@@ -0,0 +1,121 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "pixel_format.h"
+
+#include <QAtomicInt>
+#include <QDebug>
+
+static QAtomicInt conversion_count(0);
+
+static void count_conversion(const QImage &image, QImage::Format format, const char *site, bool implicit)
+{
+  conversion_count.fetchAndAddRelaxed(1);
+  if (PixelFormat::tracing())
+  {
+    qDebug() << (implicit ? "implicit conversion" : "conversion") << site
+             << int(image.format()) << "->" << int(format) << image.size();
+  }
+}
+
+bool PixelFormat::tracing()
+{
+  static const bool trace = qEnvironmentVariableIsSet("LAIGTER_TRACE_CONVERSIONS");
+  return trace;
+}
+
+QImage PixelFormat::toCanonical(const QImage &image, const char *site)
+{
+  return convert(image, canonical, site);
+}
+
+QImage PixelFormat::convert(const QImage &image, QImage::Format format, const char *site)
+{
+  if (image.isNull() || image.format() == format)
+    return image;
+
+  count_conversion(image, format, site, false);
+  return image.convertToFormat(format);
+}
+
+bool PixelFormat::expect(const QImage &image, QImage::Format format, const char *site)
+{
+  if (image.isNull() || image.format() == format)
+    return true;
+
+  /* Qt will convert behind our back here (painter, GL upload...) */
+  count_conversion(image, format, site, true);
+  return false;
+}
+
+QImage PixelFormat::opaqueView(const QImage &image)
+{
+  /* Opaque premultiplied pixels are bit-identical to straight RGBA, so the
+   * GL upload can read them as Format_RGBA8888 without a conversion. The
+   * view does not own the pixels: keep the source alive while it is used. */
+  if (image.format() != canonical)
+    return image;
+
+  return QImage(image.constBits(), image.width(), image.height(),
+                image.bytesPerLine(), QImage::Format_RGBA8888);
+}
+
+void PixelFormat::applyAlpha(QImage *image, const QImage &alpha_source)
+{
+  if (image->isNull() || alpha_source.isNull())
+    return;
+
+  *image = toCanonical(*image, "PixelFormat::applyAlpha");
+  QImage alpha = alpha_source;
+  int alpha_offset = 3, alpha_stride = 4;
+  if (alpha.format() == QImage::Format_Alpha8)
+  {
+    alpha_offset = 0;
+    alpha_stride = 1;
+  }
+  else
+  {
+    alpha = toCanonical(alpha, "PixelFormat::applyAlpha source");
+  }
+
+  int w = qMin(image->width(), alpha.width());
+  int h = qMin(image->height(), alpha.height());
+  for (int y = 0; y < h; y++)
+  {
+    uchar *dst = image->scanLine(y);
+    const uchar *src = alpha.constScanLine(y) + alpha_offset;
+    for (int x = 0; x < w; x++)
+    {
+      /* Same as composing with DestinationIn: scale every channel by alpha */
+      uint a = *src;
+      for (int c = 0; c < 4; c++)
+      {
+        uint t = dst[c] * a + 128;
+        dst[c] = (t + (t >> 8)) >> 8;
+      }
+      dst += 4;
+      src += alpha_stride;
+    }
+  }
+}
+
+int PixelFormat::conversionCount()
+{
+  return conversion_count.loadAcquire();
+}
@@ -0,0 +1,43 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef PIXELFORMAT_H
+#define PIXELFORMAT_H
+
+#include <QImage>
+
+/* Every image is normalized to PixelFormat::canonical when it enters the
+ * processor. Conversions that still have to happen go through convert() so
+ * they are counted, and traced when LAIGTER_TRACE_CONVERSIONS is set. */
+class PixelFormat
+{
+public:
+  static const QImage::Format canonical = QImage::Format_RGBA8888_Premultiplied;
+
+public:
+  static QImage toCanonical(const QImage &image, const char *site);
+  static QImage convert(const QImage &image, QImage::Format format, const char *site);
+  static bool expect(const QImage &image, QImage::Format format, const char *site);
+  static QImage opaqueView(const QImage &image);
+  static void applyAlpha(QImage *image, const QImage &alpha_source);
+  static int conversionCount();
+  static bool tracing();
+};
+
+#endif // PIXELFORMAT_H
@@ -0,0 +1,292 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "presets.h"
+#include "image_processor.h"
+#include "light_source.h"
+
+#include <QBuffer>
+#include <QFile>
+#include <QTextCodec>
+#include <QTextStream>
+
+Presets::code_array &Presets::codes()
+{
+  /* Keys of the .presset text format, in the order the dialog lists them */
+  static QString presetCodes[30] = {"EnhanceHeight ",
+                                    "EnhanceSoft ",
+                                    "BumpHeight ",
+                                    "BumpDistance",
+                                    "BumpSoft ",
+                                    "BumpCut ",
+                                    "Tile ",
+                                    "InvertX ",
+                                    "InvertY ",
+                                    "ParallaxType",
+                                    "BinaryThreshold ",
+                                    "BinaryFocus ",
+                                    "ParallaxSoft ",
+                                    "BinaryMinHeight ",
+                                    "BinaryErodeDilate ",
+                                    "HeightMapBrightness ",
+                                    "HeightMapContrast ",
+                                    "InvertParallax ",
+                                    "SpecularBlur ",
+                                    "SpecularBright ",
+                                    "SpecularContrast ",
+                                    "SpecularThresh ",
+                                    "SpecularInvert ",
+                                    "OcclusionBlur ",
+                                    "OcclusionBright ",
+                                    "OcclusionInvert ",
+                                    "OcclusionThresh ",
+                                    "OcclusionContrast ",
+                                    "OcclusionDistance ",
+                                    "OcclusionDistanceMode "};
+  return presetCodes;
+}
+
+void Presets::apply_setting(QByteArray &setting, ImageProcessor &p)
+{
+  code_array &presetCodes = codes();
+  QList<QByteArray> aux = setting.split('\t');
+  if (aux[0] == presetCodes[0])
+    p.set_normal_depth(aux[1].toInt());
+  else if (aux[0] == presetCodes[1])
+    p.set_normal_blur_radius(aux[1].toInt());
+  else if (aux[0] == presetCodes[2])
+    p.set_normal_bisel_depth(aux[1].toInt());
+  else if (aux[0] == presetCodes[3])
+    p.set_normal_bisel_distance(aux[1].toInt());
+  else if (aux[0] == presetCodes[4])
+    p.set_normal_bisel_blur_radius(aux[1].toInt());
+  else if (aux[0] == presetCodes[5])
+    p.set_normal_bisel_soft((bool)aux[1].toInt());
+  else if (aux[0] == presetCodes[6])
+    p.set_tileable((bool)aux[1].toInt());
+  else if (aux[0] == presetCodes[7])
+    p.set_normal_invert_x((bool)aux[1].toInt());
+  else if (aux[0] == presetCodes[8])
+    p.set_normal_invert_y((bool)aux[1].toInt());
+  else if (aux[0] == presetCodes[9])
+    p.set_parallax_type((ParallaxType)aux[1].toInt());
+  else if (aux[0] == presetCodes[10])
+    p.set_parallax_thresh(aux[1].toInt());
+  else if (aux[0] == presetCodes[11])
+    p.set_parallax_focus(aux[1].toInt());
+  else if (aux[0] == presetCodes[12])
+    p.set_parallax_soft(aux[1].toInt());
+  else if (aux[0] == presetCodes[13])
+    p.set_parallax_min(aux[1].toInt());
+  else if (aux[0] == presetCodes[14])
+    p.set_parallax_erode_dilate(aux[1].toInt());
+  else if (aux[0] == presetCodes[15])
+    p.set_parallax_brightness(aux[1].toInt());
+  else if (aux[0] == presetCodes[16])
+    p.set_parallax_contrast(aux[1].toInt());
+  else if (aux[0] == presetCodes[17])
+    p.set_parallax_invert((bool)aux[1].toInt());
+  else if (aux[0] == presetCodes[18])
+    p.set_specular_blur(aux[1].toInt());
+  else if (aux[0] == presetCodes[19])
+    p.set_specular_bright(aux[1].toInt());
+  else if (aux[0] == presetCodes[20])
+    p.set_specular_contrast(aux[1].toInt());
+  else if (aux[0] == presetCodes[21])
+    p.set_specular_thresh(aux[1].toInt());
+  else if (aux[0] == presetCodes[22])
+    p.set_specular_invert((bool)aux[1].toInt());
+  else if (aux[0] == presetCodes[23])
+    p.set_occlusion_blur(aux[1].toInt());
+  else if (aux[0] == presetCodes[24])
+    p.set_occlusion_bright(aux[1].toInt());
+  else if (aux[0] == presetCodes[25])
+    p.set_occlusion_invert((bool)aux[1].toInt());
+  else if (aux[0] == presetCodes[26])
+    p.set_occlusion_thresh(aux[1].toInt());
+  else if (aux[0] == presetCodes[27])
+    p.set_occlusion_contrast(aux[1].toInt());
+  else if (aux[0] == presetCodes[28])
+    p.set_occlusion_distance(aux[1].toInt());
+  else if (aux[0] == presetCodes[29])
+    p.set_occlusion_distance_mode((bool)aux[1].toInt());
+  else if (aux[0] == "LightSource")
+  {
+    QList<LightSource *> *pLightList = p.get_light_list_ptr();
+    LightSource *light = new LightSource;
+    pLightList->append(light);
+  }
+  else if (aux[0] == "DiffuseColor ")
+  {
+    QList<LightSource *> *pLightList = p.get_light_list_ptr();
+    pLightList->last()->set_diffuse_color(
+        QColor(aux[1].toInt(), aux[2].toInt(), aux[3].toInt()));
+  }
+  else if (aux[0] == "DiffuseIntensity ")
+  {
+    QList<LightSource *> *pLightList = p.get_light_list_ptr();
+    pLightList->last()->set_diffuse_intensity(aux[1].toFloat());
+  }
+  else if (aux[0] == "SpecularColor ")
+  {
+    QList<LightSource *> *pLightList = p.get_light_list_ptr();
+    pLightList->last()->set_specular_color(
+        QColor(aux[1].toInt(), aux[2].toInt(), aux[3].toInt()));
+  }
+  else if (aux[0] == "SpecularScatter ")
+  {
+    QList<LightSource *> *pLightList = p.get_light_list_ptr();
+    pLightList->last()->set_specular_scatter(aux[1].toInt());
+  }
+  else if (aux[0] == "SpecularIntensity ")
+  {
+    QList<LightSource *> *pLightList = p.get_light_list_ptr();
+    pLightList->last()->set_specular_intensity(aux[1].toFloat());
+  }
+  else if (aux[0] == "Position ")
+  {
+    QList<LightSource *> *pLightList = p.get_light_list_ptr();
+    pLightList->last()->set_light_position(
+        QVector3D(aux[1].toFloat(), aux[2].toFloat(), aux[3].toFloat()));
+  }
+}
+
+bool Presets::apply_file(QString preset, ImageProcessor &p)
+{
+  QFile selected_preset(preset);
+  if (!selected_preset.open(QIODevice::ReadOnly))
+    return false;
+
+  QByteArray settings = selected_preset.readAll();
+  if (settings.contains("LightSource"))
+    p.get_light_list_ptr()->clear();
+
+  QList<QByteArray> settings_list = settings.split('\n');
+  for (int i = 0; i < settings_list.count(); i++)
+  {
+    QByteArray setting = settings_list.at(i);
+    apply_setting(setting, p);
+  }
+}
+
+void Presets::apply_string(QString presets, ImageProcessor *p)
+{
+  QByteArray settings = presets.toUtf8();
+  if (settings.contains("LightSource"))
+    p->get_light_list_ptr()->clear();
+
+  QList<QByteArray> settings_list = settings.split('\n');
+  for (int i = 0; i < settings_list.count(); i++)
+  {
+    QByteArray setting = settings_list.at(i);
+    apply_setting(setting, *p);
+  }
+}
+
+QByteArray Presets::encode(ImageProcessor *p)
+{
+  QString currentValues[30];
+
+  QList<LightSource *> pLightList;
+  pLightList.clear();
+
+  ProcessorSettings settings = p->get_settings();
+  foreach (LightSource *light, *(settings.lightList))
+  {
+    LightSource *l = new LightSource();
+    l->copy_settings(light);
+    pLightList.append(l);
+  }
+
+  currentValues[0] = QString::number(*settings.normal_depth);
+  currentValues[1] = QString::number(*settings.normal_blur_radius);
+  currentValues[2] = QString::number(*settings.normal_bisel_depth);
+  currentValues[3] = QString::number(*settings.normal_bisel_distance);
+  currentValues[4] = QString::number(*settings.normal_bisel_blur_radius);
+  currentValues[5] = *settings.normal_bisel_soft ? "1" : "0";
+  currentValues[6] = *settings.tileable ? "1" : "0";
+  currentValues[7] = *settings.normalInvertX == -1 ? "1" : "0";
+  currentValues[8] = *settings.normalInvertY == -1 ? "1" : "0";
+  currentValues[9] = QString::number((int)*settings.parallax_type);
+  currentValues[10] = QString::number(*settings.parallax_max);
+  currentValues[11] = QString::number(*settings.parallax_focus);
+  currentValues[12] = QString::number(*settings.parallax_soft);
+  currentValues[13] = QString::number(*settings.parallax_min);
+  currentValues[14] = QString::number(*settings.parallax_erode_dilate);
+  currentValues[15] = QString::number(*settings.parallax_brightness);
+  currentValues[16] = QString::number(*settings.parallax_contrast * 1000);
+  currentValues[17] = QString::number(*settings.parallax_invert);
+  currentValues[18] = QString::number(*settings.specular_blur);
+  currentValues[19] = QString::number(*settings.specular_bright);
+  currentValues[20] = QString::number(*settings.specular_contrast * 1000);
+  currentValues[21] = QString::number(*settings.specular_thresh);
+  currentValues[22] = *settings.specular_invert ? "1" : "0";
+  currentValues[23] = QString::number(*settings.occlusion_blur);
+  currentValues[24] = QString::number(*settings.occlusion_bright);
+  currentValues[25] = *settings.occlusion_invert ? "1" : "0";
+  currentValues[26] = QString::number(*settings.occlusion_thresh);
+  currentValues[27] = QString::number(*settings.occlusion_contrast * 1000);
+  currentValues[28] = QString::number(*settings.occlusion_distance);
+  currentValues[29] = *settings.occlusion_distance_mode ? "1" : "0";
+
+  QByteArray data;
+  QBuffer buffer(&data);
+  buffer.open(QIODevice::WriteOnly);
+  {
+    QTextStream in(&buffer);
+    in << "[Laigter Preset]";
+    in.setCodec(QTextCodec::codecForName("UTF-8"));
+    for (int i = 0; i < 30; i++)
+    {
+      in << "\n"
+         << codes()[i] << "\t" << currentValues[i];
+    }
+
+    foreach (LightSource *light, pLightList)
+    {
+      QColor diffuseColor = light->get_diffuse_color();
+      QColor specularColor = light->get_specular_color();
+      QVector3D position = light->get_light_position();
+      in << "\nLightSource\n";
+      in << "DiffuseColor \t" << diffuseColor.red() << "\t"
+         << diffuseColor.green() << "\t" << diffuseColor.blue()
+         << "\n";
+      in << "DiffuseIntensity \t" << light->get_diffuse_intensity()
+         << "\n";
+      in << "SpecularColor \t" << specularColor.red() << "\t"
+         << specularColor.green() << "\t" << specularColor.blue()
+         << "\n";
+      in << "SpecularScatter \t" << light->get_specular_scatter()
+         << "\n";
+      in << "SpecularIntensity \t" << light->get_specular_intesity()
+         << "\n";
+      in << "Position \t" << position.x() << "\t" << position.y()
+         << "\t" << position.z() << "\t";
+    }
+  }
+  qDeleteAll(pLightList);
+  return data;
+}
+
+void Presets::save(ImageProcessor *p, QString path)
+{
+  QFile preset(path);
+  if (preset.open(QIODevice::WriteOnly))
+    preset.write(encode(p));
+}
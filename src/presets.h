@@ -0,0 +1,45 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+
+#ifndef PRESETS_H
+#define PRESETS_H
+
+#include <QByteArray>
+#include <QString>
+
+class ImageProcessor;
+
+/* Reads and writes processor settings in the .presset text format. Kept
+ * apart from the presets dialog so the processing core can apply presets. */
+class Presets
+{
+public:
+  typedef QString code_array[30];
+
+public:
+  static code_array &codes();
+  static void apply_setting(QByteArray &setting, ImageProcessor &p);
+  static bool apply_file(QString preset, ImageProcessor &p);
+  static void apply_string(QString presets, ImageProcessor *p);
+  static QByteArray encode(ImageProcessor *p);
+  static void save(ImageProcessor *p, QString path);
+};
+
+#endif // PRESETS_H
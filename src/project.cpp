@@ -1,217 +1,286 @@
 #include "project.h"
-#include "gui/presets_manager.h"
+#include "map_exporter.h"
+#include "pixel_format.h"
+#include "presets.h"
+#include "project_archive.h"
 
+#include <QBuffer>
 #include <QDebug>
 #include <QFile>
+#include <QFileInfo>
+#include <QFuture>
 #include <QImage>
+#include <QImageWriter>
 #include <QJsonArray>
 #include <QJsonDocument>
 #include <QJsonObject>
-#include <QStandardPaths>
+#include <QSaveFile>
 #include <QTemporaryDir>
+#include <QtConcurrent/QtConcurrent>
 
-extern "C"
+static QByteArray encode_texture(QImage texture, QByteArray format)
 {
-#include "thirdparty/zip.h"
+  QByteArray data;
+  QBuffer buffer(&data);
+  buffer.open(QIODevice::WriteOnly);
+  if (!texture.save(&buffer, format))
+    return QByteArray();
+  return data;
+}
+
+static QByteArray encode_entry(ProjectSnapshot::Entry e, bool raw)
+{
+  /* Overlays never decoded since load go back in their file encoding */
+  if (!e.data.isEmpty() && !raw)
+    return e.data;
+
+  QImage image = e.image;
+  if (!e.data.isEmpty())
+    image = QImage::fromData(e.data);
+  else if (e.overlay)
+    image = e.overlay->get_image();
+  return raw ? ProjectArchive::encode_raw(image) : encode_texture(image, e.format);
+}
+
+/* Same order as ImageProcessor::install_maps */
+static const TextureTypes stored_types[] = {TextureTypes::Normal, TextureTypes::Specular,
+                                            TextureTypes::Parallax, TextureTypes::Occlussion};
+
+static QImage decode_image(const ProjectArchive *archive, QString name)
+{
+  QByteArray data = archive->read(name);
+  if (ProjectArchive::is_raw(data))
+    return ProjectArchive::decode_raw(data);
+  return PixelFormat::toCanonical(QImage::fromData(data), "Project::load");
+}
+
+static QImage decode_map(const ProjectArchive *archive, QString name, TextureTypes type)
+{
+  /* Maps are kept compact, not in the canonical format */
+  QByteArray data = archive->read(name);
+  if (ProjectArchive::is_raw(data))
+    return MapExporter::file_image(type, ProjectArchive::decode_raw(data));
+  return MapExporter::file_image(type, QImage::fromData(data));
+}
+
+static QString archive_stamp(QString path)
+{
+  QFileInfo info(path);
+  if (!info.isFile())
+    return QString();
+  return QString::number(info.size()) + " " + QString::number(info.lastModified().toMSecsSinceEpoch());
 }
 
-Project::Project(QObject *parent) : QObject(parent) {}
+Project::Project(QObject *parent) : QObject(parent)
+{
+  connect(&save_watcher, SIGNAL(finished()), this, SLOT(finish_save()));
+}
+
+Project::~Project()
+{
+  wait_for_save();
+}
 
 QString Project::GetCurrentPath()
 {
   return m_path;
 }
 
-bool Project::load(QString project_path, QList<ImageProcessor *> *p_list, QJsonObject *general_settings)
+void Project::set_headless(bool h)
 {
-  void *buf = NULL;
-  size_t bufsize;
-  QJsonDocument doc;
-  QJsonObject project_json;
-  QByteArray data;
+  headless = h;
+}
+
+void Project::set_compression(ProjectCompression c)
+{
+  compression = c;
+}
+
+bool Project::parse_compression(QString name, ProjectCompression *c)
+{
+  /* mixed, deflate or raw */
+  name = name.toLower();
+  if (name == "mixed")
+    *c = ProjectCompression::Mixed;
+  else if (name == "deflate")
+    *c = ProjectCompression::Deflate;
+  else if (name == "raw")
+    *c = ProjectCompression::Raw;
+  else
+    return false;
+  return true;
+}
 
+bool Project::load(QString project_path, QList<ImageProcessor *> *p_list, QJsonObject *general_settings)
+{
   QFileInfo info(project_path);
   if (!info.exists())
   {
-    return 1;
+    return false;
   }
 
+  /* Keys kept below describe the file opened here */
+  wait_for_save();
+
   QString base_path = info.path();
   m_path = project_path;
+  entry_keys.clear();
+  QHash<QString, qint64> keys;
 
-  struct zip_t *zip = zip_open(project_path.toUtf8(), 0, 'r');
+  ProjectArchive archive;
+  if (!archive.open(project_path))
   {
-    /* Load project json */
-    zip_entry_open(zip, "project.json");
-    {
-      zip_entry_read(zip, &buf, &bufsize);
-    }
-    zip_entry_close(zip);
-    data.append((char *)buf, bufsize);
-    QJsonParseError e;
-    doc = QJsonDocument::fromJson(data, &e);
-    project_json = doc.object();
-    /* Set general settings */
-    general_settings->insert("general", project_json.value("general"));
-
-    /* Start generating the processors */
-    QJsonArray processors = project_json.value("processors").toArray();
-    for (int i = 0; i < processors.count(); i++)
-    {
-      QJsonObject p_json = processors.at(i).toObject();
-      QString processor_name = p_json.value("processor name").toString();
-      ImageProcessor *p = new ImageProcessor;
-      p->set_name(processor_name);
-      /* Read Diffuse image. Maps are calculated when settings applied */
-
-      data.clear();
-      QImage diffuse;
-      QJsonObject frame = p_json.value("sprite").toObject();
-      QString path = frame.value("diffuse").toString();
-      zip_entry_open(zip, path.toUtf8());
-      {
-        zip_entry_read(zip, &buf, &bufsize);
-        data.append((char *)buf, bufsize);
-        diffuse = QImage::fromData(data);
-        p->loadImage(path, diffuse, base_path);
-      }
-      zip_entry_close(zip);
-
-      /* Restore Neighbours */
-      data.clear();
-      path = frame.value("neighbours").toString();
-      zip_entry_open(zip, path.toUtf8());
-      {
-        zip_entry_read(zip, &buf, &bufsize);
-        data.append((char *)buf, bufsize);
-        p->get_current_frame()->set_image(TextureTypes::Neighbours, QImage::fromData(data));
-      }
-      zip_entry_close(zip);
-
-      /* Restore Overlays */
-      data.clear();
-      path = frame.value("heightmapOverlay").toString();
-      zip_entry_open(zip, path.toUtf8());
-      {
-        zip_entry_read(zip, &buf, &bufsize);
-        data.append((char *)buf, bufsize);
-        p->set_heightmap_overlay(QImage::fromData(data));
-      }
-      zip_entry_close(zip);
+    qWarning() << "could not read project" << project_path;
+    return false;
+  }
 
-      data.clear();
-      path = frame.value("normalOverlay").toString();
-      zip_entry_open(zip, path.toUtf8());
-      {
-        zip_entry_read(zip, &buf, &bufsize);
-        data.append((char *)buf, bufsize);
-        QImage image = QImage::fromData(data);
-        p->set_normal_overlay(QImage::fromData(data));
-      }
-      zip_entry_close(zip);
+  /* Load project json */
+  QJsonParseError e;
+  QJsonDocument doc = QJsonDocument::fromJson(archive.read("project.json"), &e);
+  QJsonObject project_json = doc.object();
+  /* Set general settings */
+  if (general_settings)
+    general_settings->insert("general", project_json.value("general"));
 
-      data.clear();
-      path = frame.value("occlussionOverlay").toString();
-      zip_entry_open(zip, path.toUtf8());
-      {
-        zip_entry_read(zip, &buf, &bufsize);
-        data.append((char *)buf, bufsize);
-        p->set_occlussion_overlay(QImage::fromData(data));
-      }
-      zip_entry_close(zip);
+  /* Every diffuse, and the maps saved with a fingerprint, are decoded on
+   * the pool at once, in project order */
+  QJsonArray processors = project_json.value("processors").toArray();
+  QList<QFuture<QImage>> diffuses;
+  QList<QList<QFuture<QImage>>> stored_maps;
+  for (int i = 0; i < processors.count(); i++)
+  {
+    QJsonObject p_json = processors.at(i).toObject();
+    QJsonObject frame = p_json.value("sprite").toObject();
+    diffuses << QtConcurrent::run(decode_image, &archive, frame.value("diffuse").toString());
 
-      data.clear();
-      path = frame.value("parallaxOverlay").toString();
-      zip_entry_open(zip, path.toUtf8());
-      {
-        zip_entry_read(zip, &buf, &bufsize);
-        data.append((char *)buf, bufsize);
-        p->set_parallax_overlay(QImage::fromData(data));
-      }
-      zip_entry_close(zip);
+    QList<QFuture<QImage>> maps;
+    if (p_json.contains("maps fingerprint"))
+    {
+      for (TextureTypes type : stored_types)
+        maps << QtConcurrent::run(decode_map, &archive, frame.value(types.at(int(type))).toString(), type);
+    }
+    stored_maps << maps;
+  }
 
-      data.clear();
-      path = frame.value("specularOverlay").toString();
-      zip_entry_open(zip, path.toUtf8());
-      {
-        zip_entry_read(zip, &buf, &bufsize);
-        data.append((char *)buf, bufsize);
-        p->set_specular_overlay(QImage::fromData(data));
-      }
-      zip_entry_close(zip);
+  /* Start generating the processors */
+  for (int i = 0; i < processors.count(); i++)
+  {
+    QJsonObject p_json = processors.at(i).toObject();
+    QString processor_name = p_json.value("processor name").toString();
+    ImageProcessor *p = new ImageProcessor;
+    p->set_name(processor_name);
+    if (headless)
+      p->set_headless(true);
+    /* Maps are calculated once all settings are in */
+    p->set_calculation_deferred(true);
+
+    QJsonObject frame = p_json.value("sprite").toObject();
+    QString path = frame.value("diffuse").toString();
+    p->loadImage(path, diffuses[i].result(), base_path);
+
+    /* Neighbours are rebuilt from the frames after splitInFrames below */
+
+    /* Restore Overlays. Overlays that were never painted are not stored,
+     * the others stay encoded until they are first read. Their saved
+     * digests let the maps fingerprint skip decoding them */
+    QJsonObject digests = p_json.value("overlay digests").toObject();
+    for (int t = static_cast<int>(TextureTypes::TextureOverlay); t < types.count(); t++)
+    {
+      path = frame.value(types.at(t)).toString();
+      QByteArray digest = QByteArray::fromHex(digests.value(types.at(t)).toString().toLatin1());
+      if (path != "" && archive.contains(path))
+        p->set_encoded_overlay(static_cast<TextureTypes>(t), archive.read(path), digest);
+    }
 
-      data.clear();
-      path = frame.value("textureOverlay").toString();
-      zip_entry_open(zip, path.toUtf8());
-      {
-        zip_entry_read(zip, &buf, &bufsize);
-        data.append((char *)buf, bufsize);
-        p->set_texture_overlay(QImage::fromData(data));
-      }
-      zip_entry_close(zip);
+    /* Load custom heightmaps and specular maps */
 
-      /* Load custom heightmaps and specular maps */
+    /* restore position of processor */
+    QVector3D position;
+    position.setX(p_json.value("position").toObject().value("x").toDouble());
+    position.setY(p_json.value("position").toObject().value("y").toDouble());
+    position.setZ(p_json.value("position").toObject().value("z").toDouble());
 
-      /* restore position of processor */
-      QVector3D position;
-      position.setX(p_json.value("position").toObject().value("x").toDouble());
-      position.setY(p_json.value("position").toObject().value("y").toDouble());
-      position.setZ(p_json.value("position").toObject().value("z").toDouble());
+    p->set_position(position);
 
-      p->set_position(position);
+    /* restore tile options */
 
-      /* restore tile options */
+    p->set_tile_x(p_json.value("tile x").toBool());
+    p->set_tile_y(p_json.value("tile y").toBool());
 
-      p->set_tile_x(p_json.value("tile x").toBool());
-      p->set_tile_y(p_json.value("tile y").toBool());
+    /* restore individual zoom */
 
-      /* restore individual zoom */
+    p->set_zoom(p_json.value("zoom").toDouble());
 
-      p->set_zoom(p_json.value("zoom").toDouble());
+    /* Read Presets */
+    QByteArray data = archive.read(processor_name + "/" + processor_name + ".presets");
 
-      /* Read Presets */
-      data.clear();
-      zip_entry_open(zip, (processor_name + "/" + processor_name + ".presets").toUtf8());
-      {
-        zip_entry_read(zip, &buf, &bufsize);
-        data.append((char *)buf, bufsize);
-      }
-      zip_entry_close(zip);
-
-      /* restore frames settings */
-      int hframes = p_json.value("hframes").toInt();
-      int vframes = p_json.value("vframes").toInt();
-      p->splitInFrames(hframes, vframes);
-      p->reset_neighbours();
-      p->frame_mode = p_json.value("frames mode").toString();
-      p->animation_list.clear();
-      QJsonArray animations = p_json.value("animations").toArray();
-      for (int i = 0; i < animations.count(); i++)
+    /* restore frames settings */
+    int hframes = p_json.value("hframes").toInt();
+    int vframes = p_json.value("vframes").toInt();
+    p->splitInFrames(hframes, vframes);
+    p->reset_neighbours();
+    p->frame_mode = p_json.value("frames mode").toString();
+    p->animation_list.clear();
+    QJsonArray animations = p_json.value("animations").toArray();
+    for (int i = 0; i < animations.count(); i++)
+    {
+      QJsonObject animation_object = animations.at(i).toObject();
+      Animation animation(animation_object.value("name").toString());
+      QJsonArray frames_array = animation_object.value("frames").toArray();
+      for (int j = 0; j < frames_array.count(); j++)
       {
-        QJsonObject animation_object = animations.at(i).toObject();
-        Animation animation(animation_object.value("name").toString());
-        QJsonArray frames_array = animation_object.value("frames").toArray();
-        for (int j = 0; j < frames_array.count(); j++)
-        {
-          animation.frames_id.append(frames_array.at(j).toInt());
-        }
-        p->animation_list.append(animation);
+        animation.frames_id.append(frames_array.at(j).toInt());
       }
-      PresetsManager::applyPresetsString(data, p);
-      p_list->append(p);
+      p->animation_list.append(animation);
+    }
+    Presets::apply_string(data, p);
+
+    /* Maps saved from the same inputs and settings are installed as they
+     * are. Otherwise they are computed when the sprite is first drawn or
+     * exported */
+    QByteArray key = QByteArray::fromHex(p_json.value("maps fingerprint").toString().toLatin1());
+    QList<QFuture<QImage>> &maps = stored_maps[i];
+    bool installed = maps.count() == 4 &&
+                     p->install_stored_maps(key, maps[0].result(), maps[1].result(),
+                                            maps[2].result(), maps[3].result());
+    if (!installed)
+      p->defer_maps();
+
+    /* Remember what the entries were decoded into, so that saving again
+     * copies the ones left untouched */
+    QList<TextureTypes> loaded;
+    loaded << TextureTypes::Diffuse;
+    if (installed)
+    {
+      for (TextureTypes type : stored_types)
+        loaded << type;
     }
+    for (int t = static_cast<int>(TextureTypes::TextureOverlay); t < types.count(); t++)
+      loaded << static_cast<TextureTypes>(t);
+    foreach (TextureTypes type, loaded)
+    {
+      QString entry_name = frame.value(types.at(int(type))).toString();
+      if (entry_name == "" || !archive.contains(entry_name))
+        continue;
+      TiledOverlay *overlay = p->sprite.get_overlay(type);
+      QImage image;
+      if (!overlay)
+        p->sprite.get_image(type, &image);
+      keys.insert(entry_name, overlay ? qint64(overlay->generation()) : image.cacheKey());
+    }
+    p_list->append(p);
   }
-  zip_close(zip);
 
-  free(buf);
+  entry_keys = keys;
+  saved_stamp = archive_stamp(project_path);
   return true;
 }
 
-bool Project::save(QString path, QList<ImageProcessor *> processorList, QJsonObject general_settings)
+ProjectSnapshot Project::snapshot(QList<ImageProcessor *> processorList, QJsonObject general_settings)
 {
+  ProjectSnapshot snapshot;
+  snapshot.compression = compression;
   QJsonArray json_array;
-  m_path = path;
-  struct zip_t *zip = zip_open(path.toUtf8(), ZIP_DEFAULT_COMPRESSION_LEVEL, 'w');
   for (int j = 0; j < processorList.count(); j++)
   {
     ImageProcessor *p = processorList.at(j);
@@ -221,30 +290,60 @@ bool Project::save(QString path, QList<ImageProcessor *> processorList, QJsonObj
     processor_json.insert("hframes", p->getHFrames());
     processor_json.insert("vframes", p->getVFrames());
 
+    /* Lets load skip computing maps that are still current */
+    QByteArray key = p->maps_fingerprint();
+    if (!key.isEmpty())
+    {
+      processor_json.insert("maps fingerprint", QString::fromLatin1(key.toHex()));
+
+      /* Already hashed for the key, so nothing is decoded here. The
+       * texture overlay is not part of it */
+      QJsonObject digests;
+      for (int t = static_cast<int>(TextureTypes::NormalOverlay); t < types.count(); t++)
+      {
+        TiledOverlay *overlay = p->sprite.get_overlay(static_cast<TextureTypes>(t));
+        if (overlay && !overlay->is_empty())
+          digests.insert(types.at(t), QString::fromLatin1(overlay->digest().toHex()));
+      }
+      processor_json.insert("overlay digests", digests);
+    }
+
     // TODO: REDO project frame save
 
     QJsonObject sprite_json;
-    Sprite s;
-    s = p->sprite;
+    /* Read in place: a copy would decode every overlay still encoded */
+    Sprite &s = p->sprite;
     QString name;
     for (int i = 0; i < types.count(); i++)
     {
-      QImage texture;
-      s.get_image((TextureTypes)i, &texture);
-      bool save = true;
+      TiledOverlay *overlay = s.get_overlay((TextureTypes)i);
+      ProjectSnapshot::Entry entry;
+      bool save;
+      if (overlay)
+      {
+        entry.key = qint64(overlay->generation());
+        save = !overlay->is_empty();
+      }
+      else
+      {
+        s.get_image((TextureTypes)i, &entry.image);
+        entry.key = entry.image.cacheKey();
+        /* Lazily allocated slots (neighbours) may still be empty */
+        save = !entry.image.isNull();
+      }
       switch ((TextureTypes)i)
       {
         case TextureTypes::Heightmap:
         {
           name = s.heightmapPath;
-          save = name != "";
+          save &= name != "";
           break;
         }
 
         case TextureTypes::SpecularBase:
         {
           name = s.specularPath;
-          save = name != "";
+          save &= name != "";
           break;
         }
 
@@ -262,46 +361,37 @@ bool Project::save(QString path, QList<ImageProcessor *> processorList, QJsonObj
 
       if (save)
       {
-        QDir dir(QStandardPaths::writableLocation(
-            QStandardPaths::TempLocation));
-        name = dir.path() + "/" + name.split("/").last().split(".").join(suffixes.at(i) + ".");
-        if (texture.hasAlphaChannel() && (name.endsWith("jpg") || name.endsWith("jpeg")))
+        name = name.split("/").last().split(".").join(suffixes.at(i) + ".");
+        if ((overlay || entry.image.hasAlphaChannel()) && (name.endsWith("jpg") || name.endsWith("jpeg")))
         {
           name = name.replace("jpg", "png");
           name = name.replace("jpeg", "png");
         }
-        texture.save(name);
-        QString entry_name = p->get_name() + "/" + types.at(i) + "/" + name.split("/").last();
-
-        sprite_json.insert(types.at(i), entry_name);
-
-        zip_entry_open(zip, entry_name.toUtf8());
+        entry.name = p->get_name() + "/" + types.at(i) + "/" + name;
+        sprite_json.insert(types.at(i), entry.name);
+
+        /* Loading sniffs the content, so formats Qt cannot write go as png.
+         * Raw payloads keep the image names and are told apart the same way */
+        entry.format = QFileInfo(name).suffix().toLower().toUtf8();
+        if (!QImageWriter::supportedImageFormats().contains(entry.format))
+          entry.format = "png";
+
+        /* Overlays are only put together on the writing thread. Copies of
+         * painted ones share their tiles */
+        if (overlay)
         {
-          QFile f(name);
-          if (f.open(QIODevice::ReadOnly))
-          {
-            QByteArray a = f.readAll();
-            zip_entry_write(zip, a, a.count());
-            f.close();
-          }
+          entry.data = overlay->encoded();
+          if (entry.data.isEmpty())
+            entry.overlay = QSharedPointer<TiledOverlay>(new TiledOverlay(*overlay));
         }
-        zip_entry_close(zip);
-      }
-    }
-    zip_entry_open(zip, (p->get_name() + "/" + p->get_name() + ".presets").toUtf8());
-    {
-      QDir dir(QStandardPaths::writableLocation(
-          QStandardPaths::TempLocation));
-      name = dir.path() + "/" + p->get_name() + ".presets";
-      PresetsManager::SaveAllPresets(p, name);
-      QFile f(name);
-      if (f.open(QIODevice::ReadOnly))
-      {
-        QByteArray content = f.readAll();
-        zip_entry_write(zip, content, content.count());
+        snapshot.entries << entry;
       }
     }
-    zip_entry_close(zip);
+    /* Presets are a few lines of text, encoded right here */
+    ProjectSnapshot::Entry presets;
+    presets.name = p->get_name() + "/" + p->get_name() + ".presets";
+    presets.data = Presets::encode(p);
+    snapshot.entries << presets;
 
     processor_json.insert("sprite", sprite_json);
     /* Save frames settings */
@@ -341,17 +431,176 @@ bool Project::save(QString path, QList<ImageProcessor *> processorList, QJsonObj
 
     json_array.append(processor_json);
   }
-  QJsonObject project_json;
-  project_json.insert("processors", json_array);
-  project_json.insert("general", general_settings);
-  QJsonDocument json_project(project_json);
-  zip_entry_open(zip, "project.json");
+
+  snapshot.json.insert("processors", json_array);
+  snapshot.json.insert("general", general_settings);
+  return snapshot;
+}
+
+bool Project::write(ProjectSnapshot snapshot, QString path)
+{
+  /* Entries whose texture did not change since the last load or save are
+   * copied over from that file as they are, if nobody touched it since */
+  ProjectArchive previous;
+  bool incremental = !snapshot.previous_keys.isEmpty() &&
+                     archive_stamp(snapshot.previous_path) == snapshot.previous_stamp &&
+                     previous.open(snapshot.previous_path);
+  bool raw = snapshot.compression == ProjectCompression::Raw;
+
+  /* Written next to the destination and renamed over it once complete */
+  QSaveFile file(path);
+  ProjectArchiveWriter zip;
+  if (!file.open(QIODevice::WriteOnly) || !zip.open(&file))
+  {
+    qWarning() << "could not write project" << path;
+    return false;
+  }
+  /* Text compresses well; deflating png or jpeg again gains next to nothing */
+  int text_level = ProjectArchiveWriter::deflated;
+
+  /* Textures are encoded in memory on the pool, all at once, while the zip
+   * entries are appended from this thread in project order */
+  QList<QFuture<QByteArray>> encoded;
+  QList<bool> copied;
+  foreach (const ProjectSnapshot::Entry &e, snapshot.entries)
   {
-    zip_entry_write(zip, json_project.toJson(), json_project.toJson().count());
+    bool copy = incremental && e.key != 0 && snapshot.previous_keys.value(e.name, 0) == e.key &&
+                previous.contains(e.name) && previous.is_raw_entry(e.name) == raw;
+    copied << copy;
+    encoded << (copy || e.format.isEmpty() ? QFuture<QByteArray>() : QtConcurrent::run(encode_entry, e, raw));
   }
-  zip_entry_close(zip);
 
-  zip_close(zip);
+  bool written = true;
+  int total = snapshot.entries.count() + 1;
+  for (int i = 0; i < snapshot.entries.count(); i++)
+  {
+    const ProjectSnapshot::Entry &e = snapshot.entries.at(i);
+    if (copied.at(i))
+    {
+      written &= zip.copy(previous, e.name);
+    }
+    else if (e.format.isEmpty())
+    {
+      written &= zip.add(e.name, e.data, text_level);
+    }
+    else
+    {
+      QByteArray data = encoded[i].result();
+      if (data.isEmpty())
+      {
+        qWarning() << "could not encode" << e.name;
+        written = false;
+      }
+      bool packed = e.format == "png" || e.format == "jpg" || e.format == "jpeg" || e.format == "webp";
+      int level = raw || (snapshot.compression == ProjectCompression::Mixed && packed) ? ProjectArchiveWriter::stored
+                                                                                      : ProjectArchiveWriter::deflated;
+      written &= zip.add(e.name, data, level);
+    }
+    emit save_progress(i + 1, total);
+  }
 
+  QJsonDocument json_project(snapshot.json);
+  written &= zip.add("project.json", json_project.toJson(), text_level);
+
+  /* The previous file may be the one being replaced */
+  previous.close();
+  if (!zip.finish() || !written || !file.commit())
+  {
+    qWarning() << "could not write project" << path;
+    file.cancelWriting();
+    return false;
+  }
+  emit save_progress(total, total);
+  return true;
+}
+
+void Project::saved(const ProjectSnapshot &s, QString path)
+{
+  m_path = path;
+  entry_keys.clear();
+  foreach (const ProjectSnapshot::Entry &e, s.entries)
+  {
+    if (e.key != 0)
+      entry_keys.insert(e.name, e.key);
+  }
+  saved_stamp = archive_stamp(path);
+}
+
+bool Project::save(QString path, QList<ImageProcessor *> processorList, QJsonObject general_settings)
+{
+  wait_for_save();
+  ProjectSnapshot s = snapshot(processorList, general_settings);
+  s.previous_path = m_path;
+  s.previous_keys = entry_keys;
+  s.previous_stamp = saved_stamp;
+  if (!write(s, path))
+    return false;
+
+  saved(s, path);
   return true;
 }
+
+void Project::save_async(QString path, QList<ImageProcessor *> processorList, QJsonObject general_settings)
+{
+  /* Taken now and written on the pool: edits made meanwhile go to the
+   * next save */
+  ProjectSnapshot s = snapshot(processorList, general_settings);
+  if (is_saving())
+  {
+    /* Only the latest request waiting behind the running save is kept */
+    queued = s;
+    queued_path = path;
+    return;
+  }
+  start_save(s, path);
+}
+
+void Project::start_save(ProjectSnapshot s, QString path)
+{
+  /* Previous keys are only final once the save before has finished */
+  s.previous_path = m_path;
+  s.previous_keys = entry_keys;
+  s.previous_stamp = saved_stamp;
+  running = s;
+  running_path = path;
+  save_watcher.setFuture(QtConcurrent::run(this, &Project::write, s, path));
+}
+
+void Project::finish_save()
+{
+  /* Also reached from wait_for_save(), before the watcher reports */
+  if (running_path.isEmpty() || !save_watcher.isFinished())
+    return;
+
+  QString path = running_path;
+  bool ok = save_watcher.result();
+  if (ok)
+    saved(running, path);
+  running = ProjectSnapshot();
+  running_path.clear();
+
+  if (!queued_path.isEmpty())
+  {
+    ProjectSnapshot s = queued;
+    QString next = queued_path;
+    queued = ProjectSnapshot();
+    queued_path.clear();
+    start_save(s, next);
+  }
+  emit save_finished(ok, path);
+}
+
+bool Project::is_saving()
+{
+  return !running_path.isEmpty();
+}
+
+void Project::wait_for_save()
+{
+  /* Queued saves are written too */
+  while (is_saving())
+  {
+    save_watcher.waitForFinished();
+    finish_save();
+  }
+}
@@ -3,8 +3,46 @@
 
 #include "src/image_processor.h"
 
+#include <QFutureWatcher>
+#include <QHash>
 #include <QJsonObject>
 #include <QObject>
+#include <QSharedPointer>
+
+/* How Project::save compresses its entries */
+enum class ProjectCompression
+{
+  Mixed,   /* encoded images stored as they are, json and presets deflated */
+  Deflate, /* every entry deflated, as older versions wrote them */
+  Raw      /* raw pixels with a checksum, stored: fastest but largest */
+};
+
+/* Everything a save writes, taken on the GUI thread. Images are shared,
+ * not copied, so taking it is cheap and later edits do not reach it */
+struct ProjectSnapshot
+{
+  struct Entry
+  {
+    QString name;
+    /* What the entry is made from, 0 for entries always written again */
+    qint64 key = 0;
+    QImage image;
+    QSharedPointer<TiledOverlay> overlay;
+    /* Text as is, or an overlay still in its file encoding */
+    QByteArray data;
+    /* Empty for text entries */
+    QByteArray format;
+  };
+
+  QList<Entry> entries;
+  QJsonObject json;
+  ProjectCompression compression = ProjectCompression::Mixed;
+
+  /* The file entries may be copied from, filled in when writing starts */
+  QString previous_path;
+  QHash<QString, qint64> previous_keys;
+  QString previous_stamp;
+};
 
 class Project : public QObject
 {
@@ -15,14 +53,43 @@ public:
 
 public:
   explicit Project(QObject *parent = nullptr);
+  ~Project();
   QString GetCurrentPath();
+  void set_headless(bool h);
+  void set_compression(ProjectCompression c);
+  static bool parse_compression(QString name, ProjectCompression *c);
+  ProjectSnapshot snapshot(QList<ImageProcessor *> processorList, QJsonObject general_settings = {});
+  bool is_saving();
+  void wait_for_save();
 
 public slots:
   bool save(QString path, QList<ImageProcessor *> processorList, QJsonObject general_settings = {});
+  void save_async(QString path, QList<ImageProcessor *> processorList, QJsonObject general_settings = {});
   bool load(QString project_path, QList<ImageProcessor *> *p_list, QJsonObject *general_settings = nullptr);
 
+signals:
+  /* Emitted from the thread writing the file */
+  void save_progress(int done, int total);
+  void save_finished(bool saved, QString path);
+
+private slots:
+  void finish_save();
+
 private:
+  bool write(ProjectSnapshot s, QString path);
+  void start_save(ProjectSnapshot s, QString path);
+  void saved(const ProjectSnapshot &s, QString path);
+
+  QFutureWatcher<bool> save_watcher;
+  ProjectSnapshot running, queued;
+  QString running_path, queued_path;
+
   QString m_path;
+  bool headless = false;
+  ProjectCompression compression = ProjectCompression::Mixed;
+  /* What each entry of the file at m_path was made from, see save() */
+  QHash<QString, qint64> entry_keys;
+  QString saved_stamp;
   const QStringList suffixes = {"", "_n", "_s", "_p", "_o", "_h",
                                 "_d", "_neigh", "_sb", "_ob", "_co", "_to", "_no",
                                 "_ho", "_so", "_po", "_oo"};
@@ -0,0 +1,329 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+
+#include "project_archive.h"
+#include "pixel_format.h"
+
+#include <QDebug>
+#include <QtEndian>
+#include <climits>
+#include <cstring>
+
+/* Declarations only: the implementation is built with thirdparty/zip.c */
+#define MINIZ_HEADER_FILE_ONLY
+#define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
+#include "thirdparty/miniz.h"
+
+static const int local_header_size = 30;
+static const char raw_magic[8] = {'L', 'G', 'T', 'R', 'A', 'W', '0', '1'};
+static const int raw_header_size = 20;
+
+static quint16 read_u16(const uchar *p)
+{
+  return quint16(p[0] | (p[1] << 8));
+}
+
+ProjectArchive::ProjectArchive() {}
+
+ProjectArchive::~ProjectArchive()
+{
+  close();
+}
+
+bool ProjectArchive::open(QString path)
+{
+  close();
+  file.setFileName(path);
+  if (!file.open(QIODevice::ReadOnly))
+    return false;
+
+  length = quint64(file.size());
+  data = file.map(0, file.size());
+  mapped = data != nullptr;
+  if (!mapped)
+  {
+    /* Some file systems cannot map: fall back to one read */
+    buffered = file.readAll();
+    data = reinterpret_cast<const uchar *>(buffered.constData());
+    length = quint64(buffered.size());
+  }
+
+  mz_zip_archive zip;
+  memset(&zip, 0, sizeof(zip));
+  if (!mz_zip_reader_init_mem(&zip, data, size_t(length), 0))
+  {
+    qWarning() << "not a project archive" << path;
+    close();
+    return false;
+  }
+
+  mz_uint count = mz_zip_reader_get_num_files(&zip);
+  index.reserve(int(count));
+  for (mz_uint i = 0; i < count; i++)
+  {
+    mz_zip_archive_file_stat stat;
+    if (mz_zip_reader_is_file_a_directory(&zip, i) || !mz_zip_reader_file_stat(&zip, i, &stat))
+      continue;
+
+    Entry e;
+    e.header = stat.m_local_header_ofs;
+    e.compressed = stat.m_comp_size;
+    e.size = stat.m_uncomp_size;
+    e.crc = stat.m_crc32;
+    e.method = stat.m_method;
+    index.insert(QString::fromUtf8(stat.m_filename), e);
+  }
+  mz_zip_reader_end(&zip);
+  return true;
+}
+
+void ProjectArchive::close()
+{
+  index.clear();
+  if (mapped)
+    file.unmap(const_cast<uchar *>(data));
+  file.close();
+  buffered.clear();
+  data = nullptr;
+  length = 0;
+  mapped = false;
+}
+
+bool ProjectArchive::contains(QString name) const
+{
+  return index.contains(name);
+}
+
+bool ProjectArchive::read_stored(QString name, QByteArray *stored, int *method, quint32 *crc, quint64 *size) const
+{
+  QHash<QString, Entry>::const_iterator i = index.constFind(name);
+  if (i == index.constEnd())
+    return false;
+
+  /* The local header repeats the name and may carry its own extra field */
+  const Entry &e = i.value();
+  if (e.header + local_header_size > length)
+    return false;
+
+  const uchar *header = data + e.header;
+  if (header[0] != 'P' || header[1] != 'K' || header[2] != 3 || header[3] != 4)
+    return false;
+
+  quint64 start = e.header + local_header_size + read_u16(header + 26) + read_u16(header + 28);
+  if (start + e.compressed > length || e.size > quint64(INT_MAX) || e.compressed > quint64(INT_MAX))
+    return false;
+
+  /* Points into the mapping: only valid while the archive is open */
+  *stored = QByteArray::fromRawData(reinterpret_cast<const char *>(data + start), int(e.compressed));
+  *method = e.method;
+  *crc = e.crc;
+  *size = e.size;
+  return true;
+}
+
+QByteArray ProjectArchive::read(QString name) const
+{
+  QByteArray stored;
+  int method;
+  quint32 crc;
+  quint64 size;
+  if (!read_stored(name, &stored, &method, &crc, &size))
+    return QByteArray();
+
+  if (method == 0)
+    return QByteArray(stored.constData(), stored.size());
+
+  if (method != MZ_DEFLATED)
+  {
+    qWarning() << "unsupported compression for" << name;
+    return QByteArray();
+  }
+
+  QByteArray out(int(size), Qt::Uninitialized);
+  size_t n = tinfl_decompress_mem_to_mem(out.data(), size_t(size), stored.constData(), size_t(stored.size()), 0);
+  if (n == TINFL_DECOMPRESS_MEM_TO_MEM_FAILED || n != size)
+  {
+    qWarning() << "corrupt entry" << name;
+    return QByteArray();
+  }
+  return out;
+}
+
+QByteArray ProjectArchive::encode_raw(const QImage &image)
+{
+  QImage canonical = PixelFormat::toCanonical(image, "ProjectArchive::encode_raw");
+  int line = canonical.width() * 4;
+  QByteArray data(raw_header_size + line * canonical.height(), Qt::Uninitialized);
+  uchar *out = reinterpret_cast<uchar *>(data.data());
+  memcpy(out, raw_magic, sizeof(raw_magic));
+  qToLittleEndian<quint32>(quint32(canonical.width()), out + 8);
+  qToLittleEndian<quint32>(quint32(canonical.height()), out + 12);
+
+  uchar *pixels = out + raw_header_size;
+  for (int y = 0; y < canonical.height(); y++)
+    memcpy(pixels + y * line, canonical.constScanLine(y), line);
+
+  mz_ulong sum = mz_adler32(MZ_ADLER32_INIT, pixels, size_t(data.size() - raw_header_size));
+  qToLittleEndian<quint32>(quint32(sum), out + 16);
+  return data;
+}
+
+bool ProjectArchive::is_raw(const QByteArray &data)
+{
+  return data.size() >= raw_header_size && memcmp(data.constData(), raw_magic, sizeof(raw_magic)) == 0;
+}
+
+QImage ProjectArchive::decode_raw(const QByteArray &data)
+{
+  if (!is_raw(data))
+    return QImage();
+
+  const uchar *in = reinterpret_cast<const uchar *>(data.constData());
+  quint32 w = qFromLittleEndian<quint32>(in + 8);
+  quint32 h = qFromLittleEndian<quint32>(in + 12);
+  quint32 sum = qFromLittleEndian<quint32>(in + 16);
+  if (w > 32768 || h > 32768 || quint64(data.size() - raw_header_size) != quint64(w) * h * 4)
+  {
+    qWarning() << "truncated raw image";
+    return QImage();
+  }
+
+  const uchar *pixels = in + raw_header_size;
+  if (quint32(mz_adler32(MZ_ADLER32_INIT, pixels, size_t(w) * h * 4)) != sum)
+  {
+    qWarning() << "raw image checksum mismatch";
+    return QImage();
+  }
+
+  QImage image(int(w), int(h), PixelFormat::canonical);
+  for (int y = 0; y < int(h); y++)
+    memcpy(image.scanLine(y), pixels + size_t(y) * w * 4, w * 4);
+  return image;
+}
+
+bool ProjectArchive::is_raw_entry(QString name) const
+{
+  /* Raw payloads are always stored, so the header can be read in place */
+  QByteArray bytes;
+  int method;
+  quint32 crc;
+  quint64 size;
+  return read_stored(name, &bytes, &method, &crc, &size) && method == 0 && is_raw(bytes);
+}
+
+struct ProjectArchiveWriter::State
+{
+  mz_zip_archive zip;
+  bool failed;
+};
+
+ProjectArchiveWriter::ProjectArchiveWriter() {}
+
+ProjectArchiveWriter::~ProjectArchiveWriter()
+{
+  if (state)
+  {
+    mz_zip_writer_end(&state->zip);
+    delete state;
+  }
+}
+
+size_t ProjectArchiveWriter::write(void *opaque, quint64 offset, const void *data, size_t n)
+{
+  /* miniz goes back to fill in each local header once the entry is written */
+  QIODevice *device = static_cast<QIODevice *>(opaque);
+  if (quint64(device->pos()) != offset && !device->seek(qint64(offset)))
+    return 0;
+  qint64 written = device->write(static_cast<const char *>(data), qint64(n));
+  return written < 0 ? 0 : size_t(written);
+}
+
+bool ProjectArchiveWriter::open(QIODevice *d)
+{
+  if (state || !d || !d->isWritable() || d->isSequential())
+    return false;
+
+  device = d;
+  state = new State;
+  memset(&state->zip, 0, sizeof(state->zip));
+  state->failed = false;
+  state->zip.m_pWrite = write;
+  state->zip.m_pIO_opaque = device;
+  if (!mz_zip_writer_init(&state->zip, 0))
+  {
+    delete state;
+    state = nullptr;
+    return false;
+  }
+  return true;
+}
+
+bool ProjectArchiveWriter::add(QString name, const QByteArray &data, int level)
+{
+  if (!state)
+    return false;
+
+  if (!mz_zip_writer_add_mem(&state->zip, name.toUtf8().constData(), data.constData(), size_t(data.size()),
+                             mz_uint(qBound(0, level, 10))))
+  {
+    qWarning() << "could not add" << name << "to the project";
+    state->failed = true;
+    return false;
+  }
+  return true;
+}
+
+bool ProjectArchiveWriter::copy(const ProjectArchive &from, QString name)
+{
+  if (!state)
+    return false;
+
+  /* Deflated data goes across untouched along with its crc */
+  QByteArray bytes;
+  int method;
+  quint32 crc;
+  quint64 size;
+  if (!from.read_stored(name, &bytes, &method, &crc, &size) || (method != 0 && method != MZ_DEFLATED))
+    return false;
+
+  bool added = method == 0 ? mz_zip_writer_add_mem(&state->zip, name.toUtf8().constData(), bytes.constData(),
+                                                   size_t(bytes.size()), mz_uint(stored))
+                           : mz_zip_writer_add_mem_ex(&state->zip, name.toUtf8().constData(), bytes.constData(),
+                                                      size_t(bytes.size()), nullptr, 0,
+                                                      MZ_ZIP_FLAG_COMPRESSED_DATA, size, crc);
+  if (!added)
+  {
+    qWarning() << "could not copy" << name << "to the project";
+    state->failed = true;
+  }
+  return added;
+}
+
+bool ProjectArchiveWriter::finish()
+{
+  if (!state)
+    return false;
+
+  bool ok = !state->failed && mz_zip_writer_finalize_archive(&state->zip);
+  ok &= bool(mz_zip_writer_end(&state->zip));
+  delete state;
+  state = nullptr;
+  return ok;
+}
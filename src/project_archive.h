@@ -0,0 +1,97 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+
+#ifndef PROJECTARCHIVE_H
+#define PROJECTARCHIVE_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QImage>
+#include <QIODevice>
+#include <QString>
+
+/* Read-only view of a .laigter zip. The file is memory-mapped and its
+ * central directory indexed once; read() then inflates a single entry
+ * straight from the mapping and may be called from several threads. */
+class ProjectArchive
+{
+public:
+  ProjectArchive();
+  ~ProjectArchive();
+
+  bool open(QString path);
+  void close();
+  bool contains(QString name) const;
+  QByteArray read(QString name) const;
+  /* The entry as stored in the zip, without copying it out of the file */
+  bool read_stored(QString name, QByteArray *data, int *method, quint32 *crc, quint64 *size) const;
+
+  /* Uncompressed canonical pixels behind a small header with a checksum,
+   * for saves where speed matters more than size */
+  static QByteArray encode_raw(const QImage &image);
+  static bool is_raw(const QByteArray &data);
+  static QImage decode_raw(const QByteArray &data);
+  bool is_raw_entry(QString name) const;
+
+private:
+  struct Entry
+  {
+    quint64 header;
+    quint64 compressed;
+    quint64 size;
+    quint32 crc;
+    int method;
+  };
+
+  QFile file;
+  QByteArray buffered;
+  const uchar *data = nullptr;
+  quint64 length = 0;
+  bool mapped = false;
+  QHash<QString, Entry> index;
+};
+
+/* Writes a .laigter zip to a seekable device, with the compression level
+ * chosen per entry: 0 stores it as is */
+class ProjectArchiveWriter
+{
+public:
+  static const int stored = 0;
+  static const int deflated = 6;
+
+public:
+  ProjectArchiveWriter();
+  ~ProjectArchiveWriter();
+
+  bool open(QIODevice *device);
+  bool add(QString name, const QByteArray &data, int level);
+  bool copy(const ProjectArchive &from, QString name);
+  bool finish();
+
+private:
+  struct State;
+  static size_t write(void *opaque, quint64 offset, const void *data, size_t n);
+
+  QIODevice *device = nullptr;
+  State *state = nullptr;
+};
+
+#endif // PROJECTARCHIVE_H
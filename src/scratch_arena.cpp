@@ -0,0 +1,192 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "scratch_arena.h"
+
+#include <QAtomicInteger>
+#include <chrono>
+#include <vector>
+
+using namespace cimg_library;
+
+static QAtomicInteger<qint64> allocation_count(0);
+static QAtomicInteger<qint64> reuse_count(0);
+static QAtomicInteger<qint64> allocated_bytes(0);
+static QAtomicInteger<qint64> free_bytes(0);
+static QAtomicInt trim_epoch(0);
+
+static const int max_planes = 16;
+static const qint64 max_bytes = 256 * 1024 * 1024;
+/* Planes not reused for this long are released */
+static const qint64 idle_ms = 10000;
+
+struct FreePlane
+{
+  CImg<float> image;
+  qint64 used;
+};
+
+/* One free list per worker thread, so borrowing never takes a lock */
+struct FreeList
+{
+  std::vector<FreePlane> planes;
+  qint64 bytes = 0;
+  int epoch = 0;
+
+  ~FreeList()
+  {
+    free_bytes.fetchAndAddRelaxed(-bytes);
+  }
+};
+
+static thread_local FreeList free_list;
+
+static qint64 now_ms()
+{
+  using namespace std::chrono;
+  return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static qint64 plane_bytes(const CImg<float> &image)
+{
+  return (qint64)image.size() * sizeof(float);
+}
+
+/* Removes a free plane, handing its buffer to into when one is given */
+static void release(FreeList &list, size_t i, CImg<float> *into = nullptr)
+{
+  qint64 bytes = plane_bytes(list.planes[i].image);
+  list.bytes -= bytes;
+  free_bytes.fetchAndAddRelaxed(-bytes);
+  if (into)
+    into->swap(list.planes[i].image);
+  list.planes.erase(list.planes.begin() + i);
+}
+
+static void tidy(FreeList &list)
+{
+  int epoch = trim_epoch.loadAcquire();
+  bool all = epoch != list.epoch;
+  list.epoch = epoch;
+
+  qint64 now = now_ms();
+  for (size_t i = list.planes.size(); i-- > 0;)
+  {
+    if (all || now - list.planes[i].used > idle_ms)
+      release(list, i);
+  }
+}
+
+ScratchArena::Plane::Plane(int width, int height, int spectrum)
+{
+  borrow(image, width, height, spectrum);
+}
+
+ScratchArena::Plane::~Plane()
+{
+  give_back(image);
+}
+
+void ScratchArena::borrow(CImg<float> &image, int width, int height, int spectrum)
+{
+  give_back(image);
+  tidy(free_list);
+
+  size_t size = (size_t)width * height * spectrum;
+  for (size_t i = 0; i < free_list.planes.size(); i++)
+  {
+    if (free_list.planes[i].image.size() == size)
+    {
+      release(free_list, i, &image);
+      /* Same element count: CImg reuses the buffer */
+      image.assign(width, height, 1, spectrum);
+      reuse_count.fetchAndAddRelaxed(1);
+      return;
+    }
+  }
+
+  allocation_count.fetchAndAddRelaxed(1);
+  allocated_bytes.fetchAndAddRelaxed(size * sizeof(float));
+  image.assign(width, height, 1, spectrum);
+}
+
+void ScratchArena::give_back(CImg<float> &image)
+{
+  if (image.is_empty() || image.is_shared())
+    return;
+
+  tidy(free_list);
+  qint64 bytes = plane_bytes(image);
+  if (bytes > max_bytes)
+  {
+    image.assign();
+    return;
+  }
+
+  while (!free_list.planes.empty() &&
+         ((int)free_list.planes.size() >= max_planes || free_list.bytes + bytes > max_bytes))
+    release(free_list, 0);
+
+  free_list.planes.push_back(FreePlane());
+  free_list.planes.back().image.swap(image);
+  free_list.planes.back().used = now_ms();
+  free_list.bytes += bytes;
+  free_bytes.fetchAndAddRelaxed(bytes);
+}
+
+qint64 ScratchArena::allocations()
+{
+  return allocation_count.loadAcquire();
+}
+
+qint64 ScratchArena::reuses()
+{
+  return reuse_count.loadAcquire();
+}
+
+qint64 ScratchArena::bytes_allocated()
+{
+  return allocated_bytes.loadAcquire();
+}
+
+void ScratchArena::reset_stats()
+{
+  allocation_count.storeRelease(0);
+  reuse_count.storeRelease(0);
+  allocated_bytes.storeRelease(0);
+}
+
+qint64 ScratchArena::resident_bytes()
+{
+  return free_bytes.loadAcquire();
+}
+
+void ScratchArena::trim()
+{
+  trim_epoch.fetchAndAddRelease(1);
+}
+
+QString ScratchArena::stats()
+{
+  return QString("scratch planes: %1 allocated (%2 bytes), %3 reused, %4 bytes kept")
+      .arg(allocations())
+      .arg(bytes_allocated())
+      .arg(reuses())
+      .arg(resident_bytes());
+}
@@ -0,0 +1,67 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef SCRATCHARENA_H
+#define SCRATCHARENA_H
+
+#include <QString>
+
+#define cimg_display 0
+#include "thirdparty/CImg.h"
+
+/* Per thread pool of float planes for the map kernels. A recompute borrows
+ * the planes it needs and gives them back, so once every worker has seen
+ * the sprite size no new buffers are allocated. Each free list is capped in
+ * bytes, forgets planes that stay unused, and is freed with its thread. */
+class ScratchArena
+{
+public:
+  /* Borrows a plane for the lifetime of the object */
+  class Plane
+  {
+  public:
+    Plane() {}
+    Plane(int width, int height, int spectrum = 1);
+    ~Plane();
+    cimg_library::CImg<float> &operator*() { return image; }
+    cimg_library::CImg<float> *operator->() { return &image; }
+
+  private:
+    Plane(const Plane &);
+    Plane &operator=(const Plane &);
+    cimg_library::CImg<float> image;
+  };
+
+public:
+  static void borrow(cimg_library::CImg<float> &image, int width, int height, int spectrum = 1);
+  static void give_back(cimg_library::CImg<float> &image);
+
+  static qint64 allocations();
+  static qint64 reuses();
+  static qint64 bytes_allocated();
+  static void reset_stats();
+  static QString stats();
+
+  /* Bytes kept in the free lists of all threads */
+  static qint64 resident_bytes();
+  /* Every thread drops its free planes the next time it uses the arena */
+  static void trim();
+};
+
+#endif // SCRATCHARENA_H
@@ -0,0 +1,83 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+
+#include "sequence_index.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <algorithm>
+
+bool SequenceIndex::split_name(const QString &name, QString *prefix, QString *postfix, qint64 *frame)
+{
+  int end = name.size();
+  while (end > 0 && !name.at(end - 1).isDigit())
+    end--;
+  if (end == 0)
+    return false;
+
+  int start = end;
+  while (start > 0 && name.at(start - 1).isDigit())
+    start--;
+
+  *prefix = name.left(start);
+  *postfix = name.mid(end);
+  *frame = name.midRef(start, end - start).toLongLong();
+  return true;
+}
+
+const SequenceIndex::Groups &SequenceIndex::directory(const QString &path)
+{
+  QHash<QString, Groups>::iterator i = directories.find(path);
+  if (i != directories.end())
+    return i.value();
+
+  Groups groups;
+  QString prefix, postfix;
+  qint64 number;
+  foreach (QString file, QDir(path).entryList(QDir::Files))
+  {
+    if (split_name(file, &prefix, &postfix, &number))
+      groups[Key(prefix, postfix)].append(Frame{number, path + "/" + file});
+  }
+
+  for (Groups::iterator g = groups.begin(); g != groups.end(); ++g)
+  {
+    std::stable_sort(g.value().begin(), g.value().end(), [](const Frame &a, const Frame &b) {
+      return a.number < b.number;
+    });
+  }
+
+  return directories.insert(path, groups).value();
+}
+
+QStringList SequenceIndex::sequence(QString file_name, QString *prefix)
+{
+  QStringList list;
+  QFileInfo info(file_name);
+  QString postfix;
+  qint64 number;
+  prefix->clear();
+  if (!split_name(info.fileName(), prefix, &postfix, &number) || prefix->isEmpty())
+    return list;
+
+  foreach (const Frame &f, directory(info.absolutePath()).value(Key(*prefix, postfix)))
+    list.append(f.path);
+  return list;
+}
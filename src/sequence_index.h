@@ -0,0 +1,57 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+
+#ifndef SEQUENCEINDEX_H
+#define SEQUENCEINDEX_H
+
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QString>
+#include <QStringList>
+
+/* Groups the files of a directory into frame sequences: names that only
+ * differ in their last run of digits share a (prefix, postfix) key. Each
+ * directory is listed and parsed once, however many of its files are
+ * looked up. */
+class SequenceIndex
+{
+public:
+  /* Files of the sequence file_name belongs to, ordered by frame number.
+   * Empty when the name has no frame number or nothing before it */
+  QStringList sequence(QString file_name, QString *prefix);
+
+  static bool split_name(const QString &name, QString *prefix, QString *postfix, qint64 *frame);
+
+private:
+  struct Frame
+  {
+    qint64 number;
+    QString path;
+  };
+  typedef QPair<QString, QString> Key;
+  typedef QHash<Key, QList<Frame>> Groups;
+
+  const Groups &directory(const QString &path);
+
+  QHash<QString, Groups> directories;
+};
+
+#endif // SEQUENCEINDEX_H
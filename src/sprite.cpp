@@ -3,6 +3,7 @@
 Sprite::Sprite()
 {
   textures.resize(17);
+  overlays.resize(6);
   neighbours_paths.resize(3);
   neighbours_paths[0].resize(3);
   neighbours_paths[1].resize(3);
@@ -12,6 +13,9 @@ Sprite::Sprite()
 Sprite::Sprite(const Sprite &S)
 {
   textures = S.textures;
+  overlays = S.overlays;
+  /* get_overlay hands out pointers, so never share the vector */
+  overlays.detach();
   fileName = S.fileName;
   heightmapPath = S.heightmapPath;
   specularPath = S.specularPath;
@@ -24,6 +28,9 @@ Sprite::Sprite(const Sprite &S)
 Sprite &Sprite::operator=(const Sprite &S)
 {
   textures = S.textures;
+  overlays = S.overlays;
+  /* get_overlay hands out pointers, so never share the vector */
+  overlays.detach();
   fileName = S.fileName;
   heightmapPath = S.heightmapPath;
   specularPath = S.specularPath;
@@ -36,16 +43,48 @@ Sprite &Sprite::operator=(const Sprite &S)
 
 void Sprite::set_image(TextureTypes type, QImage i)
 {
+  if (is_overlay(type))
+  {
+    get_overlay(type)->set_image(i);
+    return;
+  }
+
   int t = static_cast<int>(type);
   textures[t].set_image(i);
+
+  /* Overlay tile grids follow the diffuse size */
+  if (type == TextureTypes::Diffuse)
+  {
+    for (int j = 0; j < overlays.size(); j++)
+      overlays[j].set_size(i.size());
+  }
 }
 
 bool Sprite::get_image(TextureTypes type, QImage *dst)
 {
+  if (is_overlay(type))
+  {
+    *dst = get_overlay(type)->get_image();
+    return true;
+  }
+
   int t = static_cast<int>(type);
   return textures[t].get_image(dst);
 }
 
+bool Sprite::is_overlay(TextureTypes type)
+{
+  return static_cast<int>(type) >= static_cast<int>(TextureTypes::TextureOverlay);
+}
+
+TiledOverlay *Sprite::get_overlay(TextureTypes type)
+{
+  if (!is_overlay(type))
+    return nullptr;
+
+  return &overlays[static_cast<int>(type) - static_cast<int>(TextureTypes::TextureOverlay)];
+}
+
 void Sprite::set_texture(TextureTypes type, Texture t)
 {
   int tex = static_cast<int>(type);
@@ -56,6 +95,23 @@ void Sprite::set_texture(TextureTypes type, Texture t)
 
 QSize Sprite::size() { return textures[0].size(); }
 
+qint64 Sprite::resident_bytes(QSet<qint64> *seen)
+{
+  /* Slots that share pixels are only counted once */
+  qint64 total = 0;
+  for (int t = 0; t < textures.size(); t++)
+  {
+    QImage image;
+    if (!textures[t].get_image(&image) || image.isNull() || seen->contains(image.cacheKey()))
+      continue;
+    seen->insert(image.cacheKey());
+    total += image.sizeInBytes();
+  }
+  for (int o = 0; o < overlays.size(); o++)
+    total += overlays[o].bytes();
+  return total;
+}
+
 QString Sprite::get_file_name()
 {
   return fileName;
@@ -2,8 +2,10 @@
 #define SPRITE_H
 
 #include "texture.h"
+#include "tiled_overlay.h"
 
 #include <QObject>
+#include <QSet>
 
 enum class TextureTypes
 {
@@ -36,6 +38,8 @@ public:
 
 private:
   QVector<Texture> textures;
+  /* Overlay types are kept sparse, indexed from TextureOverlay */
+  QVector<TiledOverlay> overlays;
 
 public:
   explicit Sprite();
@@ -43,9 +47,12 @@ public:
   void set_image(TextureTypes type, QImage i);
   bool get_image(TextureTypes type, QImage *dst);
   void set_texture(TextureTypes type, Texture t);
+  TiledOverlay *get_overlay(TextureTypes type);
+  static bool is_overlay(TextureTypes type);
   Sprite &operator=(const Sprite &S);
   QString get_file_name();
   QSize size();
+  qint64 resident_bytes(QSet<qint64> *seen);
 };
 
 #endif // SPRITE_H
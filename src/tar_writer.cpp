@@ -0,0 +1,81 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#include "tar_writer.h"
+
+#include <QDateTime>
+#include <cstring>
+
+static const int block_size = 512;
+
+static void put_octal(char *field, int width, qint64 value)
+{
+  /* width - 1 digits and a terminating NUL */
+  QByteArray digits = QByteArray::number(value, 8).rightJustified(width - 1, '0');
+  memcpy(field, digits.constData(), width - 1);
+  field[width - 1] = '\0';
+}
+
+TarWriter::TarWriter(QIODevice *device) : device(device) {}
+
+bool TarWriter::write(const QByteArray &data)
+{
+  ok &= device->write(data) == data.size();
+  return ok;
+}
+
+bool TarWriter::add_file(QString name, const QByteArray &data)
+{
+  QByteArray path = name.toUtf8();
+  if (path.size() > 99)
+    return ok = false;
+
+  QByteArray header(block_size, '\0');
+  char *h = header.data();
+  memcpy(h, path.constData(), path.size());
+  put_octal(h + 100, 8, 0644);
+  put_octal(h + 108, 8, 0);
+  put_octal(h + 116, 8, 0);
+  put_octal(h + 124, 12, data.size());
+  put_octal(h + 136, 12, QDateTime::currentSecsSinceEpoch());
+  h[156] = '0';
+  memcpy(h + 257, "ustar", 6);
+  memcpy(h + 263, "00", 2);
+
+  /* The checksum is computed with its own field filled with spaces */
+  memset(h + 148, ' ', 8);
+  unsigned int sum = 0;
+  for (int i = 0; i < block_size; i++)
+    sum += uchar(h[i]);
+  put_octal(h + 148, 7, sum);
+  h[155] = ' ';
+
+  write(header);
+  write(data);
+  int pad = (block_size - data.size() % block_size) % block_size;
+  if (pad)
+    write(QByteArray(pad, '\0'));
+  return ok;
+}
+
+bool TarWriter::finish()
+{
+  write(QByteArray(2 * block_size, '\0'));
+  return ok;
+}
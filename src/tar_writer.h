@@ -0,0 +1,44 @@
+/*
+ * Laigter: an automatic map generator for lighting effects.
+ * Copyright (C) 2019  Pablo Ivan Fonovich
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * Contact: azagaya.games@gmail.com
+ */
+
+#ifndef TARWRITER_H
+#define TARWRITER_H
+
+#include <QByteArray>
+#include <QIODevice>
+#include <QString>
+
+/* Minimal uncompressed ustar writer. Entries are written in one pass and
+ * never revisited, so the device can be a pipe. */
+class TarWriter
+{
+public:
+  explicit TarWriter(QIODevice *device);
+
+  bool add_file(QString name, const QByteArray &data);
+  bool finish();
+
+private:
+  bool write(const QByteArray &data);
+
+  QIODevice *device;
+  bool ok = true;
+};
+
+#endif // TARWRITER_H
@@ -19,7 +19,8 @@ bool Texture::set_image(QImage i)
 {
   if (mutex.tryLock())
   {
-         image = i.copy();
+    /* Shallow copy: QImage detaches on write, so slots can share pixels */
+    image = i;
     mutex.unlock();
     return true;
   }
@@ -30,7 +31,7 @@ bool Texture::get_image(QImage *dst)
 {
   if (mutex.tryLock())
   {
-    *dst = image.copy();
+    *dst = image;
     mutex.unlock();
     return true;
   }
@@ -0,0 +1,300 @@
+#include "tiled_overlay.h"
+#include "pixel_format.h"
+
+#include <QAtomicInteger>
+#include <QCryptographicHash>
+#include <QMutexLocker>
+#include <cstring>
+
+static QAtomicInteger<quint64> generations(0);
+
+TiledOverlay::TiledOverlay() {}
+
+TiledOverlay::TiledOverlay(const TiledOverlay &T)
+{
+  /* Copies are taken to read the tiles, so decode once in the source */
+  TiledOverlay &source = const_cast<TiledOverlay &>(T);
+  QMutexLocker locker(&source.mutex);
+  source.decode_pending();
+  m_size = T.m_size;
+  tiles = T.tiles;
+  m_generation = T.m_generation;
+  m_digest = T.m_digest;
+  digest_generation = T.digest_generation;
+}
+
+TiledOverlay &TiledOverlay::operator=(const TiledOverlay &T)
+{
+  if (&T == this)
+    return *this;
+
+  QSize s;
+  QMap<int, QImage> t;
+  quint64 g, dg;
+  QByteArray d;
+  {
+    TiledOverlay &source = const_cast<TiledOverlay &>(T);
+    QMutexLocker locker(&source.mutex);
+    source.decode_pending();
+    s = T.m_size;
+    t = T.tiles;
+    g = T.m_generation;
+    d = T.m_digest;
+    dg = T.digest_generation;
+  }
+  QMutexLocker locker(&mutex);
+  m_size = s;
+  tiles = t;
+  pending.clear();
+  m_generation = g;
+  m_digest = d;
+  digest_generation = dg;
+  return *this;
+}
+
+void TiledOverlay::touch()
+{
+  /* Called with the mutex held */
+  m_generation = generations.fetchAndAddRelaxed(1) + 1;
+}
+
+int TiledOverlay::columns()
+{
+  return (m_size.width() + tile_size - 1) / tile_size;
+}
+
+int TiledOverlay::key(QPoint tile)
+{
+  return tile.y() * columns() + tile.x();
+}
+
+QPoint TiledOverlay::key_tile(int key)
+{
+  int c = columns();
+  return QPoint(key % c, key / c);
+}
+
+bool TiledOverlay::is_transparent(const QImage &image, QRect r)
+{
+  for (int y = r.top(); y <= r.bottom(); y++)
+  {
+    const uchar *src = image.constScanLine(y) + 4 * r.left() + 3;
+    for (int x = 0; x < r.width(); x++, src += 4)
+    {
+      if (*src)
+        return false;
+    }
+  }
+  return true;
+}
+
+void TiledOverlay::set_size(QSize s)
+{
+  QMutexLocker locker(&mutex);
+  if (s == m_size)
+    return;
+
+  m_size = s;
+  tiles.clear();
+  pending.clear();
+  touch();
+}
+
+QSize TiledOverlay::size()
+{
+  QMutexLocker locker(&mutex);
+  return m_size;
+}
+
+void TiledOverlay::clear()
+{
+  QMutexLocker locker(&mutex);
+  tiles.clear();
+  pending.clear();
+  touch();
+}
+
+bool TiledOverlay::is_empty()
+{
+  QMutexLocker locker(&mutex);
+  return tiles.isEmpty() && pending.isEmpty();
+}
+
+qint64 TiledOverlay::bytes()
+{
+  QMutexLocker locker(&mutex);
+  qint64 total = pending.size();
+  foreach (const QImage &t, tiles)
+    total += t.sizeInBytes();
+  return total;
+}
+
+quint64 TiledOverlay::generation()
+{
+  QMutexLocker locker(&mutex);
+  return m_generation;
+}
+
+QByteArray TiledOverlay::digest()
+{
+  QMutexLocker locker(&mutex);
+  if (!m_digest.isEmpty() && digest_generation == m_generation)
+    return m_digest;
+
+  decode_pending();
+  QCryptographicHash hash(QCryptographicHash::Sha1);
+  hash.addData(QByteArray::number(m_size.width()) + " " + QByteArray::number(m_size.height()));
+  QMap<int, QImage>::const_iterator i;
+  for (i = tiles.constBegin(); i != tiles.constEnd(); ++i)
+  {
+    const QImage &t = i.value();
+    hash.addData(" " + QByteArray::number(i.key()) + " " + QByteArray::number(t.width()) + " " +
+                 QByteArray::number(t.height()));
+    for (int y = 0; y < t.height(); y++)
+      hash.addData(reinterpret_cast<const char *>(t.constScanLine(y)), 4 * t.width());
+  }
+  m_digest = hash.result();
+  digest_generation = m_generation;
+  return m_digest;
+}
+
+QList<QPoint> TiledOverlay::allocated_tiles()
+{
+  QMutexLocker locker(&mutex);
+  decode_pending();
+  QList<QPoint> list;
+  foreach (int k, tiles.keys())
+    list.append(key_tile(k));
+  return list;
+}
+
+QRect TiledOverlay::tile_rect(QPoint tile)
+{
+  QMutexLocker locker(&mutex);
+  QRect r(tile.x() * tile_size, tile.y() * tile_size, tile_size, tile_size);
+  return r.intersected(QRect(QPoint(0, 0), m_size));
+}
+
+QImage TiledOverlay::tile(QPoint tile)
+{
+  QMutexLocker locker(&mutex);
+  decode_pending();
+  return tiles.value(key(tile));
+}
+
+void TiledOverlay::set_tile(QPoint tile, QImage image)
+{
+  QRect r = tile_rect(tile);
+  if (r.isEmpty())
+    return;
+
+  QMutexLocker locker(&mutex);
+  decode_pending();
+  touch();
+  int k = key(tile);
+  if (image.isNull())
+  {
+    tiles.remove(k);
+    return;
+  }
+
+  image = PixelFormat::toCanonical(image, "TiledOverlay::set_tile");
+  if (image.size() != r.size())
+    image = image.copy(0, 0, r.width(), r.height());
+
+  /* A tile wiped back to transparent releases its memory */
+  if (is_transparent(image, image.rect()))
+    tiles.remove(k);
+  else
+    tiles.insert(k, image);
+}
+
+void TiledOverlay::set_image(QImage image)
+{
+  QMutexLocker locker(&mutex);
+  pending.clear();
+  fill_tiles(image);
+  touch();
+}
+
+void TiledOverlay::set_encoded(QByteArray data, QByteArray digest)
+{
+  QMutexLocker locker(&mutex);
+  tiles.clear();
+  pending = data;
+  touch();
+  m_digest = digest;
+  digest_generation = m_generation;
+}
+
+QByteArray TiledOverlay::encoded()
+{
+  QMutexLocker locker(&mutex);
+  return pending;
+}
+
+void TiledOverlay::decode_pending()
+{
+  /* Called with the mutex held */
+  if (pending.isEmpty())
+    return;
+
+  QImage image = QImage::fromData(pending);
+  pending.clear();
+  fill_tiles(image);
+}
+
+void TiledOverlay::fill_tiles(QImage image)
+{
+  tiles.clear();
+  if (image.isNull())
+    return;
+
+  image = PixelFormat::toCanonical(image, "TiledOverlay::set_image");
+  m_size = image.size();
+  QRect bounds = image.rect();
+  for (int y = 0; y < m_size.height(); y += tile_size)
+  {
+    for (int x = 0; x < m_size.width(); x += tile_size)
+    {
+      QRect r = QRect(x, y, tile_size, tile_size).intersected(bounds);
+      if (!is_transparent(image, r))
+        tiles.insert(key(QPoint(x / tile_size, y / tile_size)), image.copy(r));
+    }
+  }
+}
+
+QImage TiledOverlay::get_image()
+{
+  QSize s = size();
+  if (is_empty())
+    return QImage();
+
+  return get_region(QRect(QPoint(0, 0), s));
+}
+
+QImage TiledOverlay::get_region(QRect r)
+{
+  QImage region(r.size(), PixelFormat::canonical);
+  region.fill(Qt::transparent);
+
+  QMutexLocker locker(&mutex);
+  decode_pending();
+  QMap<int, QImage>::const_iterator i;
+  for (i = tiles.constBegin(); i != tiles.constEnd(); ++i)
+  {
+    QPoint t = key_tile(i.key());
+    QRect tr(t.x() * tile_size, t.y() * tile_size, i.value().width(), i.value().height());
+    QRect common = tr.intersected(r);
+    if (common.isEmpty())
+      continue;
+
+    for (int y = common.top(); y <= common.bottom(); y++)
+    {
+      const uchar *src = i.value().constScanLine(y - tr.top()) + 4 * (common.left() - tr.left());
+      uchar *dst = region.scanLine(y - r.top()) + 4 * (common.left() - r.left());
+      memcpy(dst, src, 4 * common.width());
+    }
+  }
+  return region;
+}
@@ -0,0 +1,68 @@
+#ifndef TILEDOVERLAY_H
+#define TILEDOVERLAY_H
+
+#include <QImage>
+#include <QByteArray>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QPoint>
+#include <QRect>
+
+/* Painted overlay stored as tile_size x tile_size tiles in the canonical
+ * pixel format. Only tiles that hold some paint are allocated. */
+class TiledOverlay
+{
+public:
+  static const int tile_size = 64;
+
+public:
+  TiledOverlay();
+  TiledOverlay(const TiledOverlay &T);
+  TiledOverlay &operator=(const TiledOverlay &T);
+
+  void set_size(QSize s);
+  QSize size();
+  void clear();
+  bool is_empty();
+  qint64 bytes();
+  /* Changes with every edit and is kept by copies, so equal generations
+   * mean equal content */
+  quint64 generation();
+  /* Hash of the content, computed once per generation. An encoded image
+   * can carry the one it was saved with, so it is not decoded for it */
+  QByteArray digest();
+
+  QList<QPoint> allocated_tiles();
+  QRect tile_rect(QPoint tile);
+  QImage tile(QPoint tile);
+  void set_tile(QPoint tile, QImage image);
+
+  void set_image(QImage image);
+  /* Keeps an encoded image (as stored in a project) and only decodes it
+   * the first time the tiles are read */
+  void set_encoded(QByteArray data, QByteArray digest = QByteArray());
+  /* The encoded image while it has not been decoded yet, or nothing */
+  QByteArray encoded();
+  QImage get_image();
+  QImage get_region(QRect r);
+
+private:
+  int columns();
+  int key(QPoint tile);
+  QPoint key_tile(int key);
+  static bool is_transparent(const QImage &image, QRect r);
+  void fill_tiles(QImage image);
+  void decode_pending();
+  void touch();
+
+  QMutex mutex;
+  QSize m_size;
+  QMap<int, QImage> tiles;
+  QByteArray pending;
+  quint64 m_generation = 0;
+  QByteArray m_digest;
+  quint64 digest_generation = 0;
+};
+
+#endif // TILEDOVERLAY_H